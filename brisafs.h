@@ -0,0 +1,66 @@
+/*
+ * Interface em C do núcleo do BrisaFS, para usar o sistema de arquivos
+ * dentro do próprio processo, sem montá-lo com o FUSE (ex. brisafs_bench).
+ *
+ * O brisafs_v2.c compilado com -DBRISAFS_BIBLIOTECA fica sem o main e
+ * pode ser ligado a outro programa:
+ *
+ *   gcc -O2 -DBRISAFS_BIBLIOTECA -c -o brisafs.o brisafs_v2.c
+ *   gcc -O2 -o programa programa.c brisafs.o -lfuse -lpthread
+ *
+ * O libfuse continua necessário só pelas funções de cópia de buffers.
+ * Cada função chama a operação correspondente da tabela do FUSE, com as
+ * mesmas travas, o mesmo journal e as mesmas estatísticas de uma montagem
+ * de verdade, e devolve o mesmo valor: 0 (ou bytes transferidos) em caso
+ * de sucesso ou um código de erro negativo. Só uma imagem pode estar
+ * montada por vez em cada processo.
+ */
+
+#ifndef BRISAFS_H
+#define BRISAFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Arquivo aberto, entre brisafs_abre (ou brisafs_cria) e brisafs_fecha */
+typedef struct brisafs_arquivo brisafs_arquivo;
+
+/* Chamada por brisafs_lista para cada entrada do diretório, inclusive
+   "." e "..". O valor devolvido é ignorado */
+typedef int (*brisafs_entrada_t) (void *contexto, const char *nome);
+
+/* Monta a imagem (criada e formatada se não existir), com mmap se
+   usa_mmap for diferente de 0 */
+int brisafs_monta (const char *imagem, int usa_mmap);
+/* Descarrega tudo na imagem, como na desmontagem pelo FUSE */
+void brisafs_desmonta (void);
+/* Limita a bytes o cache de blocos de dados da próxima montagem, como
+   -o cache=<tamanho> (implica mmap). 0 tira o limite */
+void brisafs_limita_cache (uint64_t bytes);
+
+int brisafs_cria (const char *path, mode_t mode, brisafs_arquivo **arquivo);
+int brisafs_abre (const char *path, int flags, brisafs_arquivo **arquivo);
+int brisafs_le (brisafs_arquivo *arquivo, void *buf, size_t size, off_t offset);
+int brisafs_escreve (brisafs_arquivo *arquivo, const void *buf, size_t size, off_t offset);
+int brisafs_fsync (brisafs_arquivo *arquivo);
+/* lseek com SEEK_DATA ou SEEK_HOLE: devolve o offset encontrado ou um
+   código de erro negativo (-ENXIO além do fim ou sem mais dados) */
+off_t brisafs_busca (brisafs_arquivo *arquivo, off_t offset, int whence);
+int brisafs_fallocate (brisafs_arquivo *arquivo, int mode, off_t offset, off_t length);
+/* Fecha e libera o arquivo, mesmo em caso de erro */
+int brisafs_fecha (brisafs_arquivo *arquivo);
+
+int brisafs_stat (const char *path, struct stat *st);
+int brisafs_lista (const char *path, brisafs_entrada_t entrada, void *contexto);
+int brisafs_mkdir (const char *path, mode_t mode);
+int brisafs_unlink (const char *path);
+int brisafs_rmdir (const char *path);
+int brisafs_truncate (const char *path, off_t size);
+int brisafs_mknod (const char *path, mode_t mode);
+int brisafs_chmod (const char *path, mode_t mode);
+int brisafs_chown (const char *path, uid_t uid, gid_t gid);
+int brisafs_utimens (const char *path, const struct timespec ts[2]);
+
+#endif
@@ -0,0 +1,393 @@
+/*
+ * brisafs_bench: mede o núcleo do BrisaFS dentro do próprio processo, pela
+ * interface de brisafs.h, sem o custo das idas e voltas ao kernel de uma
+ * montagem pelo FUSE.
+ *
+ * Uso: brisafs_bench [-m] [-k] [-i imagem] [-t threads] [-n ops] [-s tamanho]
+ *                    [-d entradas] [-c cache] [carga...]
+ *   -m  monta a imagem com mmap
+ *   -k  usa a imagem existente; sem ela a imagem é apagada e recriada com a
+ *       geometria padrão (use o mkfs.brisafs e -k para outra geometria)
+ *   -i  imagem (padrão bench.img)
+ *   -t  threads por carga (padrão 1), cada uma com os seus arquivos
+ *   -n  operações de criacao, aleatoria e stat (padrão 10000); readdir
+ *       lista o diretório n / 100 vezes
+ *   -s  bytes escritos e lidos por seq_escrita e seq_leitura, com sufixo K,
+ *       M ou G opcional (padrão 64M)
+ *   -d  entradas do diretório listado por readdir (padrão 10000)
+ *   -c  limita o cache de blocos de dados, com sufixo K, M ou G (como
+ *       -o cache=; implica -m)
+ *
+ * Cargas (padrão: todas, nesta ordem):
+ *   criacao      cria e fecha arquivos vazios num mesmo diretório
+ *   seq          seq_escrita e seq_leitura com 4K, 64K e 1M por operação
+ *   aleatoria    leituras e escritas de 4K em posições aleatórias
+ *   stat         getattr de um arquivo 16 diretórios abaixo da raiz
+ *   readdir      lista um diretório com -d entradas
+ *
+ * Cada carga gera uma linha com a quantidade de operações, operações por
+ * segundo (tempo total, com todas as threads) e os percentis de latência
+ * de uma operação, em microssegundos.
+ *
+ * Compilação:
+ *   gcc -O2 -DBRISAFS_BIBLIOTECA -c -o brisafs.o brisafs_v2.c
+ *   gcc -O2 -o brisafs_bench brisafs_bench.c brisafs.o -lfuse -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "brisafs.h"
+
+#define PROFUNDIDADE 16
+
+static int n_threads = 1;
+static uint64_t n_ops = 10000;
+static uint64_t tamanho_seq = 64 << 20;
+static uint64_t n_entradas = 10000;
+
+static void uso (const char *prog) {
+  fprintf (stderr, "Uso: %s [-m] [-k] [-i imagem] [-t threads] [-n ops] [-s tamanho] "
+           "[-d entradas] [-c cache] [carga...]\n", prog);
+  exit (2);
+}
+
+// Lê um número com sufixo K, M ou G opcional. Devolve 0 se for inválido
+static uint64_t le_tamanho (const char *s) {
+  char *fim;
+  errno = 0;
+  uint64_t n = strtoull (s, &fim, 10);
+  if (errno != 0 || fim == s)
+    return 0;
+  switch (*fim) {
+  case 'G': case 'g': n <<= 10; // fall through
+  case 'M': case 'm': n <<= 10; // fall through
+  case 'K': case 'k': n <<= 10; fim++; break;
+  }
+  return *fim == '\0' ? n : 0;
+}
+
+static uint64_t relogio_ns (void) {
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1000000000u + t.tv_nsec;
+}
+
+static void falha (const char *o_que, const char *path, int erro) {
+  fprintf (stderr, "%s %s: %s\n", o_que, path, strerror (-erro));
+  exit (1);
+}
+
+/* Uma carga: prepara é chamada por cada thread antes de começar a medição
+   e termina depois dela (ambas opcionais); operacao executa a operação i
+   da thread. As latências de cada thread ficam na sua faixa de latencias */
+typedef struct {
+  const char *nome;
+  uint64_t ops_thread;
+  void (*prepara) (int thread);
+  void (*operacao) (int thread, uint64_t i);
+  void (*termina) (int thread);
+  uint64_t *latencias;
+  uint64_t inicio[256], fim[256]; // da medição de cada thread
+  pthread_barrier_t largada;
+} carga;
+
+static carga *atual;
+
+static void *executa_thread (void *p) {
+  int t = (int) (intptr_t) p;
+  carga *c = atual;
+  if (c->prepara != NULL)
+    c->prepara (t);
+  pthread_barrier_wait (&c->largada);
+  uint64_t *lat = c->latencias + t * c->ops_thread;
+  c->inicio[t] = relogio_ns ();
+  for (uint64_t i = 0; i < c->ops_thread; i++) {
+    uint64_t ini = relogio_ns ();
+    c->operacao (t, i);
+    lat[i] = relogio_ns () - ini;
+  }
+  c->fim[t] = relogio_ns ();
+  if (c->termina != NULL)
+    c->termina (t);
+  return NULL;
+}
+
+static int compara_u64 (const void *a, const void *b) {
+  uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentil (const uint64_t *v, uint64_t n, double p) {
+  uint64_t i = (uint64_t) (p * (n - 1) + 0.5);
+  return v[i] / 1000.0;
+}
+
+/* Executa a carga em n_threads threads e imprime a sua linha. O tempo total
+   vai da largada (todas as threads preparadas) até a última terminar, pelos
+   relógios das próprias threads: a thread principal pode sair da barreira
+   depois que elas já acabaram */
+static void mede (carga *c) {
+  uint64_t total = c->ops_thread * n_threads;
+  c->latencias = malloc ((total > 0 ? total : 1) * sizeof(uint64_t));
+  pthread_t threads[n_threads];
+  pthread_barrier_init (&c->largada, NULL, n_threads + 1);
+  atual = c;
+  for (int t = 0; t < n_threads; t++)
+    pthread_create (&threads[t], NULL, executa_thread, (void*) (intptr_t) t);
+  pthread_barrier_wait (&c->largada);
+  for (int t = 0; t < n_threads; t++)
+    pthread_join (threads[t], NULL);
+  uint64_t ini = c->inicio[0], fim = c->fim[0];
+  for (int t = 1; t < n_threads; t++) {
+    if (c->inicio[t] < ini)
+      ini = c->inicio[t];
+    if (c->fim[t] > fim)
+      fim = c->fim[t];
+  }
+  double segundos = (fim > ini ? fim - ini : 1) / 1e9;
+  pthread_barrier_destroy (&c->largada);
+
+  if (total > 0) {
+    qsort (c->latencias, total, sizeof(uint64_t), compara_u64);
+    printf ("%-18s %10lu %12.0f %9.1f %9.1f %9.1f %9.1f\n", c->nome, total,
+            total / segundos, percentil (c->latencias, total, 0.5),
+            percentil (c->latencias, total, 0.9), percentil (c->latencias, total, 0.99),
+            c->latencias[total - 1] / 1000.0);
+    fflush (stdout);
+  }
+  free (c->latencias);
+}
+
+/* criacao */
+static void cria_um (int t, uint64_t i) {
+  char path[64];
+  brisafs_arquivo *a;
+  snprintf (path, sizeof(path), "/criacao/t%d_%lu", t, i);
+  int erro = brisafs_cria (path, 0644, &a);
+  if (erro < 0)
+    falha ("create", path, erro);
+  brisafs_fecha (a);
+}
+
+static void carga_criacao (void) {
+  brisafs_mkdir ("/criacao", 0755);
+  carga c = { "criacao", n_ops / n_threads, NULL, cria_um, NULL };
+  mede (&c);
+}
+
+/* seq_escrita e seq_leitura: cada thread tem o seu arquivo e o seu buffer */
+static brisafs_arquivo *arquivos[256];
+static char *buffers[256];
+static size_t tam_op;
+
+static void caminho_seq (int t, char *path, size_t n) {
+  snprintf (path, n, "/seq%d", t);
+}
+
+static void abre_seq (int t) {
+  char path[32];
+  caminho_seq (t, path, sizeof(path));
+  int erro = brisafs_abre (path, O_RDWR, &arquivos[t]);
+  if (erro == -ENOENT)
+    erro = brisafs_cria (path, 0644, &arquivos[t]);
+  if (erro < 0)
+    falha ("open", path, erro);
+  buffers[t] = malloc (tam_op);
+  memset (buffers[t], 'a' + t % 26, tam_op);
+}
+
+static void fecha_seq (int t) {
+  brisafs_fecha (arquivos[t]);
+  free (buffers[t]);
+}
+
+static void escreve_seq (int t, uint64_t i) {
+  int erro = brisafs_escreve (arquivos[t], buffers[t], tam_op, i * tam_op);
+  if (erro < 0)
+    falha ("write", "seq", erro);
+}
+
+static void le_seq (int t, uint64_t i) {
+  int erro = brisafs_le (arquivos[t], buffers[t], tam_op, i * tam_op);
+  if (erro < 0)
+    falha ("read", "seq", erro);
+}
+
+static void carga_seq (void) {
+  static const size_t tamanhos[] = { 4096, 65536, 1 << 20 };
+  for (int k = 0; k < 3; k++) {
+    char nome_e[32], nome_l[32];
+    tam_op = tamanhos[k];
+    snprintf (nome_e, sizeof(nome_e), "seq_escrita_%zuk", tam_op >> 10);
+    snprintf (nome_l, sizeof(nome_l), "seq_leitura_%zuk", tam_op >> 10);
+    uint64_t ops = tamanho_seq / n_threads / tam_op;
+    carga e = { nome_e, ops, abre_seq, escreve_seq, fecha_seq };
+    mede (&e);
+    carga l = { nome_l, ops, abre_seq, le_seq, fecha_seq };
+    mede (&l);
+    for (int t = 0; t < n_threads; t++) {
+      char path[32];
+      caminho_seq (t, path, sizeof(path));
+      brisafs_unlink (path);
+    }
+  }
+}
+
+/* aleatoria: metade leituras, metade escritas de 4K alinhadas, num
+   arquivo de -s bytes por thread escrito antes da medição */
+static unsigned sementes[256];
+
+static void prepara_aleatoria (int t) {
+  tam_op = 1 << 20;
+  abre_seq (t);
+  for (uint64_t o = 0; o < tamanho_seq / n_threads; o += tam_op)
+    escreve_seq (t, o / tam_op);
+  brisafs_fsync (arquivos[t]);
+  sementes[t] = t + 1;
+}
+
+static void opera_aleatoria (int t, uint64_t i) {
+  uint64_t blocos = tamanho_seq / n_threads / 4096;
+  off_t pos = (off_t) (rand_r (&sementes[t]) % blocos) * 4096;
+  int erro = (i & 1) ? brisafs_escreve (arquivos[t], buffers[t], 4096, pos)
+                     : brisafs_le (arquivos[t], buffers[t], 4096, pos);
+  if (erro < 0)
+    falha ((i & 1) ? "write" : "read", "aleatoria", erro);
+}
+
+static void carga_aleatoria (void) {
+  carga c = { "aleatoria_4k", n_ops / n_threads, prepara_aleatoria, opera_aleatoria, fecha_seq };
+  mede (&c);
+  for (int t = 0; t < n_threads; t++) {
+    char path[32];
+    caminho_seq (t, path, sizeof(path));
+    brisafs_unlink (path);
+  }
+}
+
+/* stat */
+static char caminho_fundo[PROFUNDIDADE * 4 + 16];
+
+static void stat_fundo (int t, uint64_t i) {
+  struct stat st;
+  int erro = brisafs_stat (caminho_fundo, &st);
+  if (erro < 0)
+    falha ("getattr", caminho_fundo, erro);
+}
+
+static void carga_stat (void) {
+  char *p = caminho_fundo;
+  for (int k = 0; k < PROFUNDIDADE; k++) {
+    p += sprintf (p, "/p%02d", k);
+    brisafs_mkdir (caminho_fundo, 0755);
+  }
+  strcpy (p, "/arquivo");
+  brisafs_arquivo *a;
+  if (brisafs_cria (caminho_fundo, 0644, &a) == 0)
+    brisafs_fecha (a);
+  carga c = { "stat_profundo", n_ops / n_threads, NULL, stat_fundo, NULL };
+  mede (&c);
+}
+
+/* readdir */
+static int conta_entrada (void *contexto, const char *nome) {
+  (*(uint64_t*) contexto)++;
+  return 0;
+}
+
+static void lista_grande (int t, uint64_t i) {
+  uint64_t n = 0;
+  int erro = brisafs_lista ("/grande", conta_entrada, &n);
+  if (erro < 0 || n != n_entradas + 2) {
+    fprintf (stderr, "readdir /grande: %lu entradas (%d)\n", n, erro);
+    exit (1);
+  }
+}
+
+static void carga_readdir (void) {
+  brisafs_mkdir ("/grande", 0755);
+  for (uint64_t i = 0; i < n_entradas; i++) {
+    char path[64];
+    brisafs_arquivo *a;
+    snprintf (path, sizeof(path), "/grande/entrada_%lu", i);
+    int erro = brisafs_cria (path, 0644, &a);
+    if (erro < 0 && erro != -EEXIST)
+      falha ("create", path, erro);
+    if (erro == 0)
+      brisafs_fecha (a);
+  }
+  uint64_t ops = n_ops / 100 / n_threads;
+  carga c = { "readdir", ops > 0 ? ops : 1, NULL, lista_grande, NULL };
+  mede (&c);
+}
+
+static const struct {
+  const char *nome;
+  void (*executa) (void);
+} cargas[] = {
+  { "criacao", carga_criacao },
+  { "seq", carga_seq },
+  { "aleatoria", carga_aleatoria },
+  { "stat", carga_stat },
+  { "readdir", carga_readdir },
+};
+#define N_CARGAS (sizeof(cargas) / sizeof(cargas[0]))
+
+int main (int argc, char *argv[]) {
+  const char *imagem = "bench.img";
+  int usa_mmap = 0, manter = 0, opt;
+  uint64_t cache = 0;
+
+  while ((opt = getopt (argc, argv, "mki:t:n:s:d:c:")) != -1) {
+    switch (opt) {
+    case 'm': usa_mmap = 1; break;
+    case 'k': manter = 1; break;
+    case 'i': imagem = optarg; break;
+    case 't': n_threads = atoi (optarg); break;
+    case 'n': n_ops = le_tamanho (optarg); break;
+    case 's': tamanho_seq = le_tamanho (optarg); break;
+    case 'd': n_entradas = le_tamanho (optarg); break;
+    case 'c':
+      cache = le_tamanho (optarg);
+      if (cache == 0)
+        uso (argv[0]);
+      break;
+    default: uso (argv[0]);
+    }
+  }
+  if (n_threads < 1 || n_threads > 256 || n_ops == 0 || tamanho_seq < (1 << 20) * (uint64_t) n_threads)
+    uso (argv[0]);
+  for (int i = optind; i < argc; i++) {
+    size_t k = 0;
+    while (k < N_CARGAS && strcmp (argv[i], cargas[k].nome) != 0)
+      k++;
+    if (k == N_CARGAS)
+      uso (argv[0]);
+  }
+
+  if (!manter)
+    unlink (imagem);
+  brisafs_limita_cache (cache);
+  if (brisafs_monta (imagem, usa_mmap) < 0)
+    return 1;
+
+  printf ("%-18s %10s %12s %9s %9s %9s %9s\n", "carga", "ops", "ops/s",
+          "p50_us", "p90_us", "p99_us", "max_us");
+  for (size_t k = 0; k < N_CARGAS; k++) {
+    int escolhida = optind == argc;
+    for (int i = optind; i < argc; i++)
+      escolhida |= strcmp (argv[i], cargas[k].nome) == 0;
+    if (escolhida)
+      cargas[k].executa ();
+  }
+
+  brisafs_desmonta ();
+  return 0;
+}
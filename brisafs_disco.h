@@ -0,0 +1,133 @@
+/*
+ * Formato da imagem do BrisaFS.
+ *
+ * O primeiro bloco da imagem guarda o cabeçalho abaixo, com a geometria
+ * escolhida na formatação (veja mkfs_brisafs.c). Tudo o mais é calculado
+ * a partir dele por calcula_geometria, na mesma ordem usada no disco:
+ *
+ *   bloco 0            cabeçalho da imagem
+ *   superbloco         n_inodes inodes de TAM_INODE bytes
+ *   mapa de blocos     um bit por bloco da imagem
+ *   mapa de inodes     um bit por inode
+ *   journal            n_blocos_journal blocos
+ *   dados              até o fim da imagem
+ *
+ * O cabeçalho fica sempre nos primeiros bytes do arquivo, de modo que
+ * pode ser lido antes de se conhecer o tamanho do bloco.
+ */
+
+#ifndef BRISAFS_DISCO_H
+#define BRISAFS_DISCO_H
+
+#include <stdint.h>
+#include <errno.h>
+
+#define IMAGEM_PADRAO "hdd1"
+#define MAGICO_DISCO 0x46535242u // "BRSF"
+/* Versão 1: números de bloco e de inode de 16 bits.
+   Versão 2: números de 32 bits e tamanhos de arquivo de 64.
+   Versão 3: inodes de 64 bytes, com os nomes nas entradas de diretório e
+   o índice dos diretórios em até dois níveis */
+#define VERSAO_DISCO 3
+#define TAM_INODE 64
+
+/* Características opcionais da imagem. Uma imagem com alguma
+   característica desconhecida não é montada */
+#define CARAC_JOURNAL 0x1u // Journal de metadados
+#define CARACTERISTICAS_SUPORTADAS (CARAC_JOURNAL)
+
+/* Limites do formato: o tamanho do bloco é uma potência de 2 entre
+   TAM_BLOCO_MIN e TAM_BLOCO_MAX. Blocos e inodes são numerados em 32 bits
+   e o último número de inode fica reservado para "não encontrado" */
+#define TAM_BLOCO_MIN 1024
+#define TAM_BLOCO_MAX 65536
+#define MAX_INODES (UINT32_MAX - 1)
+
+/* Geometria de uma imagem criada sem o mkfs.brisafs */
+#define TAM_BLOCO_PADRAO 4096
+#define N_INODES_PADRAO 62500
+/* O mkfs.brisafs não cria mais inodes que isso sem -i: cada inode custa
+   uma trava em memória durante a montagem */
+#define N_INODES_MAX_PADRAO (1u << 20)
+#define TAM_JOURNAL_PADRAO (4 << 20) // bytes
+
+typedef struct {
+    uint32_t magico;
+    uint32_t versao;
+    uint32_t tam_bloco;        // bytes
+    uint32_t caracteristicas;  // CARAC_*
+    uint64_t n_blocos;         // total da imagem, contando o bloco 0
+    uint64_t n_inodes;
+    uint32_t n_blocos_journal;
+    uint32_t reservado[7];
+} cabecalho_disco; // 64 bytes
+
+/* Geometria em memória, derivada do cabeçalho */
+typedef struct {
+    uint32_t tam_bloco;
+    uint32_t n_blocos;
+    uint32_t n_inodes;
+    uint32_t n_superblocks;
+    uint32_t n_mapa_blocos;
+    uint32_t n_mapa_inodes;
+    uint32_t n_blocos_journal;
+    uint32_t inicio_superbloco;
+    uint32_t inicio_mapa_blocos;
+    uint32_t inicio_mapa_inodes;
+    uint32_t inicio_journal;
+    uint32_t inicio_dados;
+} geometria;
+
+/* Preenche um cabeçalho com tam_bloco e n_inodes e o tamanho de journal
+   padrão. n_blocos fica com o mínimo que deixa um bloco de dados por inode */
+static inline void cabecalho_padrao (cabecalho_disco *c, uint32_t tam_bloco, uint64_t n_inodes) {
+  *c = (cabecalho_disco) {0};
+  c->magico = MAGICO_DISCO;
+  c->versao = VERSAO_DISCO;
+  c->tam_bloco = tam_bloco;
+  c->caracteristicas = CARAC_JOURNAL;
+  c->n_inodes = n_inodes;
+  c->n_blocos_journal = TAM_JOURNAL_PADRAO / tam_bloco;
+  uint64_t bits = 8 * (uint64_t) tam_bloco;
+  uint64_t meta = 1 + (n_inodes * TAM_INODE + tam_bloco - 1) / tam_bloco +
+    (n_inodes + bits - 1) / bits + c->n_blocos_journal;
+  // O mapa de blocos cobre também os seus próprios blocos
+  uint64_t n = meta + n_inodes, mapa = 0;
+  while (mapa < (n + mapa + bits - 1) / bits)
+    mapa++;
+  c->n_blocos = n + mapa;
+}
+
+/* Confere o cabeçalho e calcula a posição de cada região da imagem.
+   Devolve 0 ou um código de erro negativo */
+static inline int calcula_geometria (const cabecalho_disco *c, geometria *g) {
+  if (c->magico != MAGICO_DISCO)
+    return -EINVAL;
+  if (c->versao != VERSAO_DISCO || (c->caracteristicas & ~CARACTERISTICAS_SUPORTADAS) != 0)
+    return -EPROTONOSUPPORT;
+  if (c->tam_bloco < TAM_BLOCO_MIN || c->tam_bloco > TAM_BLOCO_MAX ||
+      (c->tam_bloco & (c->tam_bloco - 1)) != 0 ||
+      c->n_inodes < 2 || c->n_inodes > MAX_INODES ||
+      c->n_blocos_journal < 8 || c->n_blocos > UINT32_MAX)
+    return -EINVAL;
+
+  uint64_t bits = 8 * (uint64_t) c->tam_bloco;
+  g->tam_bloco = c->tam_bloco;
+  g->n_blocos = c->n_blocos;
+  g->n_inodes = c->n_inodes;
+  g->n_superblocks = (c->n_inodes * TAM_INODE + c->tam_bloco - 1) / c->tam_bloco;
+  g->n_mapa_blocos = (c->n_blocos + bits - 1) / bits;
+  g->n_mapa_inodes = (c->n_inodes + bits - 1) / bits;
+  g->n_blocos_journal = c->n_blocos_journal;
+  g->inicio_superbloco = 1;
+  g->inicio_mapa_blocos = g->inicio_superbloco + g->n_superblocks;
+  g->inicio_mapa_inodes = g->inicio_mapa_blocos + g->n_mapa_blocos;
+  g->inicio_journal = g->inicio_mapa_inodes + g->n_mapa_inodes;
+  g->inicio_dados = g->inicio_journal + g->n_blocos_journal;
+  // Pelo menos o diretório raiz (dois blocos) precisa caber
+  if ((uint64_t) g->inicio_mapa_inodes + g->n_mapa_inodes + g->n_blocos_journal + 2 > c->n_blocos)
+    return -ENOSPC;
+  return 0;
+}
+
+#endif
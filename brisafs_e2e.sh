@@ -0,0 +1,230 @@
+#!/bin/bash
+#
+# brisafs_e2e.sh: mede o BrisaFS montado pelo FUSE, de ponta a ponta, com
+# cargas de dados e de metadados. Cada execução cria uma imagem nova com o
+# mkfs.brisafs, monta-a num diretório temporário e desmonta no final.
+#
+# Uso: brisafs_e2e.sh [-m] [-b brisafs] [-f mkfs.brisafs] [-s tamanho]
+#                     [-p processos] [-n arquivos] [-D diretório] [carga...]
+#   -m  monta com -o mmap
+#   -b  binário do BrisaFS (padrão ./brisafs)
+#   -f  binário do mkfs.brisafs (padrão ./mkfs.brisafs)
+#   -s  tamanho da imagem, como no mkfs.brisafs -s (padrão 2G)
+#   -p  processos de anexa e de aleatoria (padrão 4)
+#   -n  arquivos de pequenos e da árvore de untar (padrão 5000)
+#   -D  roda as cargas em um diretório já existente, sem montar nada
+#       (ex. um tmpfs, para comparação)
+#
+# Cargas (padrão: todas, nesta ordem):
+#   seq        escreve e lê de volta um arquivo de 256M com dd, blocos de 1M
+#   aleatoria  leituras e escritas aleatórias de 4K com o fio (só se ele
+#              estiver instalado)
+#   untar      extrai uma árvore de fontes sintética (diretórios com
+#              arquivos de 1K a 32K) de um tar fora da montagem
+#   stat       find -exec stat sobre a árvore extraída
+#   anexa      processos simultâneos anexando 4K por vez, cada um ao seu
+#              arquivo
+#   pequenos   cria, lê e apaga arquivos de 1K num único diretório
+#
+# A saída padrão tem uma linha JSON por medição, com a carga, a fase, a
+# duração em segundos, a quantidade de operações (ou de arquivos) e os
+# bytes transferidos, para ser comparada entre execuções. Mensagens vão
+# para a saída de erros.
+#
+# Compilação dos binários, no diretório dos fontes (precisa da libfuse 2.9
+# e do seu pkg-config):
+#   gcc -O2 -o brisafs brisafs_v2.c $(pkg-config fuse --cflags --libs) -lpthread
+#   gcc -O2 -o mkfs.brisafs mkfs_brisafs.c
+#
+# A montagem precisa de /dev/fuse e do fusermount (ou de root para o
+# umount). As cargas usam dd, tar, find e stat; o fio é opcional.
+
+set -e
+
+BRISAFS=./brisafs
+MKFS=./mkfs.brisafs
+MMAP=
+TAMANHO=2G
+PROCESSOS=4
+ARQUIVOS=5000
+DIRETORIO=
+
+uso () {
+  echo "Uso: $0 [-m] [-b brisafs] [-f mkfs.brisafs] [-s tamanho] [-p processos]" \
+       "[-n arquivos] [-D diretório] [carga...]" >&2
+  exit 2
+}
+
+while getopts "mb:f:s:p:n:D:" opt; do
+  case $opt in
+    m) MMAP=",mmap" ;;
+    b) BRISAFS=$OPTARG ;;
+    f) MKFS=$OPTARG ;;
+    s) TAMANHO=$OPTARG ;;
+    p) PROCESSOS=$OPTARG ;;
+    n) ARQUIVOS=$OPTARG ;;
+    D) DIRETORIO=$OPTARG ;;
+    *) uso ;;
+  esac
+done
+shift $((OPTIND - 1))
+CARGAS=${*:-seq aleatoria untar stat anexa pequenos}
+for c in $CARGAS; do
+  case $c in
+    seq|aleatoria|untar|stat|anexa|pequenos) ;;
+    *) uso ;;
+  esac
+done
+
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/brisafs_e2e.XXXXXX")
+PID=
+
+desmonta () {
+  if [ -z "$DIRETORIO" ] && mountpoint -q "$TMP/mnt"; then
+    fusermount -u "$TMP/mnt" || umount "$TMP/mnt"
+  fi
+  if [ -n "$PID" ]; then
+    wait "$PID" || true
+  fi
+  rm -rf "$TMP"
+}
+trap desmonta EXIT
+
+if [ -n "$DIRETORIO" ]; then
+  MNT=$DIRETORIO/brisafs_e2e.$$
+  mkdir "$MNT"
+  trap 'rm -rf "$MNT"; desmonta' EXIT
+else
+  for b in "$BRISAFS" "$MKFS"; do
+    if [ ! -x "$b" ]; then
+      echo "$b não encontrado; veja a compilação no início de $0" >&2
+      exit 1
+    fi
+  done
+  MNT=$TMP/mnt
+  mkdir "$MNT"
+  "$MKFS" -s "$TAMANHO" "$TMP/imagem" >&2
+  # Em primeiro plano, para que o fim do processo marque a desmontagem
+  "$BRISAFS" -f -o "imagem=$TMP/imagem$MMAP" "$MNT" >&2 &
+  PID=$!
+  for _ in $(seq 100); do
+    mountpoint -q "$MNT" && break
+    kill -0 "$PID" 2> /dev/null || { echo "O BrisaFS não montou" >&2; exit 1; }
+    sleep 0.1
+  done
+  mountpoint -q "$MNT" || { echo "O BrisaFS não montou em 10s" >&2; exit 1; }
+fi
+
+agora () {
+  date +%s.%N
+}
+
+# resultado carga fase inicio ops bytes
+resultado () {
+  local fim
+  fim=$(agora)
+  awk -v c="$1" -v f="$2" -v i="$3" -v t="$fim" -v o="$4" -v b="$5" 'BEGIN {
+    s = t - i; if (s <= 0) s = 1e-9
+    printf "{\"carga\":\"%s\",\"fase\":\"%s\",\"segundos\":%.6f,\"ops\":%d,\"ops_s\":%.1f,\"bytes\":%d,\"mb_s\":%.2f}\n",
+           c, f, s, o, o / s, b, b / s / 1048576
+  }'
+}
+
+carga_seq () {
+  local ini
+  ini=$(agora)
+  dd if=/dev/zero of="$MNT/seq" bs=1M count=256 conv=fsync status=none
+  resultado seq escrita "$ini" 256 $((256 << 20))
+  ini=$(agora)
+  dd if="$MNT/seq" of=/dev/null bs=1M status=none
+  resultado seq leitura "$ini" 256 $((256 << 20))
+  rm -f "$MNT/seq"
+}
+
+carga_aleatoria () {
+  if ! command -v fio > /dev/null; then
+    echo "fio não encontrado, aleatoria ignorada" >&2
+    return
+  fi
+  fio --name=aleatoria --directory="$MNT" --rw=randrw --bs=4k --size=64M \
+      --numjobs="$PROCESSOS" --time_based --runtime=10 --ioengine=psync \
+      --group_reporting --output-format=terse --terse-version=3 > "$TMP/fio"
+  # Campos do formato terse 3: 6 e 9 são os KiB lidos e o tempo de leitura
+  # em ms, 47 e 50 os da escrita
+  awk -F';' '{
+    s = ($9 > $50 ? $9 : $50) / 1000; if (s <= 0) s = 1e-9
+    b = ($6 + $47) * 1024; ops = b / 4096
+    printf "{\"carga\":\"aleatoria\",\"fase\":\"randrw_4k\",\"segundos\":%.6f,\"ops\":%d,\"ops_s\":%.1f,\"bytes\":%d,\"mb_s\":%.2f}\n",
+           s, ops, ops / s, b, b / s / 1048576
+  }' "$TMP/fio"
+  rm -f "$MNT"/aleatoria.*
+}
+
+# Árvore de fontes sintética: diretórios de 50 arquivos, em dois níveis
+cria_arvore () {
+  local raiz=$TMP/arvore i d conteudo
+  conteudo=$(head -c 32768 /dev/urandom | base64 -w 0)
+  for ((i = 0; i < ARQUIVOS; i++)); do
+    d=$raiz/modulo$((i / 500))/dir$((i / 50 % 10))
+    [ -d "$d" ] || mkdir -p "$d"
+    printf '%s' "${conteudo:0:$((1024 << (i % 6)))}" > "$d/arquivo$i.c"
+  done
+  tar -C "$TMP" -cf "$TMP/arvore.tar" arvore
+  du -sb "$raiz" | cut -f1
+}
+
+carga_untar () {
+  local bytes ini
+  bytes=$(cria_arvore)
+  ini=$(agora)
+  tar -C "$MNT" -xf "$TMP/arvore.tar"
+  sync -f "$MNT" 2> /dev/null || sync
+  resultado untar extracao "$ini" "$ARQUIVOS" "$bytes"
+}
+
+carga_stat () {
+  if [ ! -d "$MNT/arvore" ]; then
+    [ -f "$TMP/arvore.tar" ] || cria_arvore > /dev/null
+    tar -C "$MNT" -xf "$TMP/arvore.tar"
+  fi
+  local ini n
+  ini=$(agora)
+  n=$(find "$MNT/arvore" -exec stat -c %s {} + | wc -l)
+  resultado stat find "$ini" "$n" 0
+}
+
+carga_anexa () {
+  local ini p pids=
+  ini=$(agora)
+  for ((p = 0; p < PROCESSOS; p++)); do
+    dd if=/dev/zero of="$MNT/anexa$p" bs=4k count=16384 oflag=append conv=notrunc status=none &
+    pids="$pids $!"
+  done
+  # shellcheck disable=SC2086
+  wait $pids
+  sync -f "$MNT" 2> /dev/null || sync
+  resultado anexa escrita "$ini" $((PROCESSOS * 16384)) $((PROCESSOS * (64 << 20)))
+  rm -f "$MNT"/anexa*
+}
+
+carga_pequenos () {
+  local ini i linha
+  linha=$(head -c 768 /dev/urandom | base64 -w 0)
+  mkdir "$MNT/pequenos"
+  ini=$(agora)
+  for ((i = 0; i < ARQUIVOS; i++)); do
+    printf '%s' "$linha" > "$MNT/pequenos/p$i"
+  done
+  resultado pequenos criacao "$ini" "$ARQUIVOS" $((ARQUIVOS * 1024))
+  ini=$(agora)
+  cat "$MNT"/pequenos/* > /dev/null
+  resultado pequenos leitura "$ini" "$ARQUIVOS" $((ARQUIVOS * 1024))
+  ini=$(agora)
+  rm -rf "$MNT/pequenos"
+  resultado pequenos remocao "$ini" "$ARQUIVOS" 0
+}
+
+for c in $CARGAS; do
+  echo "carga $c" >&2
+  "carga_$c"
+done
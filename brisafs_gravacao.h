@@ -0,0 +1,46 @@
+/*
+ * Formato das gravações de operações do BrisaFS.
+ *
+ * Montado com -o gravar=<arquivo>, o BrisaFS troca a tabela de operações
+ * do FUSE por uma que repassa cada chamada à original e, ao final dela,
+ * grava no arquivo um registro_gravacao seguido dos len_path bytes do
+ * caminho (sem o '\0'). O arquivo começa com um cabecalho_gravacao.
+ *
+ * Os registros saem na ordem em que as operações terminam, o que preserva
+ * as dependências entre elas (ex. o create antes das escritas no arquivo
+ * criado). O conteúdo lido ou escrito não é gravado. O brisareplay repete
+ * uma gravação sobre o núcleo do BrisaFS, sem o FUSE.
+ *
+ * Um arquivo aberto é identificado pelo valor de fi->fh que o open ou o
+ * create devolveu, e que pode voltar a aparecer depois do release dele.
+ */
+
+#ifndef BRISAFS_GRAVACAO_H
+#define BRISAFS_GRAVACAO_H
+
+#include <stdint.h>
+
+#define MAGICO_GRAVACAO 0x42524752u // "BRGR"
+#define VERSAO_GRAVACAO 1
+
+typedef struct {
+    uint32_t magico;
+    uint32_t versao;
+    uint64_t reservado;
+} cabecalho_gravacao;
+
+/* Os campos que uma operação não usa ficam zerados */
+typedef struct {
+    uint64_t instante_ns; // início da operação, desde o início da gravação
+    uint64_t offset;      // offset; uid em chown; tamanho em truncate
+    uint64_t tamanho;     // bytes pedidos; gid em chown; length em fallocate
+    uint64_t arquivo;     // fi->fh, ou 0 se a operação não recebeu um
+    uint32_t op;          // OP_* (brisafs_trace.h)
+    uint32_t modo;        // mode, flags do open ou modo do fallocate
+    int32_t resultado;    // valor devolvido ao FUSE
+    uint32_t latencia_ns;
+    uint16_t len_path;
+    uint16_t reservado[3];
+} registro_gravacao; // 56 bytes
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * Formato dos anéis de rastreamento do BrisaFS.
+ *
+ * Quando compilado com -DBRISAFS_TRACE, o BrisaFS cria o arquivo
+ * ARQUIVO_TRACE e o mapeia em memória compartilhada. Cada thread que
+ * atende operações do FUSE fica com um anel só seu e grava nele um
+ * evento binário por operação, sem travas: a thread dona é a única que
+ * avança o campo escrita e o leitor externo (ex. brisatrace) é o único que
+ * avança o campo leitura. Com o anel cheio o evento é descartado e contado
+ * em perdidos.
+ *
+ * Para drenar um anel, o leitor lê escrita (com semântica acquire), copia
+ * os eventos de leitura até escrita - 1 (posição % n_eventos) e só então
+ * grava o novo valor de leitura (com semântica release).
+ */
+
+#ifndef BRISAFS_TRACE_H
+#define BRISAFS_TRACE_H
+
+#include <stdint.h>
+
+#define ARQUIVO_TRACE "brisafs.trace"
+#define MAGICO_TRACE 0x42524954u // "BRIT"
+#define VERSAO_TRACE 1
+
+#define N_ANEIS_TRACE 64
+#define N_EVENTOS_TRACE 4096 // potência de 2
+
+// Operações registradas, também usadas nas estatísticas do BrisaFS
+enum {
+    OP_GETATTR = 1,
+    OP_READDIR,
+    OP_OPEN,
+    OP_READ,
+    OP_WRITE,
+    OP_UNLINK,
+    OP_RMDIR,
+    OP_TRUNCATE,
+    OP_MKNOD,
+    OP_FSYNC,
+    OP_UTIMENS,
+    OP_CHOWN,
+    OP_CHMOD,
+    OP_CREATE,
+    OP_MKDIR,
+    OP_RELEASE,
+    OP_FALLOCATE,
+    OP_LSEEK,
+    N_OPS_TRACE
+};
+
+static const char *const nomes_ops_trace[N_OPS_TRACE] = {
+    "?", "getattr", "readdir", "open", "read", "write", "unlink", "rmdir",
+    "truncate", "mknod", "fsync", "utimens", "chown", "chmod", "create",
+    "mkdir", "release", "fallocate", "lseek"
+};
+
+typedef struct {
+    uint64_t instante_ns; // CLOCK_MONOTONIC no início da operação
+    uint64_t offset;
+    uint32_t inode;
+    uint32_t tamanho;     // tamanho pedido
+    uint32_t latencia_ns;
+    int32_t resultado;    // valor devolvido ao FUSE
+    uint32_t op;
+    uint32_t reservado;
+} evento_trace; // 40 bytes
+
+/* Os contadores de escrita e de leitura ficam em linhas de cache
+   separadas, já que cada um é alterado por um processo diferente */
+typedef struct {
+    uint64_t escrita;   // total de eventos gravados
+    uint64_t perdidos;  // eventos descartados com o anel cheio
+    uint32_t dono;      // 1 enquanto alguma thread usa o anel
+    uint32_t reservado[11];
+    uint64_t leitura;   // total de eventos drenados
+    uint64_t reservado2[7];
+    evento_trace eventos[N_EVENTOS_TRACE];
+} anel_trace;
+
+typedef struct {
+    uint32_t magico;
+    uint32_t versao;
+    uint32_t n_aneis;
+    uint32_t n_eventos;
+    uint64_t sem_anel;  // eventos de threads que não conseguiram um anel
+    uint64_t reservado[5];
+    anel_trace aneis[N_ANEIS_TRACE];
+} arquivo_trace;
+
+#endif
@@ -25,6 +25,7 @@
  */
 
 
+#define _GNU_SOURCE // SEEK_DATA e SEEK_HOLE
 #define FUSE_USE_VERSION 31
 
 #include <stdio.h>
@@ -37,51 +38,160 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include "brisafs_trace.h"
+#include "brisafs_disco.h"
+#include "brisafs.h"
+#include "brisafs_gravacao.h"
+
+/* Geometria do disco, lida do cabeçalho da imagem na montagem (veja
+   brisafs_disco.h). As macros abaixo só dão nomes aos seus campos */
+geometria geo;
 
-/* Número máximo de arquivos */
-#define N_FILES 1024
-/* Tamanho máximo de um arquivo */
-#define MAX_FILE_SIZE 64000000
 /* Tamanho do bloco do dispositivo */
-#define TAM_BLOCO 4096
+#define TAM_BLOCO (geo.tam_bloco)
 
 /* Quantidade de arquivos por bloco */
 #define MAX_FILES (TAM_BLOCO / sizeof(inode))
 
-/* Quantidade mínima de blocos para armazenar 4 arquivos de tamanho MAX_FILE_SIZE*/
-/* Forçar o arredonamento para cima: q = x/y = 1+((x-1)/y) */
-#define MIN_DATABLOCKS (4*(1+((MAX_FILE_SIZE-1) / TAM_BLOCO)))
+/* Quantidade de inodes */
+#define N_INODES (geo.n_inodes)
+
+/* Blocos ocupados pelos inodes */
+#define N_SUPERBLOCKS (geo.n_superblocks)
+
+/* Quantidade de bits (blocos ou inodes) representados por um bloco de mapa */
+#define BITS_POR_BLOCO (8 * TAM_BLOCO)
+
+/* Blocos do mapa de bits de inodes livres (um bit por inode) */
+#define N_MAPA_INODES (geo.n_mapa_inodes)
+
+/* Blocos do mapa de bits de blocos livres (um bit por bloco do disco) */
+#define N_MAPA_BLOCOS (geo.n_mapa_blocos)
+
+/* Blocos do journal de metadados. O primeiro é o cabeçalho do journal e
+   os demais guardam as transações */
+#define N_BLOCOS_JOURNAL (geo.n_blocos_journal)
+
+/* Posição do superbloco, dos mapas de bits, do journal e do primeiro
+   bloco de dados no disco. O bloco 0 é o cabeçalho da imagem */
+#define INICIO_SUPERBLOCO (geo.inicio_superbloco)
+#define INICIO_MAPA_BLOCOS (geo.inicio_mapa_blocos)
+#define INICIO_MAPA_INODES (geo.inicio_mapa_inodes)
+#define INICIO_JOURNAL (geo.inicio_journal)
+#define INICIO_DADOS (geo.inicio_dados)
 
-/* Quantidade mínima de blocos para comportar todos os inodes */
-/* Forçar o arredonamento para cima: q = x/y = 1+((x-1)/y) */
-#define N_SUPERBLOCKS (1+(((MIN_DATABLOCKS * sizeof(inode))-1) / TAM_BLOCO))
+/* Total de blocos do disco */
+#define MAX_BLOCOS (geo.n_blocos)
 
-/* Total de blocos necessários para o sistema de arquivos */
-#define MAX_BLOCOS (N_SUPERBLOCKS + MIN_DATABLOCKS)
+/* Tamanho máximo de um arquivo: o bloco lógico de um extent tem 32 bits */
+#define MAX_FILE_SIZE ((uint64_t) TAM_BLOCO * UINT32_MAX)
+
+/* Quantidade de palavras de 64 bits de cada mapa */
+#define PALAVRAS_MAPA_BLOCOS (1 + (MAX_BLOCOS - 1) / 64)
+#define PALAVRAS_MAPA_INODES (1 + (N_INODES - 1) / 64)
 
 /* Direitos -rw-r--r-- */
 #define DIREITOS_PADRAO 0644
 
 /* Função para calcular o offset de blocos */
-#define DISCO_OFFSET(B) (B * TAM_BLOCO)
+#define DISCO_OFFSET(B) ((size_t) (B) * TAM_BLOCO)
 
 /* Definição de byte, que nada mais é que um char */
 typedef char byte;
 
+/* Um extent descreve uma sequência de blocos contíguos de um arquivo: os
+   blocos lógicos [inicio, inicio + tamanho) do arquivo estão guardados nos
+   blocos físicos [bloco, bloco + tamanho) do disco */
+typedef struct {
+    uint32_t inicio; // 4 bytes -> bloco lógico inicial
+    uint32_t bloco; // 4 bytes -> bloco físico inicial
+    uint32_t tamanho; // 4 bytes -> quantidade de blocos
+} extent; // 12 bytes
+
+/* Quantidade de extents que cabem no próprio inode */
+#define N_EXTENTS_INODE 2
+/* Um arquivo comum pequeno guarda o conteúdo no lugar dos extents do inode */
+#define TAM_INLINE 28
+/* Quantidade de extents que cabem no bloco indireto de extents */
+#define N_EXTENTS_BLOCO (TAM_BLOCO / sizeof(extent))
+
 /* Um inode guarda todas as informações relativas a um arquivo como
-   por exemplo nome, direitos, tamanho, bloco inicial, ... */
+   por exemplo direitos, tamanho, extents, ... O nome fica na entrada do
+   diretório, e o número do inode é a sua posição no superbloco */
 typedef struct {
-    uint16_t id; // 2 bytes
-    char nome[220]; // 220 bytes
     mode_t type; // 4 bytes
-    uint32_t timestamp[2]; // 4 bytes -> 0: Modificacao, 1: Acesso
     uint16_t direitos; // 2 bytes
-    uint32_t tamanho; // 4 bytes
-    uint16_t bloco; // 2 bytes
-		uint16_t proxbloco; // 2 bytes
+    uint16_t n_extents; // 2 bytes
+    uint64_t tamanho; // 8 bytes
+    uint32_t timestamp[2]; // 8 bytes -> 0: Modificacao, 1: Acesso
     uid_t userown; // 4 bytes
     gid_t groupown; // 4 bytes
-} inode; // 256 bytes
+    uint32_t bloco_extents; // 4 bytes -> bloco indireto de extents (0 se estão no inode)
+    union {
+      extent extents[N_EXTENTS_INODE]; // 24 bytes -> ordenados pelo bloco lógico
+      char dados[TAM_INLINE]; // 28 bytes -> conteúdo de um arquivo inline
+    };
+} inode; // 64 bytes
+
+_Static_assert(sizeof(inode) == TAM_INODE, "o inode deve ter TAM_INODE bytes");
+
+/* Um diretório é um arquivo cujos blocos guardam um índice por hash, no
+   estilo do htree do ext4. O bloco lógico 0 é a raiz do índice: uma lista,
+   ordenada por hash, que indica qual bloco guarda cada faixa de hashes dos
+   nomes. Enquanto a raiz tem espaço, ela aponta direto para as folhas, que
+   guardam as entradas (hash do nome, inode, nome). Quando ela enche, a
+   lista passa para um nó intermediário e a raiz passa a apontar para nós,
+   cada um com a lista de folhas da sua faixa (niveis == 1). Uma busca só
+   compara os nomes das entradas cujo hash coincide com o do nome
+   procurado */
+typedef struct {
+    uint32_t hash_min; // 4 bytes -> menor hash guardado na folha ou no nó
+    uint32_t bloco; // 4 bytes -> bloco lógico da folha ou do nó
+} indice_dir; // 8 bytes
+
+typedef struct {
+    uint32_t n_entradas; // 4 bytes -> total de arquivos no diretório
+    uint32_t n_folhas; // 4 bytes
+    uint32_t niveis; // 4 bytes -> 0: a raiz aponta para folhas; 1: para nós
+    uint32_t n; // 4 bytes -> posições em uso no índice
+    indice_dir indice[]; // ordenado por hash_min; indice[0].hash_min == 0
+} cabecalho_dir;
+
+typedef struct {
+    uint32_t n; // 4 bytes -> posições em uso no índice
+    uint32_t reservado; // 4 bytes
+    indice_dir indice[]; // ordenado por hash_min
+} no_dir;
+
+/* As entradas têm tamanho variável: o nome, sem o '\0', vem logo após
+   o campo len e a entrada seguinte começa no próximo múltiplo de 4 */
+typedef struct {
+    uint32_t hash; // 4 bytes
+    uint32_t id; // 4 bytes
+    uint8_t len; // 1 byte -> tamanho do nome
+    char nome[]; // len bytes
+} entrada_dir;
+
+#define TAM_ENTRADA(len) ((offsetof(entrada_dir, nome) + (len) + 3) & ~(size_t) 3)
+/* Maior nome de arquivo aceito */
+#define TAM_MAX_NOME 255
+
+typedef struct {
+    uint32_t n; // 4 bytes -> entradas em uso na folha
+    uint32_t usados; // 4 bytes -> bytes ocupados pelas entradas
+    byte entradas[];
+} folha_dir;
+
+/* Posições do índice na raiz e num nó intermediário e bytes de entradas
+   por folha */
+#define N_INDICES_DIR ((TAM_BLOCO - sizeof(cabecalho_dir)) / sizeof(indice_dir))
+#define N_INDICES_NO ((TAM_BLOCO - sizeof(no_dir)) / sizeof(indice_dir))
+#define ESPACO_FOLHA (TAM_BLOCO - sizeof(folha_dir))
 
 /* Disco - A variável abaixo representa um disco que pode ser acessado
    por blocos de tamanho TAM_BLOCO com um total de MAX_BLOCOS. */
@@ -90,193 +200,2253 @@ byte *disco;
 /* Ponteiro para um inode */
 inode *superbloco;
 
-/* Ponteiro de diretório */
-byte *dir;
+/* Quantidade de blocos disponíveis em disco, mantida pelo alocador */
+int64_t free_space = 0;
+
+/* Quantidade de inodes disponíveis, mantida pelo alocador */
+int64_t inodes_livres = 0;
+
+/* Mapas de bits de blocos e de inodes em uso (bit ligado = em uso). Ficam
+   no próprio disco, logo após o superbloco, e são persistidos com ele */
+uint64_t *mapa_blocos;
+uint64_t *mapa_inodes;
+
+/* Cada mapa de bits é dividido em N_FATIAS fatias, cada uma com a sua
+   trava e o seu cursor (a palavra em que a próxima busca começa, de modo
+   que cada alocação continua de onde a anterior parou). Cada thread começa
+   procurando na sua própria fatia, então threads que alocam ao mesmo tempo
+   raramente disputam a mesma trava */
+#define N_FATIAS 16
+
+typedef struct {
+  pthread_mutex_t trava;
+  uint32_t cursor;
+} fatia_mapa;
+
+fatia_mapa fatias_blocos[N_FATIAS];
+fatia_mapa fatias_inodes[N_FATIAS];
+
+/* Primeira palavra da fatia f de um mapa com p palavras */
+#define INICIO_FATIA(f, p) ((uint32_t) ((uint64_t) (f) * (p) / N_FATIAS))
+
+/* Fatia preferida da thread, atribuída no seu primeiro acesso ao alocador
+   ou às estatísticas */
+static __thread int fatia_thread = -1;
+int proxima_fatia = 0;
+
+int fatia_da_thread (void) {
+  if (fatia_thread < 0)
+    fatia_thread = __atomic_fetch_add (&proxima_fatia, 1, __ATOMIC_RELAXED) % N_FATIAS;
+  return fatia_thread;
+}
+
+/* Travas de leitura/escrita, uma por inode. Protegem os campos e os
+   extents do inode e, no caso de um diretório, as suas entradas. Quando
+   duas são necessárias, a do diretório pai é obtida antes da do filho */
+pthread_rwlock_t *travas;
+
+/* Geração de cada inode, incrementada quando ele é liberado. Um arquivo
+   aberto cujo inode foi apagado (e talvez reaproveitado) deixa de valer */
+uint32_t *geracoes;
+
+/* Arquivos abertos de cada inode que já responderam a um read_buf com o
+   descritor do hdd1 (ver read_buf_brisafs). Alterado com a trava de
+   escrita do inode ou, no read_buf, com a de leitura */
+uint32_t *leitores_fd;
+
+/* Arquivo aberto, guardado em fi->fh entre open/create e release */
+typedef struct {
+    uint32_t id;      // inode do arquivo
+    uint32_t geracao; // geração do inode na abertura
+    int cursor;       // índice do último extent visitado (-1 se nenhum)
+    char *instantaneo; // conteúdo de ARQUIVO_ESTATISTICAS, se for ele
+    size_t tamanho_instantaneo;
+    byte *atraso;      // escritas atrasadas, ainda sem blocos (ver atrasa_escrita)
+    uint64_t ini_atraso; // offset do arquivo onde elas começam
+    uint32_t tam_atraso; // bytes atrasados
+    uint32_t reservados_atraso; // blocos prometidos a elas
+    int erro_atraso;   // erro da última descarga, devolvido no fsync ou no release
+    uint64_t proxima_leitura; // onde uma leitura sequencial continuaria
+    uint64_t fim_adiante; // até onde a leitura antecipada já foi pedida
+    uint32_t janela;   // bytes lidos adiante, 0 se o acesso não é sequencial
+    int leitor_fd;     // 1 se conta em leitores_fd do inode
+} arquivo_aberto;
+
+/* Janela da leitura antecipada: começa em JANELA_INICIAL bytes e dobra a
+   cada leitura sequencial do mesmo arquivo aberto, até JANELA_MAXIMA */
+#define JANELA_INICIAL (128 << 10)
+#define JANELA_MAXIMA (4 << 20)
+
+/* Um arquivo aberto acumula até TAM_ATRASO bytes escritos no fim do
+   arquivo antes de alocar os blocos deles */
+#define TAM_ATRASO (1 << 20)
+
+/* Arquivo aberto com escritas atrasadas de cada inode, ou NULL. Só um
+   arquivo aberto por vez tem escritas atrasadas de um mesmo inode. Lido e
+   alterado com a trava do inode */
+arquivo_aberto **atrasados;
+
+/* Blocos prometidos às escritas atrasadas e ainda não alocados */
+int64_t blocos_reservados = 0;
+
+/* Blocos liberados que esperam o checkpoint para voltar a free_space */
+int64_t blocos_presos = 0;
+
+/* Blocos liberados que esperam o release dos leitores_fd do seu inode */
+int64_t blocos_em_leitura = 0;
+
+uint64_t relogio_ns (void) {
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* Estatísticas de uso, sempre ativas. Cada thread soma na cópia da sua
+   fatia e o arquivo virtual ARQUIVO_ESTATISTICAS junta as cópias quando é
+   aberto. As latências vão para um histograma logarítmico com 8 faixas
+   por potência de 2 (erro relativo de até 12,5%) */
+#define ARQUIVO_ESTATISTICAS "/.brisafs_stats"
+#define N_FAIXAS_LATENCIA 496
+
+typedef struct {
+    uint64_t chamadas;
+    uint64_t erros;
+    uint64_t bytes; // lidos ou escritos
+    uint64_t faixas[N_FAIXAS_LATENCIA];
+} estatistica_op;
+
+typedef struct {
+    estatistica_op ops[N_OPS_TRACE];
+    uint64_t palavras_varridas; // palavras dos mapas examinadas pelo alocador
+    uint64_t buscas_extent;     // buscas binárias na lista de extents
+    uint64_t passos_extent;     // iterações dessas buscas
+    uint64_t acertos_cursor;    // blocos encontrados pelo cursor, sem busca
+    uint64_t dcache_acertos;
+    uint64_t dcache_falhas;
+    uint64_t cache_acertos;     // acessos a blocos de dados já no cache
+    uint64_t cache_falhas;
+    uint64_t cache_despejos;    // blocos tirados da memória pelo cache
+    uint64_t blocos_adiante;    // blocos pedidos pela leitura antecipada
+} __attribute__((aligned(64))) estatisticas;
+
+estatisticas est[N_FATIAS];
+
+#define CONTA(campo, n) \
+  __atomic_fetch_add (&est[fatia_da_thread ()].campo, (n), __ATOMIC_RELAXED)
+
+// Faixa do histograma de uma latência
+int faixa_latencia (uint64_t ns) {
+  if (ns < 8)
+    return ns;
+  int e = 63 - __builtin_clzll (ns);
+  return (e - 2) * 8 + ((ns >> (e - 3)) & 7);
+}
+
+// Menor latência que cai na faixa f
+uint64_t inicio_faixa (int f) {
+  if (f < 8)
+    return f;
+  return (uint64_t) (8 + f % 8) << (f / 8 - 1);
+}
+
+// Conta uma chamada da operação op que levou latencia ns
+void registra_estatistica (uint32_t op, uint64_t latencia, int resultado) {
+  estatistica_op *o = &est[fatia_da_thread ()].ops[op];
+  __atomic_fetch_add (&o->chamadas, 1, __ATOMIC_RELAXED);
+  if (resultado < 0)
+    __atomic_fetch_add (&o->erros, 1, __ATOMIC_RELAXED);
+  else if (op == OP_READ || op == OP_WRITE)
+    __atomic_fetch_add (&o->bytes, resultado, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&o->faixas[faixa_latencia (latencia)], 1, __ATOMIC_RELAXED);
+}
+
+/* Latência (início da faixa) abaixo da qual ficam q por mil das chamadas
+   do histograma h, com total chamadas */
+uint64_t percentil (const uint64_t *h, uint64_t total, int q) {
+  uint64_t alvo = (total * q + 999) / 1000, acumulado = 0;
+  for (int f = 0; f < N_FAIXAS_LATENCIA; f++) {
+    acumulado += h[f];
+    if (acumulado >= alvo && acumulado > 0)
+      return inicio_faixa (f);
+  }
+  return 0;
+}
+
+// snprintf devolve o que queria escrever, que pode passar do fim de buf
+#define ACRESCENTA(...) do {                            \
+    n += snprintf (buf + n, tam - n, __VA_ARGS__);      \
+    if (n > tam)                                        \
+      n = tam;                                          \
+  } while (0)
+
+/* Escreve em buf o conteúdo atual de ARQUIVO_ESTATISTICAS: uma linha por
+   operação e, em seguida, os contadores internos. Devolve o tamanho */
+size_t gera_estatisticas (char *buf, size_t tam) {
+  static uint64_t h[N_FAIXAS_LATENCIA];
+  static pthread_mutex_t trava_h = PTHREAD_MUTEX_INITIALIZER;
+  size_t n = 0;
+
+  pthread_mutex_lock (&trava_h);
+  ACRESCENTA ("%-8s %12s %8s %14s %10s %10s %10s %10s %10s\n",
+              "op", "chamadas", "erros", "bytes", "p50_ns", "p90_ns", "p99_ns",
+              "p999_ns", "max_ns");
+  for (int op = 1; op < N_OPS_TRACE; op++) {
+    uint64_t chamadas = 0, erros = 0, bytes = 0;
+    memset (h, 0, sizeof(h));
+    for (int f = 0; f < N_FATIAS; f++) {
+      estatistica_op *o = &est[f].ops[op];
+      chamadas += __atomic_load_n (&o->chamadas, __ATOMIC_RELAXED);
+      erros += __atomic_load_n (&o->erros, __ATOMIC_RELAXED);
+      bytes += __atomic_load_n (&o->bytes, __ATOMIC_RELAXED);
+      for (int k = 0; k < N_FAIXAS_LATENCIA; k++)
+        h[k] += __atomic_load_n (&o->faixas[k], __ATOMIC_RELAXED);
+    }
+    chamadas = 0; // Recontado pelo histograma, para os percentis fecharem
+    int maior = 0;
+    for (int k = 0; k < N_FAIXAS_LATENCIA; k++) {
+      chamadas += h[k];
+      if (h[k] != 0)
+        maior = k;
+    }
+    ACRESCENTA ("%-8s %12lu %8lu %14lu %10lu %10lu %10lu %10lu %10lu\n",
+                nomes_ops_trace[op], chamadas, erros, bytes,
+                percentil (h, chamadas, 500), percentil (h, chamadas, 900),
+                percentil (h, chamadas, 990), percentil (h, chamadas, 999),
+                chamadas ? inicio_faixa (maior + 1) : 0);
+  }
+  pthread_mutex_unlock (&trava_h);
+
+  uint64_t c[10] = {0};
+  for (int f = 0; f < N_FATIAS; f++) {
+    c[0] += __atomic_load_n (&est[f].palavras_varridas, __ATOMIC_RELAXED);
+    c[1] += __atomic_load_n (&est[f].buscas_extent, __ATOMIC_RELAXED);
+    c[2] += __atomic_load_n (&est[f].passos_extent, __ATOMIC_RELAXED);
+    c[3] += __atomic_load_n (&est[f].acertos_cursor, __ATOMIC_RELAXED);
+    c[4] += __atomic_load_n (&est[f].dcache_acertos, __ATOMIC_RELAXED);
+    c[5] += __atomic_load_n (&est[f].dcache_falhas, __ATOMIC_RELAXED);
+    c[6] += __atomic_load_n (&est[f].cache_acertos, __ATOMIC_RELAXED);
+    c[7] += __atomic_load_n (&est[f].cache_falhas, __ATOMIC_RELAXED);
+    c[8] += __atomic_load_n (&est[f].cache_despejos, __ATOMIC_RELAXED);
+    c[9] += __atomic_load_n (&est[f].blocos_adiante, __ATOMIC_RELAXED);
+  }
+  ACRESCENTA ("alocador_palavras_varridas %lu\n"
+              "extents_buscas %lu\n"
+              "extents_passos %lu\n"
+              "extents_acertos_cursor %lu\n"
+              "dcache_acertos %lu\n"
+              "dcache_falhas %lu\n"
+              "cache_acertos %lu\n"
+              "cache_falhas %lu\n"
+              "cache_despejos %lu\n"
+              "blocos_adiante %lu\n"
+              "blocos_livres %ld\n"
+              "blocos_reservados %ld\n"
+              "blocos_presos %ld\n"
+              "blocos_em_leitura %ld\n"
+              "inodes_livres %ld\n",
+              c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7], c[8], c[9],
+              __atomic_load_n (&free_space, __ATOMIC_RELAXED),
+              __atomic_load_n (&blocos_reservados, __ATOMIC_RELAXED),
+              __atomic_load_n (&blocos_presos, __ATOMIC_RELAXED),
+              __atomic_load_n (&blocos_em_leitura, __ATOMIC_RELAXED),
+              __atomic_load_n (&inodes_livres, __ATOMIC_RELAXED));
+  return n < tam ? n : tam - 1;
+}
+#undef ACRESCENTA
+
+/* Espaço para o conteúdo de ARQUIVO_ESTATISTICAS: uma linha de até 192
+   caracteres por operação e mais os contadores */
+#define TAM_ESTATISTICAS ((N_OPS_TRACE + 1) * 192 + 1024)
+
+#ifdef BRISAFS_TRACE
+/* Anéis de rastreamento, mapeados a partir de ARQUIVO_TRACE (veja
+   brisafs_trace.h). Sem BRISAFS_TRACE nada disto é compilado */
+arquivo_trace *trace = NULL;
+static __thread anel_trace *anel_thread = NULL;
+static __thread uint32_t trace_inode;
+static pthread_key_t chave_trace;
+
+// Devolve o anel de uma thread que terminou
+static void solta_anel (void *anel) {
+  __atomic_store_n (&((anel_trace*) anel)->dono, 0, __ATOMIC_RELEASE);
+}
+
+// Anel da thread atual, reservado no seu primeiro evento
+static anel_trace *anel_da_thread (void) {
+  if (anel_thread == NULL) {
+    for (int i = 0; i < N_ANEIS_TRACE; i++) {
+      uint32_t livre = 0;
+      if (__atomic_compare_exchange_n (&trace->aneis[i].dono, &livre, 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        anel_thread = &trace->aneis[i];
+        pthread_setspecific (chave_trace, anel_thread);
+        break;
+      }
+    }
+  }
+  return anel_thread;
+}
+
+/* Grava um evento no anel da thread. O inode é o último informado com
+   TRACE_INODE durante a operação */
+void registra_trace (uint32_t op, uint64_t inicio, uint64_t fim,
+                     uint64_t offset, uint32_t tamanho, int resultado) {
+  if (trace == NULL)
+    return;
+  anel_trace *a = anel_da_thread ();
+  if (a == NULL) {
+    __atomic_fetch_add (&trace->sem_anel, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  uint64_t e = a->escrita;
+  if (e - __atomic_load_n (&a->leitura, __ATOMIC_ACQUIRE) >= N_EVENTOS_TRACE) {
+    __atomic_store_n (&a->perdidos, a->perdidos + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  evento_trace *ev = &a->eventos[e % N_EVENTOS_TRACE];
+  ev->instante_ns = inicio;
+  ev->offset = offset;
+  ev->inode = trace_inode;
+  ev->tamanho = tamanho;
+  ev->latencia_ns = fim - inicio;
+  ev->resultado = resultado;
+  ev->op = op;
+  __atomic_store_n (&a->escrita, e + 1, __ATOMIC_RELEASE);
+}
+
+/* Cria e mapeia ARQUIVO_TRACE, uma vez por processo. Se não conseguir, o
+   BrisaFS segue sem rastreamento */
+void inicia_trace (void) {
+  if (trace != NULL) // Continua o da montagem anterior no mesmo processo
+    return;
+  int fd = open (ARQUIVO_TRACE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate (fd, sizeof(arquivo_trace)) < 0) {
+    fprintf (stderr, "Não foi possível criar %s: %s\n", ARQUIVO_TRACE, strerror (errno));
+    if (fd >= 0)
+      close (fd);
+    return;
+  }
+  void *m = mmap (NULL, sizeof(arquivo_trace), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (m == MAP_FAILED)
+    return;
+  trace = m;
+  trace->versao = VERSAO_TRACE;
+  trace->n_aneis = N_ANEIS_TRACE;
+  trace->n_eventos = N_EVENTOS_TRACE;
+  __atomic_store_n (&trace->magico, MAGICO_TRACE, __ATOMIC_RELEASE);
+  pthread_key_create (&chave_trace, solta_anel);
+}
+
+#define TRACE_INODE(id) (trace_inode = (id))
+#define REGISTRA_TRACE(op, inicio, fim, offset, tamanho, resultado) \
+  registra_trace (op, inicio, fim, offset, tamanho, resultado)
+#else
+#define TRACE_INODE(id) ((void) 0)
+#define REGISTRA_TRACE(op, inicio, fim, offset, tamanho, resultado) ((void) 0)
+#endif
+
+/* Descritor do arquivo hdd1, mantido aberto para as escritas incrementais */
+int disco_fd = -1;
+
+/* Cabeçalho da imagem (bloco 0), de onde saiu a geometria */
+cabecalho_disco cabecalho;
+
+/* Conjunto de blocos do disco, cada um com um valor de 64 bits (ex. os
+   trechos alterados de um bloco de metadados). Ocupa memória proporcional
+   ao que foi acrescentado desde que foi esvaziado, e não ao tamanho do
+   disco. É uma tabela hash com endereçamento aberto, dividida em N_FATIAS
+   fatias pelo número do bloco, cada uma com a sua trava */
+#define NENHUMA UINT32_MAX
+
+typedef struct {
+  uint32_t bloco; // NENHUMA numa posição vazia
+  uint64_t valor;
+} item_conjunto;
+
+typedef struct {
+  pthread_mutex_t trava;
+  item_conjunto *itens;
+  uint32_t capacidade; // potência de 2, ou 0 sem itens alocados
+  uint32_t n;
+} __attribute__((aligned(64))) fatia_conjunto;
+
+typedef struct {
+  fatia_conjunto fatias[N_FATIAS];
+  int64_t n; // total, lido sem as travas
+} conjunto_blocos;
+
+void inicia_conjunto (conjunto_blocos *c) {
+  for (int f = 0; f < N_FATIAS; f++) {
+    pthread_mutex_init (&c->fatias[f].trava, NULL);
+    c->fatias[f].itens = NULL;
+    c->fatias[f].capacidade = 0;
+    c->fatias[f].n = 0;
+  }
+  c->n = 0;
+}
+
+void destroi_conjunto (conjunto_blocos *c) {
+  for (int f = 0; f < N_FATIAS; f++) {
+    pthread_mutex_destroy (&c->fatias[f].trava);
+    free (c->fatias[f].itens);
+    c->fatias[f].itens = NULL;
+    c->fatias[f].capacidade = 0;
+    c->fatias[f].n = 0;
+  }
+  c->n = 0;
+}
+
+// Sem o registro de um bloco alterado ele nunca chegaria ao hdd1
+void sem_memoria_conjunto (void) {
+  fprintf (stderr, "BrisaFS: memória insuficiente para os blocos alterados\n");
+  abort ();
+}
+
+// Posição do bloco na fatia, ou a posição vazia onde ele entraria
+item_conjunto *procura_item (fatia_conjunto *f, uint32_t bloco) {
+  uint32_t i = (bloco / N_FATIAS * 2654435761u) & (f->capacidade - 1);
+  while (f->itens[i].bloco != NENHUMA && f->itens[i].bloco != bloco)
+    i = (i + 1) & (f->capacidade - 1);
+  return &f->itens[i];
+}
+
+// Dobra a capacidade da fatia
+void cresce_fatia (fatia_conjunto *f) {
+  item_conjunto *antigos = f->itens;
+  uint32_t antiga = f->capacidade;
+  f->capacidade = antiga > 0 ? antiga * 2 : 64;
+  f->itens = malloc ((size_t) f->capacidade * sizeof(item_conjunto));
+  if (f->itens == NULL)
+    sem_memoria_conjunto ();
+  for (uint32_t i = 0; i < f->capacidade; i++)
+    f->itens[i].bloco = NENHUMA;
+  for (uint32_t i = 0; i < antiga; i++)
+    if (antigos[i].bloco != NENHUMA)
+      *procura_item (f, antigos[i].bloco) = antigos[i];
+  free (antigos);
+}
+
+/* Acrescenta o bloco ao conjunto, juntando valor (com um ou binário) ao
+   que ele já tinha. Devolve o valor anterior, 0 se o bloco não estava lá */
+uint64_t acrescenta_bloco (conjunto_blocos *c, uint32_t bloco, uint64_t valor) {
+  fatia_conjunto *f = &c->fatias[bloco % N_FATIAS];
+  pthread_mutex_lock (&f->trava);
+  // No máximo 3/4 cheia
+  if (((uint64_t) f->n + 1) * 4 > (uint64_t) f->capacidade * 3)
+    cresce_fatia (f);
+  item_conjunto *it = procura_item (f, bloco);
+  uint64_t antes = 0;
+  if (it->bloco == NENHUMA) {
+    it->bloco = bloco;
+    it->valor = valor;
+    f->n++;
+    __atomic_fetch_add (&c->n, 1, __ATOMIC_RELAXED);
+  } else {
+    antes = it->valor;
+    it->valor |= valor;
+  }
+  pthread_mutex_unlock (&f->trava);
+  return antes;
+}
+
+/* Devolve 1 se o bloco está no conjunto. Quem acrescentou o bloco antes
+   de soltar uma trava que a thread atual já pegou também é visto pelo
+   total sem trava */
+int contem_bloco (conjunto_blocos *c, uint32_t bloco) {
+  if (__atomic_load_n (&c->n, __ATOMIC_RELAXED) == 0)
+    return 0;
+  fatia_conjunto *f = &c->fatias[bloco % N_FATIAS];
+  pthread_mutex_lock (&f->trava);
+  int contem = f->n > 0 && procura_item (f, bloco)->bloco == bloco;
+  pthread_mutex_unlock (&f->trava);
+  return contem;
+}
+
+/* Retira do conjunto os blocos com o valor indicado, chamando antes
+   (bloco) para cada um enquanto ele ainda está no conjunto. Devolve
+   quantos foram retirados */
+uint32_t retira_valor (conjunto_blocos *c, uint64_t valor, void (*antes) (uint32_t)) {
+  uint32_t n = 0;
+  for (int k = 0; k < N_FATIAS && __atomic_load_n (&c->n, __ATOMIC_RELAXED) > 0; k++) {
+    fatia_conjunto *f = &c->fatias[k];
+    pthread_mutex_lock (&f->trava);
+    uint32_t retirados = 0;
+    for (uint32_t i = 0; i < f->capacidade; i++) {
+      if (f->itens[i].bloco != NENHUMA && f->itens[i].valor == valor) {
+        antes (f->itens[i].bloco);
+        retirados++;
+      }
+    }
+    if (retirados > 0) { // Os que ficam voltam para uma tabela nova
+      item_conjunto *antigos = f->itens;
+      f->itens = malloc ((size_t) f->capacidade * sizeof(item_conjunto));
+      if (f->itens == NULL)
+        sem_memoria_conjunto ();
+      for (uint32_t i = 0; i < f->capacidade; i++)
+        f->itens[i].bloco = NENHUMA;
+      for (uint32_t i = 0; i < f->capacidade; i++)
+        if (antigos[i].bloco != NENHUMA && antigos[i].valor != valor)
+          *procura_item (f, antigos[i].bloco) = antigos[i];
+      free (antigos);
+      f->n -= retirados;
+      __atomic_fetch_sub (&c->n, retirados, __ATOMIC_RELAXED);
+      n += retirados;
+    }
+    pthread_mutex_unlock (&f->trava);
+  }
+  return n;
+}
+
+int compara_itens (const void *a, const void *b) {
+  uint32_t x = ((const item_conjunto*) a)->bloco, y = ((const item_conjunto*) b)->bloco;
+  return x < y ? -1 : x > y;
+}
+
+/* Esvazia o conjunto e devolve em *itens os seus itens em ordem de bloco,
+   num vetor que quem chama libera. Devolve quantos são. Um bloco
+   acrescentado durante a chamada pode ficar para a próxima */
+uint32_t esvazia_conjunto (conjunto_blocos *c, item_conjunto **itens) {
+  item_conjunto *v = NULL;
+  uint32_t n = 0;
+  for (int k = 0; k < N_FATIAS; k++) {
+    fatia_conjunto *f = &c->fatias[k];
+    pthread_mutex_lock (&f->trava);
+    if (f->n > 0) {
+      item_conjunto *maior = realloc (v, (size_t) (n + f->n) * sizeof(item_conjunto));
+      if (maior == NULL)
+        sem_memoria_conjunto ();
+      v = maior;
+      for (uint32_t i = 0; i < f->capacidade; i++) {
+        if (f->itens[i].bloco != NENHUMA) {
+          v[n++] = f->itens[i];
+          f->itens[i].bloco = NENHUMA;
+        }
+      }
+      __atomic_fetch_sub (&c->n, f->n, __ATOMIC_RELAXED);
+    }
+    // Uma fatia bem maior do que o seu uso devolve a memória
+    if (f->capacidade > 1024 && (uint64_t) f->n * 8 < f->capacidade) {
+      free (f->itens);
+      f->itens = NULL;
+      f->capacidade = 0;
+    }
+    f->n = 0;
+    pthread_mutex_unlock (&f->trava);
+  }
+  if (n > 1)
+    qsort (v, n, sizeof(item_conjunto), compara_itens);
+  *itens = v;
+  return n;
+}
+
+/* Blocos sujos: alterados em memória e ainda não gravados no hdd1. Os
+   que não são retidos vão para o hdd1 no próximo commit */
+conjunto_blocos sujos;
+
+/* Journal de metadados. Toda alteração de inode, mapa de bits, bloco de
+   diretório ou bloco indireto de extents é marcada com marca_meta, que
+   anota quais trechos de TRECHO_JOURNAL bytes do bloco mudaram. Um commit
+   copia esses trechos, de uma só vez, para uma transação gravada no fim do
+   journal, e vários commits pedidos ao mesmo tempo saem num só. Os blocos
+   de metadados só são gravados no seu lugar do hdd1 no checkpoint, depois
+   que as transações que os alteraram estão persistidas. Na montagem as
+   transações válidas do journal são reaplicadas */
+#define TRECHO_JOURNAL (TAM_BLOCO / 64)
+#define MAGICO_JOURNAL 0x4252534au // "BRSJ"
+#define MAGICO_TRANSACAO 0x42525458u // "BRTX"
+
+// Bloco INICIO_JOURNAL
+typedef struct {
+    uint32_t magico;
+    uint32_t reservado;
+    uint64_t sequencia; // sequência da transação que começa no bloco 1 do journal
+} cabecalho_journal;
+
+/* Uma transação ocupa blocos consecutivos do journal: este cabeçalho,
+   seguido de n_registros registros */
+typedef struct {
+    uint32_t magico;
+    uint32_t crc;       // da transação inteira, calculado com este campo zerado
+    uint64_t sequencia;
+    uint32_t n_registros;
+    uint32_t tamanho;   // em bytes, contando este cabeçalho
+} cabecalho_transacao;
+
+/* Um registro é seguido pelo conteúdo, TRECHO_JOURNAL bytes para cada bit
+   ligado de trechos, em ordem */
+typedef struct {
+    uint32_t bloco;
+    uint32_t reservado;
+    uint64_t trechos;
+} registro_journal;
+
+/* Blocos de metadados alterados desde o último commit, com os trechos
+   alterados de cada um. São os registros da próxima transação */
+conjunto_blocos alterados;
+/* Blocos de metadados alterados desde o último checkpoint, que só podem
+   ser gravados no lugar no checkpoint. Os de dados são gravados no lugar
+   a cada commit, antes da transação */
+conjunto_blocos retidos;
+/* Blocos retidos que foram liberados. O journal ainda tem registros deles,
+   que a reaplicação depois de uma queda gravaria por cima de um novo dono,
+   então só voltam para o alocador no checkpoint, que esvazia o journal e
+   é feito no primeiro commit depois da liberação. Até lá também não contam
+   em free_space, e sim em blocos_presos */
+conjunto_blocos presos;
+/* Blocos liberados desde o último checkpoint. Os que continuarem livres
+   viram buracos no hdd1 durante o checkpoint, devolvendo o espaço ao
+   sistema de arquivos onde está a imagem */
+conjunto_blocos a_perfurar;
+/* Blocos de dados liberados de um inode com leitores_fd, que ainda podem
+   ser lidos pelo libfuse através do descritor do hdd1. O valor é o inode.
+   Ficam fora do alocador e de free_space até o release do último desses
+   arquivos abertos (ver solta_leitor_fd) */
+conjunto_blocos em_leitura;
+int trechos_pendentes = 0;  // aproximado, dispara o commit
+
+/* As operações que alteram metadados ficam com a trava de leitura; o
+   commit fica com a de escrita e assim nunca vê uma operação pela metade */
+pthread_rwlock_t trava_journal;
+uint64_t sequencia_journal;  // da próxima transação
+uint32_t cabeca_journal;     // próximo bloco livre, relativo a INICIO_JOURNAL
+byte *transacao;             // espaço para montar uma transação
+uint32_t tabela_crc[256];
 
-/* Quantidade de blocos disponíveis em disco (inicialmente o disco está vazio)*/
-int free_space = N_SUPERBLOCKS;
+/* Opções de montagem específicas do BrisaFS (ex. -o mmap,imagem=vol.img) */
+struct opcoes_brisafs {
+  int mmap; // Disco mapeado diretamente do hdd1 (MAP_SHARED) em vez de carregado na RAM
+  char *imagem; // Arquivo da imagem, IMAGEM_PADRAO se não for dado
+  char *gravar; // Arquivo onde as operações são gravadas (brisafs_gravacao.h)
+  char *cache;  // Limite do cache de blocos de dados, com sufixo K, M ou G
+  uint64_t limite_cache; // O mesmo em bytes (brisafs_limita_cache), 0 sem limite
+} opcoes;
+
+// Sem o main (veja brisafs.h) as opções vêm de brisafs_monta
+#ifndef BRISAFS_BIBLIOTECA
+static const struct fuse_opt opcoes_spec[] = {
+  {"mmap", offsetof(struct opcoes_brisafs, mmap), 1},
+  {"imagem=%s", offsetof(struct opcoes_brisafs, imagem), 0},
+  {"gravar=%s", offsetof(struct opcoes_brisafs, gravar), 0},
+  {"cache=%s", offsetof(struct opcoes_brisafs, cache), 0},
+  FUSE_OPT_END
+};
+#endif
 
 /* Cabeçalhos de Funções */
-int armazena_data(int typeop, int inode);
+int armazena_data(int typeop, uint32_t inode);
 int quebra_nome (const char *path, char **name, char **parent);
-int compara_nome (const char *path, const char *nome);
-uint16_t dir_tree (const char *path);
+uint32_t dir_tree (const char *path);
+uint32_t procura_entrada (uint32_t pai, const char *nome, size_t len);
+uint32_t busca_entrada (uint32_t pai, const char *nome, size_t len, uint32_t hash);
+uint32_t hash_nome (const char *nome, size_t len);
+void inicia_dcache (void);
+void termina_dcache (void);
+int insere_entrada (uint32_t pai, const char *nome, size_t len, uint32_t id);
+void inicia_dir (uint32_t id);
+void trava_leitura_descarregada (uint32_t id);
+int descarrega_inode (uint32_t id);
+
+/* Marca o bloco como sujo para que seja gravado no próximo salva_disco */
+void marca_sujo (uint32_t bloco) {
+  acrescenta_bloco (&sujos, bloco, 1);
+}
+
+/* Marca o bloco como retido até o próximo checkpoint */
+void retem_bloco (uint32_t bloco) {
+  acrescenta_bloco (&retidos, bloco, 1);
+}
+
+/* Marca como alterados os bytes [ini, ini + tam) do bloco de metadados
+   indicado, para que entrem no próximo commit do journal. O bloco fica
+   retido até o checkpoint, que o grava no lugar */
+void marca_meta (uint32_t bloco, uint32_t ini, uint32_t tam) {
+  uint32_t prim = ini / TRECHO_JOURNAL, ult = (ini + tam - 1) / TRECHO_JOURNAL;
+  uint64_t mascara = ult - prim == 63 ? ~UINT64_C(0) :
+                     ((UINT64_C(1) << (ult - prim + 1)) - 1) << prim;
+  uint64_t antes = acrescenta_bloco (&alterados, bloco, mascara);
+  if ((antes | mascara) != antes)
+    __atomic_fetch_add (&trechos_pendentes, __builtin_popcountll (mascara & ~antes),
+                        __ATOMIC_RELAXED);
+  // Todo bloco alterado desde o commit já é retido desde o checkpoint
+  if (antes == 0)
+    retem_bloco (bloco);
+}
+
+/* Marca como alterado o inode indicado */
+void marca_inode (uint32_t id) {
+  marca_meta (INICIO_SUPERBLOCO + (id * sizeof(inode)) / TAM_BLOCO,
+              (id * sizeof(inode)) % TAM_BLOCO, sizeof(inode));
+}
+
+void trava_leitura (uint32_t id) {
+  pthread_rwlock_rdlock (&travas[id]);
+}
+
+void trava_escrita (uint32_t id) {
+  pthread_rwlock_wrlock (&travas[id]);
+}
+
+void destrava (uint32_t id) {
+  pthread_rwlock_unlock (&travas[id]);
+}
+
+/* Cache de blocos de dados (-o cache=<tamanho>, só no modo mmap). Limita
+   quantos blocos de dados de arquivos ficam em memória: quando o limite é
+   atingido, um bloco sai do mapeamento (madvise) e do cache de páginas do
+   sistema (posix_fadvise) e volta a ser lido do hdd1 no próximo acesso.
+   Os blocos de metadados (inodes, mapas e journal), de diretórios e de
+   extents nunca passam por aqui, então ficam sempre em memória.
+   A escolha de quem sai segue o 2Q: um bloco acessado pela primeira vez
+   entra na fila de entrada (FIFO) e, se for acessado de novo depois de
+   sair dela, vai para a fila quente (LRU). Uma leitura sequencial de um
+   arquivo grande passa só pela fila de entrada, sem tirar do cache os
+   blocos quentes. A fila fantasma lembra os blocos que saíram da fila de
+   entrada. Blocos sujos ou retidos ainda não foram gravados no hdd1 e
+   ganham outra volta na fila em vez de sair, mas só enquanto a fatia não
+   passa do limite mais uma folga de 1/4 dele: daí em diante o mais antigo
+   sai mesmo pendente, e um bloco sujo é gravado antes (msync) para que a
+   página possa mesmo sair do cache de páginas. Um bloco de dados pode ser
+   gravado no lugar antes do commit, que só o gravaria de novo.
+   Todo acesso a um bloco de dados passa por usa_bloco depois de tocar
+   nele (antes, no read_buf, que deixa a leitura para o libfuse), então um
+   bloco despejado por outra thread no meio de uma cópia volta a contar.
+   O cache é dividido em N_FATIAS fatias pelo número do bloco, cada uma
+   com a sua trava e 1/N_FATIAS do limite */
+enum { FILA_ENTRADA, FILA_QUENTE, FILA_FANTASMA, N_FILAS_CACHE };
+
+typedef struct {
+  uint32_t bloco;
+  uint32_t prox_balde; // próxima entrada do mesmo balde, ou da lista de livres
+  uint32_t ant, prox;  // vizinhas na fila, da cabeça (mais nova) para a cauda
+  uint8_t fila;
+} entrada_cache;
+
+typedef struct {
+  uint32_t cabeca, cauda, n;
+} fila_cache;
+
+typedef struct {
+  pthread_mutex_t trava;
+  entrada_cache *entradas;
+  uint32_t *baldes;
+  uint32_t n_baldes; // potência de 2
+  uint32_t livres;
+  fila_cache filas[N_FILAS_CACHE];
+} __attribute__((aligned(64))) fatia_cache;
+
+fatia_cache fatias_cache[N_FATIAS];
+uint32_t capacidade_cache = 0; // blocos residentes por fatia, 0 sem cache
+
+uint32_t *balde_cache (fatia_cache *c, uint32_t bloco) {
+  return &c->baldes[(bloco / N_FATIAS * 2654435761u) & (c->n_baldes - 1)];
+}
+
+void tira_da_fila (fatia_cache *c, uint32_t i) {
+  entrada_cache *e = &c->entradas[i];
+  fila_cache *q = &c->filas[e->fila];
+  if (e->ant != NENHUMA)
+    c->entradas[e->ant].prox = e->prox;
+  else
+    q->cabeca = e->prox;
+  if (e->prox != NENHUMA)
+    c->entradas[e->prox].ant = e->ant;
+  else
+    q->cauda = e->ant;
+  q->n--;
+}
+
+void poe_na_fila (fatia_cache *c, uint32_t i, int fila) {
+  entrada_cache *e = &c->entradas[i];
+  fila_cache *q = &c->filas[fila];
+  e->fila = fila;
+  e->ant = NENHUMA;
+  e->prox = q->cabeca;
+  if (q->cabeca != NENHUMA)
+    c->entradas[q->cabeca].ant = i;
+  else
+    q->cauda = i;
+  q->cabeca = i;
+  q->n++;
+}
+
+// Tira a entrada i da sua fila e do seu balde e a devolve às livres
+void descarta_entrada (fatia_cache *c, uint32_t i) {
+  tira_da_fila (c, i);
+  for (uint32_t *p = balde_cache (c, c->entradas[i].bloco); *p != NENHUMA;
+       p = &c->entradas[*p].prox_balde) {
+    if (*p == i) {
+      *p = c->entradas[i].prox_balde;
+      break;
+    }
+  }
+  c->entradas[i].prox_balde = c->livres;
+  c->livres = i;
+}
+
+int bloco_pendente (uint32_t bloco) {
+  return contem_bloco (&sujos, bloco) || contem_bloco (&retidos, bloco);
+}
+
+// Blocos residentes na fatia
+uint32_t residentes_cache (const fatia_cache *c) {
+  return c->filas[FILA_ENTRADA].n + c->filas[FILA_QUENTE].n;
+}
+
+// Fila de onde sai o próximo bloco residente
+int fila_do_despejo (const fatia_cache *c) {
+  return c->filas[FILA_ENTRADA].n > capacidade_cache / 4 ||
+         c->filas[FILA_QUENTE].n == 0 ? FILA_ENTRADA : FILA_QUENTE;
+}
+
+/* Tira da memória o bloco da entrada i, que já saiu da fila indicada. Um
+   bloco da fila de entrada passa para a fantasma; o da quente é esquecido */
+void despeja_entrada (fatia_cache *c, uint32_t i, int fila) {
+  uint32_t bloco = c->entradas[i].bloco;
+  madvise (disco + DISCO_OFFSET(bloco), TAM_BLOCO, MADV_DONTNEED);
+  posix_fadvise (disco_fd, DISCO_OFFSET(bloco), TAM_BLOCO, POSIX_FADV_DONTNEED);
+  CONTA (cache_despejos, 1);
+  if (fila == FILA_QUENTE) {
+    poe_na_fila (c, i, FILA_QUENTE); // descarta_entrada a tira de novo
+    descarta_entrada (c, i);
+    return;
+  }
+  // A fila fantasma guarda até metade da capacidade
+  if (c->filas[FILA_FANTASMA].n >= capacidade_cache / 2 + 1)
+    descarta_entrada (c, c->filas[FILA_FANTASMA].cauda);
+  poe_na_fila (c, i, FILA_FANTASMA);
+}
+
+/* Tira blocos residentes da fatia até sobrar lugar para mais um. Os
+   pendentes ganham outra volta, mas a fatia nunca passa do limite mais a
+   folga: aí o mais antigo sai mesmo pendente. Com isso sempre sobra uma
+   entrada livre, já que as entradas cobrem o limite, a folga e a fila
+   fantasma */
+void abre_espaco_cache (fatia_cache *c) {
+  int tentativas = 8;
+  while (residentes_cache (c) >= capacidade_cache && tentativas-- > 0) {
+    int fila = fila_do_despejo (c);
+    uint32_t i = c->filas[fila].cauda;
+    tira_da_fila (c, i);
+    if (bloco_pendente (c->entradas[i].bloco)) {
+      poe_na_fila (c, i, fila);
+      continue;
+    }
+    despeja_entrada (c, i, fila);
+  }
+  while (residentes_cache (c) >= capacidade_cache + capacidade_cache / 4) {
+    int fila = fila_do_despejo (c);
+    uint32_t i = c->filas[fila].cauda;
+    uint32_t bloco = c->entradas[i].bloco;
+    tira_da_fila (c, i);
+    // Um retido só pode ser gravado no checkpoint e fica no cache de páginas
+    if (contem_bloco (&sujos, bloco) && !contem_bloco (&retidos, bloco))
+      msync (disco + DISCO_OFFSET(bloco), TAM_BLOCO, MS_SYNC);
+    despeja_entrada (c, i, fila);
+  }
+}
+
+/* Registra um acesso ao bloco de dados indicado */
+void usa_bloco (uint32_t bloco) {
+  if (capacidade_cache == 0)
+    return;
+  fatia_cache *c = &fatias_cache[bloco % N_FATIAS];
+  pthread_mutex_lock (&c->trava);
+  uint32_t i = *balde_cache (c, bloco);
+  while (i != NENHUMA && c->entradas[i].bloco != bloco)
+    i = c->entradas[i].prox_balde;
+
+  if (i != NENHUMA && c->entradas[i].fila != FILA_FANTASMA) {
+    CONTA (cache_acertos, 1);
+    if (c->entradas[i].fila == FILA_QUENTE) {
+      tira_da_fila (c, i);
+      poe_na_fila (c, i, FILA_QUENTE);
+    }
+  } else {
+    CONTA (cache_falhas, 1);
+    // Uma entrada fantasma sai da fila antes, para não ser descartada
+    if (i != NENHUMA)
+      tira_da_fila (c, i);
+    abre_espaco_cache (c);
+    if (i != NENHUMA) { // Voltou depois de sair da fila de entrada
+      poe_na_fila (c, i, FILA_QUENTE);
+    } else if (c->livres != NENHUMA) {
+      i = c->livres;
+      c->livres = c->entradas[i].prox_balde;
+      c->entradas[i].bloco = bloco;
+      c->entradas[i].prox_balde = *balde_cache (c, bloco);
+      *balde_cache (c, bloco) = i;
+      poe_na_fila (c, i, FILA_ENTRADA);
+    }
+  }
+  pthread_mutex_unlock (&c->trava);
+}
+
+/* Um bloco liberado deixa de ocupar o cache */
+void esquece_bloco (uint32_t bloco) {
+  if (capacidade_cache == 0)
+    return;
+  fatia_cache *c = &fatias_cache[bloco % N_FATIAS];
+  pthread_mutex_lock (&c->trava);
+  uint32_t i = *balde_cache (c, bloco);
+  while (i != NENHUMA && c->entradas[i].bloco != bloco)
+    i = c->entradas[i].prox_balde;
+  if (i != NENHUMA)
+    descarta_entrada (c, i);
+  pthread_mutex_unlock (&c->trava);
+}
+
+/* Prepara o cache para bytes de blocos de dados. Devolve 0 ou um código de
+   erro negativo */
+int inicia_cache (uint64_t bytes) {
+  uint64_t blocos = bytes / TAM_BLOCO / N_FATIAS;
+  if (blocos < 4)
+    blocos = 4;
+  if (blocos > UINT32_MAX / 4)
+    return -EINVAL;
+  // Entradas residentes, a folga para blocos pendentes e as fantasmas
+  uint32_t n = blocos + blocos / 4 + blocos / 2 + 2;
+  for (int f = 0; f < N_FATIAS; f++) {
+    fatia_cache *c = &fatias_cache[f];
+    pthread_mutex_init (&c->trava, NULL);
+    c->n_baldes = 1;
+    while (c->n_baldes < n)
+      c->n_baldes *= 2;
+    c->entradas = malloc ((size_t) n * sizeof(entrada_cache));
+    c->baldes = malloc ((size_t) c->n_baldes * sizeof(uint32_t));
+    if (c->entradas == NULL || c->baldes == NULL)
+      return -ENOMEM;
+    memset (c->baldes, 0xff, (size_t) c->n_baldes * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++)
+      c->entradas[i].prox_balde = i + 1 < n ? i + 1 : NENHUMA;
+    c->livres = 0;
+    for (int q = 0; q < N_FILAS_CACHE; q++)
+      c->filas[q] = (fila_cache) { NENHUMA, NENHUMA, 0 };
+  }
+  /* Sem isso uma falta de página no mapeamento (ou uma leitura do
+     descritor) traz junto as páginas vizinhas, que o cache não vê. A
+     leitura antecipada de le_adiante continua valendo */
+  madvise (disco, DISCO_OFFSET(MAX_BLOCOS), MADV_RANDOM);
+  posix_fadvise (disco_fd, 0, 0, POSIX_FADV_RANDOM);
+  capacidade_cache = blocos;
+  return 0;
+}
+
+/* Libera a memória do cache, que fica desligado */
+void termina_cache (void) {
+  for (int f = 0; f < N_FATIAS; f++) {
+    fatia_cache *c = &fatias_cache[f];
+    if (capacidade_cache > 0)
+      pthread_mutex_destroy (&c->trava);
+    free (c->entradas);
+    free (c->baldes);
+    c->entradas = NULL;
+    c->baldes = NULL;
+  }
+  capacidade_cache = 0;
+}
+
+/* Liga o bit n do mapa que começa no bloco inicio do disco. A escrita é
+   atômica porque o mapa de inodes também é consultado sem trava */
+void liga_bit (uint64_t *mapa, uint32_t inicio, uint32_t n) {
+  __atomic_fetch_or (&mapa[n / 64], UINT64_C(1) << (n % 64), __ATOMIC_RELEASE);
+  marca_meta (inicio + n / BITS_POR_BLOCO, (n % BITS_POR_BLOCO) / 64 * 8, 8);
+}
+
+/* Desliga o bit n do mapa que começa no bloco inicio do disco */
+void desliga_bit (uint64_t *mapa, uint32_t inicio, uint32_t n) {
+  __atomic_fetch_and (&mapa[n / 64], ~(UINT64_C(1) << (n % 64)), __ATOMIC_RELEASE);
+  marca_meta (inicio + n / BITS_POR_BLOCO, (n % BITS_POR_BLOCO) / 64 * 8, 8);
+}
+
+/* Devolve a fatia de um mapa com p palavras que contém a palavra w */
+int fatia_da_palavra (uint32_t w, uint32_t p) {
+  int f = (uint64_t) w * N_FATIAS / p;
+  while (f > 0 && w < INICIO_FATIA(f, p))
+    f--;
+  while (f < N_FATIAS - 1 && w >= INICIO_FATIA(f + 1, p))
+    f++;
+  return f;
+}
+
+/* Procura e reserva um bit desligado no mapa, uma palavra de 64 bits por
+   vez, começando pelo cursor da fatia da thread e passando para as
+   fatias seguintes se ela estiver cheia. Com palavra_livre, só serve o
+   primeiro bit de uma palavra toda desligada. Os bits para os quais
+   excluido (se não for NULL) devolve 1 contam como ligados. Devolve o
+   número do bit ou -1 se o mapa estiver cheio */
+int64_t reserva_bit (uint64_t *mapa, uint32_t palavras, fatia_mapa *fatias,
+                     uint32_t inicio, int palavra_livre, int (*excluido) (uint32_t)) {
+  int minha = fatia_da_thread ();
+  uint32_t varridas = 0;
+
+  for (int i = 0; i < N_FATIAS; i++) {
+    int f = (minha + i) % N_FATIAS;
+    uint32_t ini = INICIO_FATIA(f, palavras);
+    uint32_t fim = INICIO_FATIA(f + 1, palavras);
+    if (ini == fim)
+      continue;
+
+    pthread_mutex_lock (&fatias[f].trava);
+    uint32_t w = fatias[f].cursor;
+    if (w < ini || w >= fim)
+      w = ini;
+    for (uint32_t k = ini; k < fim; k++) {
+      varridas++;
+      // Com palavra_livre, só o primeiro bit de uma palavra toda livre
+      uint64_t livres = palavra_livre ? mapa[w] == 0 : ~mapa[w];
+      for (; livres != 0; livres &= livres - 1) {
+        uint32_t n = w * 64 + __builtin_ctzll(livres);
+        if (excluido != NULL && excluido (n))
+          continue;
+        liga_bit (mapa, inicio, n);
+        fatias[f].cursor = w;
+        pthread_mutex_unlock (&fatias[f].trava);
+        CONTA (palavras_varridas, varridas);
+        return n;
+      }
+      if (++w == fim)
+        w = ini;
+    }
+    pthread_mutex_unlock (&fatias[f].trava);
+  }
+  CONTA (palavras_varridas, varridas);
+  return -1;
+}
+
+/* Reserva o bit n do mapa se ele estiver desligado e excluido (se não for
+   NULL) devolver 0 para ele. Devolve 1 se reservou */
+int reserva_bit_se_livre (uint64_t *mapa, uint32_t palavras, fatia_mapa *fatias,
+                          uint32_t inicio, uint32_t n, int (*excluido) (uint32_t)) {
+  int f = fatia_da_palavra (n / 64, palavras);
+  int reservou = 0;
+  pthread_mutex_lock (&fatias[f].trava);
+  if (!((mapa[n / 64] >> (n % 64)) & 1) &&
+      (excluido == NULL || !excluido (n))) {
+    liga_bit (mapa, inicio, n);
+    reservou = 1;
+  }
+  pthread_mutex_unlock (&fatias[f].trava);
+  return reservou;
+}
+
+/* Desliga o bit n do mapa, com a trava da sua fatia */
+void libera_bit (uint64_t *mapa, uint32_t palavras, fatia_mapa *fatias,
+                 uint32_t inicio, uint32_t n) {
+  int f = fatia_da_palavra (n / 64, palavras);
+  pthread_mutex_lock (&fatias[f].trava);
+  desliga_bit (mapa, inicio, n);
+  pthread_mutex_unlock (&fatias[f].trava);
+}
 
-/* Função que salva o disco (RAM) no arquivo hdd1 (persistente) */
-void salva_disco(){
-	FILE *file  = fopen ("hdd1", "wb");
-  fwrite (disco, TAM_BLOCO, MAX_BLOCOS, file);
-  printf ("Salvando arquivo HDD\n");
-  fclose (file);
+/* Devolve 1 se o bloco, desligado no mapa, ainda não pode ter um novo dono */
+int bloco_preso (uint32_t bloco) {
+  return contem_bloco (&presos, bloco) || contem_bloco (&em_leitura, bloco);
+}
+
+/* Reserva um bloco livre do disco. Devolve 0 se não houver espaço (o
+   bloco 0 pertence ao superbloco e nunca é um bloco de dados) */
+uint32_t aloca_bloco() {
+  int64_t b = reserva_bit (mapa_blocos, PALAVRAS_MAPA_BLOCOS, fatias_blocos,
+                           INICIO_MAPA_BLOCOS, 0, bloco_preso);
+  if (b < 0)
+    return 0;
+  __atomic_fetch_sub (&free_space, 1, __ATOMIC_RELAXED);
+  return b;
+}
+
+/* Reserva o primeiro bloco de 64 blocos livres contíguos, para o início
+   de uma sequência que quem chama estende com aloca_bloco_se_livre.
+   Devolve 0 se nenhuma palavra do mapa estiver toda livre */
+uint32_t aloca_sequencia() {
+  int64_t b = reserva_bit (mapa_blocos, PALAVRAS_MAPA_BLOCOS, fatias_blocos,
+                           INICIO_MAPA_BLOCOS, 1, bloco_preso);
+  if (b <= 0)
+    return 0;
+  __atomic_fetch_sub (&free_space, 1, __ATOMIC_RELAXED);
+  return b;
+}
+
+/* Reserva o bloco alvo se ele estiver livre. Devolve 1 se reservou */
+int aloca_bloco_se_livre (uint32_t alvo) {
+  if (alvo > 0 && alvo < MAX_BLOCOS &&
+      reserva_bit_se_livre (mapa_blocos, PALAVRAS_MAPA_BLOCOS, fatias_blocos,
+                            INICIO_MAPA_BLOCOS, alvo, bloco_preso)) {
+    __atomic_fetch_sub (&free_space, 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+  return 0;
+}
+
+/* Reserva o bloco alvo se ele estiver livre, ou qualquer outro bloco livre
+   caso contrário. Usado para manter os blocos de um arquivo contíguos */
+uint32_t aloca_bloco_perto (uint32_t alvo) {
+  if (aloca_bloco_se_livre (alvo))
+    return alvo;
+  return aloca_bloco();
+}
+
+void libera_bloco (uint32_t bloco) {
+  // Preso antes de o bit ser desligado, para o alocador nunca o ver livre
+  int retido = contem_bloco (&retidos, bloco);
+  if (retido) {
+    acrescenta_bloco (&presos, bloco, 1);
+    __atomic_fetch_add (&blocos_presos, 1, __ATOMIC_RELAXED);
+  }
+  libera_bit (mapa_blocos, PALAVRAS_MAPA_BLOCOS, fatias_blocos, INICIO_MAPA_BLOCOS, bloco);
+  if (!retido)
+    __atomic_fetch_add (&free_space, 1, __ATOMIC_RELAXED);
+  acrescenta_bloco (&a_perfurar, bloco, 1);
+  esquece_bloco (bloco);
+}
+
+/* Libera um bloco de dados do arquivo id, com a trava de escrita do
+   inode. Se algum arquivo aberto dele respondeu a um read_buf com o
+   descritor do hdd1, o libfuse pode ainda não ter lido o bloco: ele fica
+   em em_leitura, sem novo dono, até o release desses arquivos */
+void libera_bloco_de (uint32_t id, uint32_t bloco) {
+  if (__atomic_load_n (&leitores_fd[id], __ATOMIC_RELAXED) == 0) {
+    libera_bloco (bloco);
+    return;
+  }
+  acrescenta_bloco (&em_leitura, bloco, id);
+  __atomic_fetch_add (&blocos_em_leitura, 1, __ATOMIC_RELAXED);
+  libera_bit (mapa_blocos, PALAVRAS_MAPA_BLOCOS, fatias_blocos, INICIO_MAPA_BLOCOS, bloco);
+  esquece_bloco (bloco);
+}
+
+/* Termina a liberação de um bloco que estava em em_leitura, como
+   libera_bloco depois de desligar o bit */
+void solta_bloco_lido (uint32_t bloco) {
+  if (contem_bloco (&retidos, bloco)) {
+    acrescenta_bloco (&presos, bloco, 1);
+    __atomic_fetch_add (&blocos_presos, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_add (&free_space, 1, __ATOMIC_RELAXED);
+  }
+  acrescenta_bloco (&a_perfurar, bloco, 1);
+}
+
+/* Release de um arquivo aberto que contava em leitores_fd: com o último
+   do inode, os blocos que ele liberou nesse tempo voltam ao alocador */
+void solta_leitor_fd (uint32_t id) {
+  trava_escrita (id);
+  if (__atomic_sub_fetch (&leitores_fd[id], 1, __ATOMIC_RELAXED) == 0) {
+    uint32_t n = retira_valor (&em_leitura, id, solta_bloco_lido);
+    __atomic_fetch_sub (&blocos_em_leitura, n, __ATOMIC_RELAXED);
+  }
+  destrava (id);
+}
+
+/* Reserva um inode livre. Devolve N_INODES + 1 se não houver */
+uint32_t aloca_inode() {
+  int64_t i = reserva_bit (mapa_inodes, PALAVRAS_MAPA_INODES, fatias_inodes,
+                           INICIO_MAPA_INODES, 0, NULL);
+  if (i < 0)
+    return N_INODES + 1;
+  __atomic_fetch_sub (&inodes_livres, 1, __ATOMIC_RELAXED);
+  return i;
+}
+
+/* Reserva o inode id, que deve estar livre. Devolve N_INODES + 1 se não
+   estiver */
+uint32_t aloca_inode_em (uint32_t id) {
+  if (!reserva_bit_se_livre (mapa_inodes, PALAVRAS_MAPA_INODES, fatias_inodes,
+                             INICIO_MAPA_INODES, id, NULL))
+    return N_INODES + 1;
+  __atomic_fetch_sub (&inodes_livres, 1, __ATOMIC_RELAXED);
+  return id;
+}
+
+/* Devolve 1 se o inode estiver em uso */
+int inode_em_uso (uint32_t id) {
+  return (__atomic_load_n (&mapa_inodes[id / 64], __ATOMIC_ACQUIRE) >> (id % 64)) & 1;
+}
+
+/* Devolve a lista de extents do inode, que fica no próprio inode ou, quando
+   não cabe mais nele, no bloco indireto de extents */
+extent *extents_de (uint32_t id) {
+  if (superbloco[id].bloco_extents != 0)
+    return (extent*) (disco + DISCO_OFFSET(superbloco[id].bloco_extents));
+  return superbloco[id].extents;
+}
+
+/* Marca como sujos o inode e o bloco indireto de extents, se houver */
+void marca_extents (uint32_t id) {
+  marca_inode (id);
+  if (superbloco[id].bloco_extents != 0)
+    marca_meta (superbloco[id].bloco_extents, 0, TAM_BLOCO);
+}
+
+/* Busca binária pelo último extent que começa no bloco lógico indicado ou
+   antes dele. Devolve -1 se todos os extents começam depois */
+int procura_extent (const extent *e, int n, uint32_t logico) {
+  int ini = 0, fim = n - 1, achou = -1, passos = 0;
+  while (ini <= fim) {
+    int meio = (ini + fim) / 2;
+    passos++;
+    if (e[meio].inicio <= logico) {
+      achou = meio;
+      ini = meio + 1;
+    } else {
+      fim = meio - 1;
+    }
+  }
+  CONTA (buscas_extent, 1);
+  CONTA (passos_extent, passos);
+  return achou;
+}
+
+/* Devolve o bloco físico onde está o bloco lógico do arquivo, ou 0 se o
+   bloco lógico não estiver mapeado. O cursor é o índice do extent usado
+   na chamada anterior: se o bloco está nele ou no extent seguinte, como
+   num acesso sequencial, a busca binária é evitada. O cursor é apenas uma
+   dica, conferida com os extents atuais, e é atualizado na saída */
+uint32_t mapeia_bloco_cursor (uint32_t id, uint32_t logico, int *cursor) {
+  extent *e = extents_de (id);
+  int n = superbloco[id].n_extents;
+  int i = *cursor;
+  if (i < 0 || i >= n || e[i].inicio > logico ||
+      (i + 1 < n && e[i+1].inicio <= logico)) {
+    if (i >= 0 && i + 1 < n && e[i+1].inicio <= logico &&
+        (i + 2 == n || e[i+2].inicio > logico)) {
+      i++;
+      CONTA (acertos_cursor, 1);
+    } else {
+      i = procura_extent (e, n, logico);
+    }
+  } else {
+    CONTA (acertos_cursor, 1);
+  }
+  *cursor = i;
+  if (i < 0 || logico >= (uint64_t) e[i].inicio + e[i].tamanho)
+    return 0;
+  return e[i].bloco + (logico - e[i].inicio);
+}
+
+/* Devolve o bloco físico onde está o bloco lógico do arquivo, ou 0 se o
+   bloco lógico não estiver mapeado */
+uint32_t mapeia_bloco (uint32_t id, uint32_t logico) {
+  int cursor = -1;
+  return mapeia_bloco_cursor (id, logico, &cursor);
+}
+
+/* Abre espaço para um extent novo na posição pos da lista do inode,
+   passando os extents para um bloco indireto quando não cabem mais no
+   inode. Devolve 0 ou um código de erro negativo */
+int abre_extent (uint32_t id, int pos) {
+  inode *ino = &superbloco[id];
+  extent *e = extents_de (id);
+  int n = ino->n_extents;
+  if (ino->bloco_extents == 0 && n == N_EXTENTS_INODE) {
+    // Os extents não cabem mais no inode: passam para um bloco indireto
+    uint32_t b = aloca_bloco();
+    if (b == 0)
+      return -ENOSPC;
+    memcpy (disco + DISCO_OFFSET(b), ino->extents, sizeof(ino->extents));
+    memset (ino->extents, 0, sizeof(ino->extents));
+    ino->bloco_extents = b;
+    e = extents_de (id);
+  } else if (n == N_EXTENTS_BLOCO) {
+    return -EFBIG;
+  }
+  memmove (&e[pos+1], &e[pos], (n - pos) * sizeof(extent));
+  ino->n_extents++;
+  return 0;
+}
+
+/* Inclui o mapeamento do bloco lógico para o bloco físico na lista de
+   extents do inode. Se o bloco continua um extent vizinho, o extent só
+   cresce, então alocações contíguas viram um único extent */
+int insere_extent (uint32_t id, uint32_t logico, uint32_t fisico) {
+  inode *ino = &superbloco[id];
+  extent *e = extents_de (id);
+  int n = ino->n_extents;
+  int i = procura_extent (e, n, logico);
+
+  // Continua o extent anterior
+  if (i >= 0 && e[i].inicio + e[i].tamanho == logico &&
+      e[i].bloco + e[i].tamanho == fisico && e[i].tamanho < UINT32_MAX) {
+    e[i].tamanho++;
+    // O bloco pode ter emendado este extent com o seguinte
+    if (i + 1 < n && e[i].inicio + e[i].tamanho == e[i+1].inicio &&
+        e[i].bloco + e[i].tamanho == e[i+1].bloco &&
+        (uint64_t) e[i].tamanho + e[i+1].tamanho <= UINT32_MAX) {
+      e[i].tamanho += e[i+1].tamanho;
+      memmove (&e[i+1], &e[i+2], (n - i - 2) * sizeof(extent));
+      ino->n_extents--;
+    }
+    marca_extents (id);
+    return 0;
+  }
+
+  // Antecede o extent seguinte
+  if (i + 1 < n && logico + 1 == e[i+1].inicio && fisico + 1 == e[i+1].bloco &&
+      e[i+1].tamanho < UINT32_MAX) {
+    e[i+1].inicio--;
+    e[i+1].bloco--;
+    e[i+1].tamanho++;
+    marca_extents (id);
+    return 0;
+  }
+
+  // Precisa de um extent novo
+  int erro = abre_extent (id, i + 1);
+  if (erro < 0)
+    return erro;
+  e = extents_de (id);
+  e[i+1].inicio = logico;
+  e[i+1].bloco = fisico;
+  e[i+1].tamanho = 1;
+  marca_extents (id);
+  return 0;
+}
+
+/* Libera os blocos lógicos [ini, fim) do arquivo id, encurtando, dividindo
+   ou retirando os extents atingidos. Os extents voltam para o inode quando
+   cabem nele, e um arquivo que fica sem blocos tem a área dos extents
+   zerada, já que ela passa a ser o seu conteúdo inline. Devolve 0 ou um
+   código de erro negativo se for preciso dividir um extent e não houver
+   lugar para a parte de cima */
+int libera_intervalo (uint32_t id, uint64_t ini, uint64_t fim) {
+  inode *ino = &superbloco[id];
+  extent *e = extents_de (id);
+  int n = ino->n_extents;
+  if (ini >= fim || n == 0)
+    return 0;
+
+  int i = procura_extent (e, n, ini < UINT32_MAX ? ini : UINT32_MAX);
+  if (i >= 0 && e[i].inicio < ini && (uint64_t) e[i].inicio + e[i].tamanho > fim) {
+    // O intervalo fica no meio do extent, que é dividido em dois
+    int erro = abre_extent (id, i + 1);
+    if (erro < 0)
+      return erro;
+    e = extents_de (id);
+    n = ino->n_extents;
+    uint32_t desloc = fim - e[i].inicio;
+    e[i+1].inicio = fim;
+    e[i+1].bloco = e[i].bloco + desloc;
+    e[i+1].tamanho = e[i].tamanho - desloc;
+    e[i].tamanho = desloc;
+  }
+
+  // Os extents que sobram são compactados no lugar
+  int j = i < 0 ? 0 : i;
+  for (int k = j; k < n; k++) {
+    uint64_t a = e[k].inicio, b = a + e[k].tamanho;
+    uint64_t la = a > ini ? a : ini, lb = b < fim ? b : fim;
+    if (la < lb) {
+      for (uint64_t x = la; x < lb; x++)
+        libera_bloco_de (id, e[k].bloco + (x - a));
+      if (la > a) { // Sobra o começo
+        e[k].tamanho = la - a;
+      } else if (lb < b) { // Sobra o fim
+        e[k].inicio = lb;
+        e[k].bloco += lb - a;
+        e[k].tamanho = b - lb;
+      } else {
+        continue;
+      }
+    }
+    e[j++] = e[k];
+  }
+  memset (&e[j], 0, (n - j) * sizeof(extent));
+  ino->n_extents = j;
+
+  if (ino->bloco_extents != 0 && j <= N_EXTENTS_INODE) {
+    // Os extents voltam para o inode e o bloco indireto é liberado
+    uint32_t b = ino->bloco_extents;
+    ino->bloco_extents = 0;
+    memcpy (ino->extents, e, j * sizeof(extent));
+    libera_bloco (b);
+  }
+  if (j == 0 && ino->bloco_extents == 0)
+    memset (ino->dados, 0, TAM_INLINE);
+  marca_extents (id);
+  return 0;
+}
+
+/* Devolve o bloco físico do bloco lógico do arquivo, reservando um bloco
+   zerado se ele ainda não estiver mapeado. O bloco reservado é, sempre que
+   possível, o seguinte ao do bloco lógico anterior. Devolve 0 se não
+   houver espaço. O cursor é o mesmo de mapeia_bloco_cursor */
+uint32_t bloco_do_arquivo (uint32_t id, uint32_t logico, int *cursor) {
+  uint32_t b = mapeia_bloco_cursor (id, logico, cursor);
+  if (b != 0)
+    return b;
+
+  uint32_t anterior = logico > 0 ? mapeia_bloco_cursor (id, logico - 1, cursor) : 0;
+  b = aloca_bloco_perto (anterior != 0 ? anterior + 1 : 0);
+  if (b == 0)
+    return 0;
+  if (insere_extent (id, logico, b) < 0) {
+    libera_bloco (b);
+    return 0;
+  }
+  // Um bloco reaproveitado pode conter dados de um arquivo apagado
+  memset (disco + DISCO_OFFSET(b), 0, TAM_BLOCO);
+  marca_sujo (b);
+  return b;
+}
+
+/* Reserva os blocos lógicos ainda não mapeados de [ini, fim] do arquivo
+   em sequências de blocos físicos contíguos: cada buraco continua o bloco
+   físico do bloco lógico anterior quando ele está livre e, senão, começa
+   numa palavra livre do mapa. Devolve 0 ou um código de erro negativo */
+int aloca_intervalo (uint32_t id, uint32_t ini, uint32_t fim) {
+  int cursor = -1;
+  uint64_t logico = ini;
+  while (logico <= fim) {
+    if (mapeia_bloco_cursor (id, logico, &cursor) != 0) {
+      logico++;
+      continue;
+    }
+    uint32_t n = 1; // Tamanho do buraco
+    while (logico + n <= fim && mapeia_bloco_cursor (id, logico + n, &cursor) == 0)
+      n++;
+
+    uint32_t anterior = logico > 0 ? mapeia_bloco_cursor (id, logico - 1, &cursor) : 0;
+    uint32_t b = 0;
+    if (anterior != 0 && aloca_bloco_se_livre (anterior + 1))
+      b = anterior + 1;
+    else if (n > 1)
+      b = aloca_sequencia ();
+    if (b == 0 && (b = aloca_bloco ()) == 0)
+      return -ENOSPC;
+    uint32_t obtidos = 1;
+    while (obtidos < n && aloca_bloco_se_livre (b + obtidos))
+      obtidos++;
+
+    for (uint32_t k = 0; k < obtidos; k++) {
+      if (insere_extent (id, logico + k, b + k) < 0) {
+        for (; k < obtidos; k++)
+          libera_bloco (b + k);
+        return -EFBIG;
+      }
+      // Um bloco reaproveitado pode conter dados de um arquivo apagado
+      memset (disco + DISCO_OFFSET(b + k), 0, TAM_BLOCO);
+      marca_sujo (b + k);
+      usa_bloco (b + k);
+    }
+    logico += obtidos;
+    cursor = -1;
+  }
+  return 0;
+}
+
+/* Um arquivo comum sem nenhum bloco e com até TAM_INLINE bytes tem o
+   conteúdo em superbloco[id].dados. Quando cresce além disso, o conteúdo
+   vai para um bloco por promove_inline */
+int eh_inline (uint32_t id) {
+  return S_ISREG(superbloco[id].type) && superbloco[id].n_extents == 0 &&
+    superbloco[id].bloco_extents == 0 && superbloco[id].tamanho <= TAM_INLINE;
+}
+
+/* Passa o conteúdo de um arquivo inline para o seu bloco lógico 0.
+   Devolve 0 ou -ENOSPC, caso em que o arquivo continua inline */
+int promove_inline (uint32_t id) {
+  char dados[TAM_INLINE];
+  memcpy (dados, superbloco[id].dados, TAM_INLINE);
+  memset (superbloco[id].dados, 0, TAM_INLINE);
+  int cursor = -1;
+  uint32_t b = bloco_do_arquivo (id, 0, &cursor);
+  if (b == 0) {
+    memcpy (superbloco[id].dados, dados, TAM_INLINE);
+    return -ENOSPC;
+  }
+  memcpy (disco + DISCO_OFFSET(b), dados, TAM_INLINE);
+  marca_sujo (b);
+  usa_bloco (b);
+  marca_inode (id);
+  return 0;
+}
+
+/* Zera os bytes [ini, fim) do arquivo que estão em blocos mapeados */
+void zera_trecho (uint32_t id, uint64_t ini, uint64_t fim) {
+  int cursor = -1;
+  while (ini < fim) {
+    uint32_t desloc = ini % TAM_BLOCO;
+    uint64_t n = TAM_BLOCO - desloc;
+    if (n > fim - ini)
+      n = fim - ini;
+    uint32_t bloco = mapeia_bloco_cursor (id, ini / TAM_BLOCO, &cursor);
+    if (bloco != 0) {
+      memset (disco + DISCO_OFFSET(bloco) + desloc, 0, n);
+      marca_sujo (bloco);
+      usa_bloco (bloco);
+    }
+    ini += n;
+  }
+}
+
+/* Zera o que houver no último bloco do arquivo além do seu tamanho, para
+   que um crescimento do arquivo leia zeros ali */
+void zera_apos_fim (uint32_t id) {
+  uint64_t tamanho = superbloco[id].tamanho;
+  zera_trecho (id, tamanho, (tamanho + TAM_BLOCO - 1) / TAM_BLOCO * TAM_BLOCO);
+}
+
+/* Quantidade de blocos ocupados pelo arquivo, contando o bloco indireto
+   de extents. Os buracos de um arquivo esparso não ocupam blocos */
+uint64_t blocos_alocados (uint32_t id) {
+  extent *e = extents_de (id);
+  uint64_t total = superbloco[id].bloco_extents != 0;
+  for (int i = 0; i < superbloco[id].n_extents; i++)
+    total += e[i].tamanho;
+  return total;
+}
+
+/* SEEK_DATA e SEEK_HOLE: devolve o primeiro offset a partir de offset que
+   tem dados (SEEK_DATA) ou que está num buraco (SEEK_HOLE), sendo o fim do
+   arquivo um buraco. Devolve -ENXIO se offset está além do fim ou se não
+   há mais dados */
+off_t busca_dado_buraco (uint32_t id, off_t offset, int whence) {
+  uint64_t tamanho = superbloco[id].tamanho;
+  if (offset < 0 || (uint64_t) offset >= tamanho)
+    return -ENXIO;
+  if (eh_inline (id))
+    return whence == SEEK_DATA ? offset : (off_t) tamanho;
+
+  extent *e = extents_de (id);
+  int n = superbloco[id].n_extents;
+  uint32_t logico = offset / TAM_BLOCO;
+  int i = procura_extent (e, n, logico);
+  int dentro = i >= 0 && logico < (uint64_t) e[i].inicio + e[i].tamanho;
+  if (whence == SEEK_DATA) {
+    if (dentro)
+      return offset;
+    if (i + 1 < n && (uint64_t) e[i+1].inicio * TAM_BLOCO < tamanho)
+      return (off_t) e[i+1].inicio * TAM_BLOCO;
+    return -ENXIO;
+  }
+  if (!dentro)
+    return offset;
+  // Extents encostados formam uma única sequência de dados
+  while (i + 1 < n && e[i+1].inicio == (uint64_t) e[i].inicio + e[i].tamanho)
+    i++;
+  uint64_t fim = ((uint64_t) e[i].inicio + e[i].tamanho) * TAM_BLOCO;
+  return fim < tamanho ? (off_t) fim : (off_t) tamanho;
+}
+
+/* Devolve ao mapa todos os blocos do arquivo e o próprio inode */
+void libera_inode (uint32_t id) {
+  // As escritas atrasadas de um arquivo apagado são descartadas
+  arquivo_aberto *a = atrasados[id];
+  if (a != NULL) {
+    atrasados[id] = NULL;
+    __atomic_fetch_sub (&blocos_reservados, a->reservados_atraso, __ATOMIC_RELAXED);
+    a->reservados_atraso = 0;
+    a->tam_atraso = 0;
+  }
+
+  extent *e = extents_de (id);
+  for (int i = 0; i < superbloco[id].n_extents; i++)
+    for (uint32_t k = 0; k < e[i].tamanho; k++)
+      libera_bloco_de (id, e[i].bloco + k);
+  if (superbloco[id].bloco_extents != 0)
+    libera_bloco (superbloco[id].bloco_extents);
+
+  memset (&superbloco[id], 0, sizeof(inode));
+  marca_inode (id);
+  geracoes[id]++;
+  libera_bit (mapa_inodes, PALAVRAS_MAPA_INODES, fatias_inodes, INICIO_MAPA_INODES, id);
+  __atomic_fetch_add (&inodes_livres, 1, __ATOMIC_RELAXED);
+}
+
+/* Conta os bits desligados das primeiras palavras do mapa */
+int64_t conta_livres (const uint64_t *mapa, uint32_t palavras) {
+  int64_t livres = 0;
+  for (uint32_t w = 0; w < palavras; w++)
+    livres += 64 - __builtin_popcountll(mapa[w]);
+  return livres;
+}
+
+/* Inicializa os mapas de um disco novo: os blocos do superbloco e dos
+   próprios mapas ficam em uso, assim como os bits que sobram no fim de
+   cada mapa, para que o alocador nunca os entregue */
+void formata_mapas() {
+  for (uint32_t b = 0; b < INICIO_DADOS; b++) // Inclui o journal
+    liga_bit (mapa_blocos, INICIO_MAPA_BLOCOS, b);
+  for (uint32_t b = MAX_BLOCOS; b < PALAVRAS_MAPA_BLOCOS * 64; b++)
+    liga_bit (mapa_blocos, INICIO_MAPA_BLOCOS, b);
+  for (uint32_t i = N_INODES; i < PALAVRAS_MAPA_INODES * 64; i++)
+    liga_bit (mapa_inodes, INICIO_MAPA_INODES, i);
+}
+
+/* Abre (criando se necessário) a imagem e calcula a geometria a partir do
+   seu cabeçalho. Uma imagem vazia fica com a geometria padrão e *novo
+   ligado. Devolve 0 ou um código de erro negativo */
+int abre_disco (int *novo) {
+  disco_fd = open (opcoes.imagem, O_RDWR | O_CREAT, 0644);
+  if (disco_fd < 0)
+    return -errno;
+  if (pread (disco_fd, &cabecalho, sizeof(cabecalho), 0) < 0)
+    return -errno;
+  *novo = cabecalho.magico == 0;
+  if (*novo)
+    cabecalho_padrao (&cabecalho, TAM_BLOCO_PADRAO, N_INODES_PADRAO);
+  int erro = calcula_geometria (&cabecalho, &geo);
+  if (erro < 0)
+    return erro;
+
+  // Blocos nunca escritos ficam como buracos (zeros) no arquivo
+  struct stat st;
+  if (fstat (disco_fd, &st) < 0)
+    return -errno;
+  if (st.st_size < (off_t) DISCO_OFFSET(MAX_BLOCOS) &&
+      ftruncate (disco_fd, (off_t) DISCO_OFFSET(MAX_BLOCOS)) < 0)
+    return -errno;
+  return 0;
+}
+
+/* Entrega para a função grava cada sequência contígua [ini, fim) dos n
+   blocos de itens, que estão em ordem. Devolve 0 ou o primeiro erro */
+int grava_itens (const item_conjunto *itens, uint32_t n,
+                 int (*grava)(uint32_t ini, uint32_t fim)) {
+  uint32_t i = 0;
+  while (i < n) {
+    uint32_t j = i + 1;
+    while (j < n && itens[j].bloco == itens[j - 1].bloco + 1)
+      j++;
+    int erro = grava (itens[i].bloco, itens[j - 1].bloco + 1);
+    if (erro < 0)
+      return erro;
+    i = j;
+  }
+  return 0;
+}
+
+/* Esvazia o conjunto de blocos sujos, entregando os seus blocos para a
+   função grava em sequências contíguas. Os que estão em exceto (se não for
+   NULL) ficam de fora e deixam de ser sujos: são gravados por quem cuida
+   de exceto. Se a gravação falha, todos voltam a ser sujos */
+int descarrega_sujos (int (*grava)(uint32_t ini, uint32_t fim), conjunto_blocos *exceto) {
+  item_conjunto *itens;
+  uint32_t n = esvazia_conjunto (&sujos, &itens), m = 0;
+  for (uint32_t i = 0; i < n; i++)
+    if (exceto == NULL || !contem_bloco (exceto, itens[i].bloco))
+      itens[m++] = itens[i];
+  int erro = grava_itens (itens, m, grava);
+  if (erro < 0)
+    for (uint32_t i = 0; i < m; i++)
+      marca_sujo (itens[i].bloco);
+  free (itens);
+  return erro;
+}
+
+/* Grava os blocos [ini, fim) da RAM na mesma posição do arquivo hdd1 */
+int grava_sequencia (uint32_t ini, uint32_t fim) {
+  size_t len = (size_t) (fim - ini) * TAM_BLOCO;
+  off_t pos = (off_t) ini * TAM_BLOCO;
+  while (len > 0) {
+    ssize_t n = pwrite (disco_fd, disco + pos, len, pos);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    len -= n;
+    pos += n;
+  }
+  return 0;
+}
+
+/* Força a escrita no hdd1 das páginas mapeadas dos blocos [ini, fim) */
+int sincroniza_sequencia (uint32_t ini, uint32_t fim) {
+  if (msync (disco + DISCO_OFFSET((size_t) ini), (size_t) (fim - ini) * TAM_BLOCO,
+             MS_SYNC) < 0)
+    return -errno;
+  return 0;
+}
+
+/* Grava len bytes de buf no hdd1 a partir do bloco b, sem passar pelo
+   disco em memória. No modo mmap o disco é o próprio hdd1 e a cópia é
+   feita nele */
+int grava_direto (uint32_t b, const void *buf, size_t len) {
+  if (opcoes.mmap) {
+    memcpy (disco + DISCO_OFFSET((size_t) b), buf, len);
+    return 0;
+  }
+  off_t pos = (off_t) b * TAM_BLOCO;
+  while (len > 0) {
+    ssize_t n = pwrite (disco_fd, buf, len, pos);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    buf = (const byte*) buf + n;
+    len -= n;
+    pos += n;
+  }
+  return 0;
+}
+
+/* Garante que as gravações feitas até aqui estão no dispositivo. No modo
+   mmap, os blocos [ini, fim) são os que precisam ir para o hdd1 */
+int sincroniza_intervalo (uint32_t ini, uint32_t fim) {
+  if (opcoes.mmap)
+    return sincroniza_sequencia (ini, fim);
+  if (fdatasync (disco_fd) < 0)
+    return -errno;
+  return 0;
+}
+
+uint32_t crc32 (const byte *p, size_t len) {
+  uint32_t crc = ~0u;
+  while (len-- > 0)
+    crc = tabela_crc[(crc ^ (uint8_t) *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+void inicia_crc (void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    tabela_crc[i] = c;
+  }
+}
+
+/* Grava o cabeçalho do journal, que passa a esperar a transação de
+   sequência sequencia_journal no bloco 1 */
+int grava_cabecalho_journal (void) {
+  byte *bloco = disco + DISCO_OFFSET(INICIO_JOURNAL);
+  memset (bloco, 0, TAM_BLOCO);
+  cabecalho_journal *cj = (cabecalho_journal*) bloco;
+  cj->magico = MAGICO_JOURNAL;
+  cj->sequencia = sequencia_journal;
+  // No modo mmap o bloco já foi alterado no próprio hdd1
+  int erro = opcoes.mmap ? 0 : grava_sequencia (INICIO_JOURNAL, INICIO_JOURNAL + 1);
+  if (erro == 0)
+    erro = sincroniza_intervalo (INICIO_JOURNAL, INICIO_JOURNAL + 1);
+  return erro;
+}
+
+/* Abre buracos no hdd1 nas sequências [ini, fim) de blocos livres */
+int perfura_sequencia (uint32_t ini, uint32_t fim) {
+  if (fallocate (disco_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                 (off_t) DISCO_OFFSET(ini), (off_t) (fim - ini) * TAM_BLOCO) < 0 &&
+      errno != EOPNOTSUPP)
+    return -errno;
+  return 0;
+}
+
+/* Perfura no hdd1 os blocos liberados desde o último checkpoint que
+   continuam livres. Chamado no checkpoint, quando a liberação já está no
+   journal e os blocos já foram gravados */
+int perfura_livres (void) {
+  item_conjunto *itens;
+  uint32_t n = esvazia_conjunto (&a_perfurar, &itens), m = 0;
+  for (uint32_t i = 0; i < n; i++)
+    if (!((mapa_blocos[itens[i].bloco / 64] >> (itens[i].bloco % 64)) & 1))
+      itens[m++] = itens[i];
+  int erro = grava_itens (itens, m, perfura_sequencia);
+  free (itens);
+  return erro;
+}
+
+/* Checkpoint: com as transações já persistidas, grava todos os blocos
+   sujos no seu lugar e esvazia o journal. Chamado com a trava de escrita
+   do journal e sem alterações pendentes */
+int checkpoint_travado (void) {
+  int erro;
+  // Os retidos vão junto com os sujos e voltam a ser retidos numa falha
+  item_conjunto *itens;
+  uint32_t n = esvazia_conjunto (&retidos, &itens);
+  for (uint32_t i = 0; i < n; i++)
+    marca_sujo (itens[i].bloco);
+  if (opcoes.mmap)
+    erro = descarrega_sujos (sincroniza_sequencia, NULL);
+  else if ((erro = descarrega_sujos (grava_sequencia, NULL)) == 0 &&
+           fdatasync (disco_fd) < 0)
+    erro = -errno;
+  if (erro < 0)
+    for (uint32_t i = 0; i < n; i++)
+      retem_bloco (itens[i].bloco);
+  free (itens);
+  if (erro < 0)
+    return erro;
+  // Só devolve espaço ao sistema de arquivos do hdd1: uma falha não impede o checkpoint
+  perfura_livres ();
+  // Com o journal vazio, os blocos presos podem ter um novo dono
+  n = esvazia_conjunto (&presos, &itens);
+  free (itens);
+  __atomic_fetch_sub (&blocos_presos, n, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&free_space, n, __ATOMIC_RELAXED);
+  cabeca_journal = 1;
+  return grava_cabecalho_journal ();
+}
+
+/* Monta em transacao os trechos alterados desde o último commit,
+   esvaziando alterados. Devolve o tamanho da transação em bytes, 0 se não
+   havia alterações ou -1 se ela não cabe no journal (e nada foi montado,
+   mas os blocos continuam retidos para o checkpoint) */
+long monta_transacao (void) {
+  item_conjunto *itens;
+  uint32_t n = esvazia_conjunto (&alterados, &itens);
+  size_t tam = sizeof(cabecalho_transacao);
+  for (uint32_t i = 0; i < n; i++)
+    tam += sizeof(registro_journal) + __builtin_popcountll (itens[i].valor) * TRECHO_JOURNAL;
+  if (n == 0 || tam > (size_t) (N_BLOCOS_JOURNAL - 1) * TAM_BLOCO) {
+    free (itens);
+    return n == 0 ? 0 : -1;
+  }
+
+  cabecalho_transacao *ct = (cabecalho_transacao*) transacao;
+  byte *p = transacao + sizeof(cabecalho_transacao);
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t b = itens[i].bloco;
+    registro_journal *r = (registro_journal*) p;
+    r->bloco = b;
+    r->reservado = 0;
+    r->trechos = itens[i].valor;
+    p += sizeof(registro_journal);
+    for (uint64_t t = itens[i].valor; t != 0; t &= t - 1) {
+      memcpy (p, disco + DISCO_OFFSET((size_t) b) + __builtin_ctzll(t) * TRECHO_JOURNAL,
+              TRECHO_JOURNAL);
+      p += TRECHO_JOURNAL;
+    }
+  }
+  free (itens);
+  ct->magico = MAGICO_TRANSACAO;
+  ct->crc = 0;
+  ct->sequencia = sequencia_journal;
+  ct->n_registros = n;
+  ct->tamanho = tam;
+  ct->crc = crc32 (transacao, tam);
+  return tam;
+}
+
+/* Commit do journal. As alterações de metadados pendentes vão, numa única
+   transação, para o fim do journal e os blocos de dados sujos são gravados
+   no lugar. Com sincronizar, tudo isso é persistido com um único
+   fdatasync (ou msync, no modo mmap). Quando o journal passa da metade,
+   com checkpoint ou com blocos presos, os metadados também são gravados no
+   lugar e o journal é esvaziado. Threads que pedem o commit ao mesmo tempo esperam a trava e
+   encontram o seu trabalho já feito pela primeira */
+int confirma_journal (int sincronizar, int checkpoint) {
+  int erro = 0;
+  pthread_rwlock_wrlock (&trava_journal);
+  __atomic_store_n (&trechos_pendentes, 0, __ATOMIC_RELAXED);
+
+  long tam = monta_transacao ();
+  uint32_t blocos = tam > 0 ? (tam + TAM_BLOCO - 1) / TAM_BLOCO : 0;
+  if (tam < 0 || cabeca_journal + blocos > N_BLOCOS_JOURNAL) {
+    /* A transação não cabe no journal: o disco inteiro é gravado no lugar,
+       como antes do journal, sem proteção contra uma queda no meio */
+    fprintf (stderr, "BrisaFS: transação maior que o journal, gravando no lugar\n");
+    erro = checkpoint_travado ();
+    pthread_rwlock_unlock (&trava_journal);
+    return erro;
+  }
+
+  // Dados primeiro, metadados retidos ficam para o checkpoint
+  if (!opcoes.mmap)
+    erro = descarrega_sujos (grava_sequencia, &retidos);
+  else if (sincronizar)
+    erro = descarrega_sujos (sincroniza_sequencia, &retidos);
+  if (erro == 0 && blocos > 0) {
+    memset (transacao + tam, 0, blocos * TAM_BLOCO - tam);
+    erro = grava_direto (INICIO_JOURNAL + cabeca_journal, transacao, blocos * TAM_BLOCO);
+    if (erro == 0 && !opcoes.mmap) // Mantém a cópia em memória igual ao hdd1
+      memcpy (disco + DISCO_OFFSET(INICIO_JOURNAL + cabeca_journal), transacao,
+              blocos * TAM_BLOCO);
+  }
+  if (erro == 0 && (sincronizar || checkpoint))
+    erro = sincroniza_intervalo (INICIO_JOURNAL + cabeca_journal,
+                                 INICIO_JOURNAL + cabeca_journal + blocos);
+  if (erro == 0) {
+    cabeca_journal += blocos;
+    sequencia_journal += blocos > 0;
+    // Blocos presos só voltam ao alocador com o journal vazio
+    if (checkpoint || cabeca_journal > N_BLOCOS_JOURNAL / 2 ||
+        __atomic_load_n (&blocos_presos, __ATOMIC_RELAXED) > 0) {
+      if (!sincronizar && !checkpoint) // O journal precisa estar persistido antes
+        erro = sincroniza_intervalo (INICIO_JOURNAL + 1, INICIO_JOURNAL + cabeca_journal);
+      if (erro == 0)
+        erro = checkpoint_travado ();
+    }
+  }
+  pthread_rwlock_unlock (&trava_journal);
+  return erro;
+}
+
+/* Confere que os registros da transação ct cabem no seu tamanho e só
+   apontam para blocos do disco. Devolve 1 se ela pode ser reaplicada */
+int registros_validos (const cabecalho_transacao *ct) {
+  const byte *p = (const byte*) ct + sizeof(cabecalho_transacao);
+  const byte *fim = (const byte*) ct + ct->tamanho;
+  for (uint32_t r = 0; r < ct->n_registros; r++) {
+    if ((size_t) (fim - p) < sizeof(registro_journal))
+      return 0;
+    const registro_journal *reg = (const registro_journal*) p;
+    p += sizeof(registro_journal);
+    size_t conteudo = (size_t) __builtin_popcountll (reg->trechos) * TRECHO_JOURNAL;
+    if (reg->bloco >= MAX_BLOCOS || (size_t) (fim - p) < conteudo)
+      return 0;
+    p += conteudo;
+  }
+  return 1;
+}
+
+/* Reaplica no disco em memória as transações válidas do journal, na ordem
+   em que foram gravadas. Devolve quantas foram reaplicadas */
+int reaplica_journal (void) {
+  cabecalho_journal *cj = (cabecalho_journal*) (disco + DISCO_OFFSET(INICIO_JOURNAL));
+  if (cj->magico != MAGICO_JOURNAL) { // Journal nunca usado
+    sequencia_journal = 1;
+    return 0;
+  }
+  sequencia_journal = cj->sequencia;
+  int n = 0;
+  uint32_t pos = 1;
+  while (pos < N_BLOCOS_JOURNAL) {
+    byte *t = disco + DISCO_OFFSET(INICIO_JOURNAL + pos);
+    cabecalho_transacao *ct = (cabecalho_transacao*) t;
+    if (ct->magico != MAGICO_TRANSACAO || ct->sequencia != sequencia_journal ||
+        ct->tamanho < sizeof(cabecalho_transacao) ||
+        ct->tamanho > (size_t) (N_BLOCOS_JOURNAL - pos) * TAM_BLOCO)
+      break;
+    uint32_t crc = ct->crc;
+    ct->crc = 0;
+    int valida = crc32 (t, ct->tamanho) == crc;
+    ct->crc = crc;
+    if (!valida) // Transação interrompida pela queda
+      break;
+    // Com o crc certo, só uma imagem corrompida de outra forma chega aqui
+    if (!registros_validos (ct)) {
+      fprintf (stderr, "BrisaFS: transação %lu do journal com registros "
+               "inválidos, reaplicação interrompida\n", ct->sequencia);
+      break;
+    }
+
+    byte *p = t + sizeof(cabecalho_transacao);
+    for (uint32_t r = 0; r < ct->n_registros; r++) {
+      registro_journal *reg = (registro_journal*) p;
+      p += sizeof(registro_journal);
+      for (uint64_t m = reg->trechos; m != 0; m &= m - 1) {
+        memcpy (disco + DISCO_OFFSET((size_t) reg->bloco) + __builtin_ctzll(m) * TRECHO_JOURNAL,
+                p, TRECHO_JOURNAL);
+        p += TRECHO_JOURNAL;
+      }
+      // Está no journal até o próximo checkpoint, como um bloco alterado agora
+      retem_bloco (reg->bloco);
+    }
+    pos += (ct->tamanho + TAM_BLOCO - 1) / TAM_BLOCO;
+    sequencia_journal++;
+    n++;
+  }
+  return n;
+}
+
+/* Função que salva o disco (RAM) no arquivo hdd1 (persistente): um commit
+   do journal, sem esperar o dispositivo */
+int salva_disco(){
+  return confirma_journal (0, 0);
+}
+
+/* Garante que tudo o que foi alterado até agora está no hdd1 */
+int sincroniza_disco() {
+  return confirma_journal (1, 0);
+}
+
+/* Delimitam uma operação que altera metadados: o commit nunca acontece
+   entre as duas. Ao final, se as alterações pendentes já ocupam um quarto
+   do journal, é feito um commit (sem esperar o dispositivo). Se os blocos
+   presos passam do espaço livre, um checkpoint os devolve */
+void inicia_operacao (void) {
+  pthread_rwlock_rdlock (&trava_journal);
+}
+
+void termina_operacao (void) {
+  pthread_rwlock_unlock (&trava_journal);
+  if (__atomic_load_n (&trechos_pendentes, __ATOMIC_RELAXED) * TRECHO_JOURNAL >
+      N_BLOCOS_JOURNAL / 4 * TAM_BLOCO)
+    confirma_journal (0, 0);
+  else if (__atomic_load_n (&blocos_presos, __ATOMIC_RELAXED) >
+           __atomic_load_n (&free_space, __ATOMIC_RELAXED))
+    confirma_journal (0, 1);
+}
+
+/* Mapeia a imagem já aberta como o disco. As páginas são trazidas do
+   arquivo sob demanda, no primeiro acesso a cada bloco */
+int mapeia_disco() {
+  disco = mmap (NULL, DISCO_OFFSET(MAX_BLOCOS), PROT_READ | PROT_WRITE,
+                MAP_SHARED, disco_fd, 0);
+  if (disco == MAP_FAILED)
+    return -errno;
+  return 0;
 }
 
 /* Função que verifica se o arquivo hdd1 já existe.
 Em caso positivo, carrega todo o conteúdo do arquivo hdd1 para a memória principal */
 int carrega_disco() {
   size_t result;
-  size_t lSize;
-  if (access("hdd1", F_OK) == 0){
-  	FILE *file = fopen ("hdd1", "rb");
-    lSize = ftell (file);
-    result = fread (disco,TAM_BLOCO,MAX_BLOCOS,file);
-    fclose (file);
-    printf ("Carregou...\n");
-    printf ("lSize = %lu\n", lSize);
-    printf ("result = %lu\n", result);
-    
-    // Esse loop atualiza a variável free_space
-    for (int i = 0; i < N_SUPERBLOCKS; i++) {
-    	if(superbloco[i].bloco != 0)
-    		free_space--;
+  if (access(opcoes.imagem, F_OK) == 0){
+    if (!opcoes.mmap) { // No modo mmap o disco já é o próprio arquivo
+  	  FILE *file = fopen (opcoes.imagem, "rb");
+      result = fread (disco,TAM_BLOCO,MAX_BLOCOS,file);
+      fclose (file);
+      fprintf (stderr, "Carregou...\n");
+      fprintf (stderr, "result = %lu\n", result);
     }
     return 1;
   } else
     return 0;
 }
 
-/* Preenche os campos do superbloco do primeiro bloc vazio que encontrar */
-int preenche_bloco (const char *nome, uint16_t direitos, uint16_t tamanho, 
+/* Preenche os campos do superbloco de um inode livre e grava o conteúdo
+   do arquivo em blocos livres, de preferência contíguos. Devolve 0 ou um
+   código de erro negativo */
+int preenche_bloco (const char *nome, uint16_t direitos, uint64_t tamanho, 
 											const byte *conteudo, mode_t type) {
   
-  // Quantidade de blocos que o arquivo ocupa
-  int num_blocos = (1+((tamanho-1) / TAM_BLOCO));
-  // Variável para fazer o link entre dois blocos de um mesmo arquivo
-  int bloco_anterior = 0;
+  /* Quantidade de blocos que o arquivo ocupa (um diretório começa com dois
+     e um arquivo pequeno não ocupa nenhum) */
+  int64_t num_blocos = type == S_IFDIR ? 2 : (tamanho + TAM_BLOCO - 1) / TAM_BLOCO;
+  if (S_ISREG(type) && tamanho <= TAM_INLINE)
+    num_blocos = 0;
   
-	printf("Blocos necessários para o arquivo: %d\n", num_blocos);
-	
 	if (tamanho > MAX_FILE_SIZE) {
-		printf("Tamanho máximo de arquivo excedido!\n");
-		return 1; //EFBIG
-		
-	} else if (num_blocos > free_space) {
-		printf("Não há espaço suficiente em disco para este arquivo!\n");
-		return 2; //ENOSPC
+		return -EFBIG; // Tamanho máximo de arquivo excedido
+	} else if (num_blocos + 1 > __atomic_load_n (&free_space, __ATOMIC_RELAXED) -
+	                            __atomic_load_n (&blocos_reservados, __ATOMIC_RELAXED) ||
+	           __atomic_load_n (&inodes_livres, __ATOMIC_RELAXED) == 0) {
+		return -ENOSPC; // Não há espaço suficiente em disco para este arquivo
 	}
-  
-  for (int k = 0; k < num_blocos; k++) {
-		printf("k = %d\n", k);
-		printf("N_SUPERBLOCKS = %lu\n", N_SUPERBLOCKS);
-		for (int isuperbloco = 0; isuperbloco < N_SUPERBLOCKS; isuperbloco++) {
-  		if (superbloco[isuperbloco].bloco == 0) { //ninguem usando
-    		uint16_t bloco = N_SUPERBLOCKS + isuperbloco + 1;
-    		printf("Inode vazio: %d - Bloco vazio %d\n", isuperbloco, bloco);
-    		if (k == 0) { //primeiro bloco
-    			printf("Entrei no k = 0\n");
-    			char *mnome = NULL;
-    			char *pai = NULL;
-
-    			quebra_nome(nome, &mnome, &pai);
-
-    			superbloco[isuperbloco].id = isuperbloco;
-    			strcpy(superbloco[isuperbloco].nome, mnome);
-    			superbloco[isuperbloco].direitos = direitos;
-    			superbloco[isuperbloco].tamanho = tamanho;
-    			superbloco[isuperbloco].bloco = bloco;
-    			superbloco[isuperbloco].type = type;
-    			superbloco[isuperbloco].proxbloco = 0;
-    			armazena_data (0, isuperbloco);
-    			
-    			bloco_anterior = isuperbloco;
-
-    			/* Para qualquer tipo de arquivo, exceto o diretório root, procura o 
-    			inode do diretório pai e se inclui dentro do bloco do diretório pai*/
-    			if (strcmp(mnome,"/")!=0) {
-    				dir = disco + DISCO_OFFSET(superbloco[dir_tree(pai)].bloco);
-						uint16_t *d = (uint16_t*) dir;
-						d[0]++;
-						d[d[0]] = isuperbloco;
-    			}
-    			
-    			free(mnome);
-    			free(pai);
-    			
-    			// Se for um diretório, inicializa informando que está vazio
-    			if (type == S_IFDIR) {
-    				dir = disco + DISCO_OFFSET(bloco);
-    				uint16_t *d = (uint16_t*) dir;
-    				d[0] = 0;
-    				return 0;
-    			} else { //Se for arquivo, grava o conteúdo
-    				if (conteudo != NULL) {
-    					printf("Conteúdo: %s\n", conteudo);
-    					printf("Tamanho do Conteúdo: %lu\n", sizeof(conteudo));
-    					if (sizeof(conteudo) > TAM_BLOCO) {
-      	 				memcpy(disco + DISCO_OFFSET(bloco), conteudo, TAM_BLOCO);
-      	 				free_space--;
-								break;
-							} else {
-								memcpy(disco + DISCO_OFFSET(bloco), conteudo, tamanho);
-								free_space--;
-								return 0;
-							}
-        		}
-    				else {
-    					printf("Criei um arquivo vazio!\n");
-        			memset(disco + DISCO_OFFSET(bloco), 0, tamanho);
-        			free_space--;
-        			return 0;
-        		}
-    			}
-    		} else { /* Se o conteudo precisa de mais que um bloco, executa esse 
-    								else para os demais blocos */
-    			superbloco[isuperbloco].id = isuperbloco;
-    			superbloco[isuperbloco].bloco = bloco;
-					superbloco[isuperbloco].proxbloco = 0;
-					
-					superbloco[bloco_anterior].proxbloco = isuperbloco;
-					bloco_anterior = isuperbloco;
-					
-					printf("Conteúdo: %s\n", conteudo);
-    			printf("Tamanho do Conteúdo: %lu\n", sizeof(conteudo));
-					if (sizeof(conteudo) > TAM_BLOCO) {
-      	  	memcpy(disco + DISCO_OFFSET(bloco), conteudo + DISCO_OFFSET(k), TAM_BLOCO);
-      	  	free_space--;
-						break;
-					} else {
-						memcpy(disco + DISCO_OFFSET(bloco), conteudo + DISCO_OFFSET(k), tamanho);
-						free_space--;
-						return 0;
-					}
-    		}
-			}
-		}
-	}
-	return 2; //ENOSPC
+
+  char *mnome = NULL;
+  char *pai = NULL;
+  quebra_nome(nome, &mnome, &pai);
+
+  int raiz = strcmp(mnome, "/") == 0;
+  if (strcmp(nome, ARQUIVO_ESTATISTICAS) == 0) { // Nome reservado
+    free(mnome);
+    free(pai);
+    return -EEXIST;
+  }
+  uint32_t id_pai = raiz ? 0 : dir_tree(pai);
+  uint32_t isuperbloco = N_INODES + 1;
+  int erro = 0;
+
+  if (strlen(mnome) > TAM_MAX_NOME) {
+    erro = -ENAMETOOLONG;
+    goto fim;
+  } else if (id_pai > N_INODES) {
+    erro = -ENOENT;
+    goto fim;
+  }
+
+  /* O inode novo só fica visível para as outras threads quando entra no
+     pai. A raiz é sempre o inode 0, qualquer que seja a fatia da thread */
+  isuperbloco = raiz ? aloca_inode_em (0) : aloca_inode();
+  if (isuperbloco > N_INODES) {
+    erro = -ENOSPC;
+    goto fim;
+  }
+
+  TRACE_INODE (isuperbloco);
+  memset(&superbloco[isuperbloco], 0, sizeof(inode));
+  superbloco[isuperbloco].direitos = direitos;
+  superbloco[isuperbloco].tamanho = tamanho;
+  superbloco[isuperbloco].type = type;
+  armazena_data (0, isuperbloco);
+
+  if (num_blocos == 0 && conteudo != NULL)
+    memcpy(superbloco[isuperbloco].dados, conteudo, tamanho);
+
+  // Reserva os blocos (zerados) e grava o conteúdo, se houver
+  int cursor = -1;
+  for (uint32_t k = 0; k < num_blocos; k++) {
+    uint32_t bloco = bloco_do_arquivo(isuperbloco, k, &cursor);
+    if (bloco == 0) {
+      erro = -ENOSPC;
+      goto fim;
+    }
+    if (conteudo != NULL) {
+      uint64_t len = tamanho - DISCO_OFFSET(k);
+      memcpy(disco + DISCO_OFFSET(bloco), conteudo + DISCO_OFFSET(k),
+             len > TAM_BLOCO ? TAM_BLOCO : len);
+    }
+  }
+
+  // Um diretório começa com o índice e uma folha vazia
+  if (type == S_IFDIR)
+    inicia_dir (isuperbloco);
+
+  /* Para qualquer tipo de arquivo, exceto o diretório root, se inclui
+  dentro do diretório pai, caso ainda não exista um arquivo com o mesmo nome */
+  if (!raiz) {
+    size_t len = strlen(mnome);
+    trava_escrita (id_pai);
+    if (!inode_em_uso(id_pai) || !S_ISDIR(superbloco[id_pai].type))
+      erro = -ENOTDIR;
+    else if (busca_entrada (id_pai, mnome, len, hash_nome (mnome, len)) <= N_INODES)
+      erro = -EEXIST;
+    else
+      erro = insere_entrada (id_pai, mnome, len, isuperbloco);
+    destrava (id_pai);
+  }
+
+fim:
+  if (erro < 0 && isuperbloco <= N_INODES)
+    libera_inode (isuperbloco);
+  free(mnome);
+  free(pai);
+  return erro;
+}
+
+// Lê um número com sufixo K, M ou G opcional. Devolve 0 se for inválido
+uint64_t le_tamanho (const char *s) {
+  char *fim;
+  errno = 0;
+  uint64_t n = strtoull (s, &fim, 10);
+  if (errno != 0 || fim == s)
+    return 0;
+  switch (*fim) {
+  case 'G': case 'g': n <<= 10; // fall through
+  case 'M': case 'm': n <<= 10; // fall through
+  case 'K': case 'k': n <<= 10; fim++; break;
+  }
+  return *fim == '\0' ? n : 0;
 }
 
-/* Inicializa o sistema de arquivos */
-void init_brisafs() {
-  disco = calloc (MAX_BLOCOS, TAM_BLOCO);
-  superbloco = (inode*) disco; //posição 0
-  dir = (byte*) disco; //posição 0
+/* Inicializa o sistema de arquivos. Devolve 0 ou -1 se a imagem não pôde
+   ser montada, depois de explicar o motivo na saída de erros. Os avisos
+   também vão para lá: o stdout é de quem usa a biblioteca */
+int init_brisafs() {
+  int novo;
 
-  if(carrega_disco() == 0){
+  if (opcoes.imagem == NULL)
+    opcoes.imagem = IMAGEM_PADRAO;
+  if (opcoes.cache != NULL) {
+    opcoes.limite_cache = le_tamanho (opcoes.cache);
+    if (opcoes.limite_cache == 0) {
+      fprintf(stderr, "Tamanho de cache inválido: %s\n", opcoes.cache);
+      return -1;
+    }
+  }
+  // O cache só decide o que sai da memória quando o disco é o próprio hdd1
+  if (opcoes.limite_cache > 0 && !opcoes.mmap) {
+    fprintf(stderr, "\t O cache de blocos usa o modo mmap\n");
+    opcoes.mmap = 1;
+  }
+  int erro = abre_disco (&novo);
+  if (erro == -EPROTONOSUPPORT) {
+    fprintf(stderr, "%s é uma imagem do BrisaFS de versão %u (esta é a %u); "
+            "recrie-a com o mkfs.brisafs\n", opcoes.imagem, cabecalho.versao, VERSAO_DISCO);
+    return -1;
+  } else if (erro == -EINVAL) {
+    fprintf(stderr, "%s não é uma imagem do BrisaFS\n", opcoes.imagem);
+    return -1;
+  } else if (erro < 0) {
+    fprintf(stderr, "Não foi possível abrir %s: %s\n", opcoes.imagem, strerror(-erro));
+    return -1;
+  }
+  if (opcoes.mmap) {
+    erro = mapeia_disco();
+    if (erro < 0) {
+      fprintf(stderr, "Não foi possível mapear o hdd1: %s\n", strerror(-erro));
+      return -1;
+    }
+  } else
+    disco = calloc (MAX_BLOCOS, TAM_BLOCO);
+  if (disco == NULL) {
+    fprintf(stderr, "Memória insuficiente para o disco de %zu bytes (veja -o mmap)\n",
+            DISCO_OFFSET(MAX_BLOCOS));
+    return -1;
+  }
+  superbloco = (inode*) (disco + DISCO_OFFSET(INICIO_SUPERBLOCO));
+  mapa_blocos = (uint64_t*) (disco + DISCO_OFFSET(INICIO_MAPA_BLOCOS));
+  mapa_inodes = (uint64_t*) (disco + DISCO_OFFSET(INICIO_MAPA_INODES));
+
+  travas = malloc (N_INODES * sizeof(pthread_rwlock_t));
+  geracoes = calloc (N_INODES, sizeof(uint32_t));
+  leitores_fd = calloc (N_INODES, sizeof(uint32_t));
+  atrasados = calloc (N_INODES, sizeof(arquivo_aberto*));
+  for (uint32_t i = 0; i < N_INODES; i++)
+    pthread_rwlock_init (&travas[i], NULL);
+  for (int f = 0; f < N_FATIAS; f++) {
+    pthread_mutex_init (&fatias_blocos[f].trava, NULL);
+    pthread_mutex_init (&fatias_inodes[f].trava, NULL);
+  }
+  inicia_dcache();
+  // madvise só tira da memória páginas inteiras
+  if (opcoes.limite_cache > 0 && TAM_BLOCO % sysconf(_SC_PAGESIZE) != 0)
+    fprintf(stderr, "\t Blocos de %u bytes são menores que uma página, cache desligado\n",
+            TAM_BLOCO);
+  else if (opcoes.limite_cache > 0 && inicia_cache (opcoes.limite_cache) < 0) {
+    fprintf(stderr, "Memória insuficiente para o cache de blocos\n");
+    return -1;
+  }
+#ifdef BRISAFS_TRACE
+  inicia_trace();
+#endif
+
+  inicia_conjunto (&sujos);
+  inicia_conjunto (&alterados);
+  inicia_conjunto (&retidos);
+  inicia_conjunto (&presos);
+  inicia_conjunto (&a_perfurar);
+  inicia_conjunto (&em_leitura);
+  transacao = malloc ((size_t) (N_BLOCOS_JOURNAL - 1) * TAM_BLOCO);
+  pthread_rwlockattr_t atributos;
+  pthread_rwlockattr_init (&atributos);
+  // O commit não pode esperar para sempre por um fluxo contínuo de operações
+  pthread_rwlockattr_setkind_np (&atributos, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init (&trava_journal, &atributos);
+  inicia_crc();
+  cabeca_journal = 1;
+  sequencia_journal = 1;
+
+  // O journal é reaplicado antes de qualquer outra leitura do disco
+  int carregou = !novo && carrega_disco() != 0;
+  if (carregou) {
+    int n = reaplica_journal();
+    if (n > 0)
+      fprintf (stderr, "Reaplicou %d transações do journal\n", n);
+  }
+
+  // Um hdd1 que nunca chegou a ser formatado não tem o bloco 0 em uso
+  int formatar = !carregou || !(mapa_blocos[0] & 1);
+  if (formatar) {
+    // O cabeçalho da imagem é gravado junto com o resto da formatação
+    memcpy (disco, &cabecalho, sizeof(cabecalho));
+    marca_sujo (0);
+    formata_mapas();
+  }
+
+  // Os contadores de espaço livre saem direto dos mapas
+  free_space = conta_livres (mapa_blocos, PALAVRAS_MAPA_BLOCOS);
+  inodes_livres = conta_livres (mapa_inodes, PALAVRAS_MAPA_INODES);
+
+  if (formatar) {
     //Cria o diretório raiz
     preenche_bloco ("/", DIREITOS_PADRAO, 64, NULL, S_IFDIR);
     //Cria um arquivo com as configurações do sistema de arquivos
     char *nome = "/BrisaFS.txt";
     
-    char str1[50];
-  	char str2[50];
-  	char str3[50];
-  	char str4[50];
-  	char str5[50];
-  	char str6[50];
-  	char str7[50];
-  	char str8[50];
-  	char str9[50];
-  	char *str = malloc(320);
+    char str1[64];
+  	char str2[64];
+  	char str3[64];
+  	char str4[64];
+  	char str5[64];
+  	char str6[64];
+  	char str7[64];
+  	char str8[64];
+  	char str9[64];
+  	char *str = malloc(9 * sizeof(str1)); // Uma linha de cada strN
     
     sprintf(str1, "Configurações do BrisaFS:\n");
-		sprintf(str2, "\t Tamanho do bloco = %d bytes\n", TAM_BLOCO);
-    sprintf(str3, "\t Tamanho máximo de arquivo = %d bytes\n", MAX_FILE_SIZE);
+		sprintf(str2, "\t Tamanho do bloco = %u bytes\n", TAM_BLOCO);
+    sprintf(str3, "\t Tamanho máximo de arquivo = %lu bytes\n", MAX_FILE_SIZE);
     sprintf(str4, "\t Tamanho do inode: %lu bytes\n", sizeof(inode));
-    sprintf(str5, "\t Quantidade de inodes: %u\n", MIN_DATABLOCKS);
+    sprintf(str5, "\t Quantidade de inodes: %u\n", N_INODES);
     sprintf(str6, "\t Número máximo de inodes por superboco: %lu\n", MAX_FILES);
-    sprintf(str7, "\t Número de superbocos: %lu\n", N_SUPERBLOCKS);
-    sprintf(str8, "\t Quantidade de blocos no disco: %lu\n", MAX_BLOCOS);
-    sprintf(str9, "\t Tamanho do Disco: %lu bytes\n", TAM_BLOCO * MAX_BLOCOS);
+    sprintf(str7, "\t Número de superbocos: %u\n", N_SUPERBLOCKS);
+    sprintf(str8, "\t Quantidade de blocos no disco: %u\n", MAX_BLOCOS);
+    sprintf(str9, "\t Tamanho do Disco: %zu bytes\n", DISCO_OFFSET(MAX_BLOCOS));
     
     strcpy(str, str1);
 		strcat(str, str2);
@@ -292,6 +2462,60 @@ void init_brisafs() {
     preenche_bloco(nome, DIREITOS_PADRAO, strlen(str), (byte*) str, S_IFREG);
     free(str);
   }
+
+  // O disco formatado ou reaplicado vai para o hdd1 e o journal fica vazio
+  confirma_journal (1, 1);
+  return 0;
+}
+
+/* Desfaz init_brisafs, mesmo um que falhou no meio, depois que tudo foi
+   descarregado (destroy_brisafs). Libera a memória e fecha o hdd1, para
+   que outra montagem possa ser feita no mesmo processo */
+void libera_estado (void) {
+  if (disco != NULL && disco != MAP_FAILED) {
+    if (opcoes.mmap)
+      munmap (disco, DISCO_OFFSET(MAX_BLOCOS));
+    else
+      free (disco);
+  }
+  disco = NULL;
+  if (disco_fd >= 0)
+    close (disco_fd);
+  disco_fd = -1;
+
+  if (travas != NULL)
+    for (uint32_t i = 0; i < N_INODES; i++)
+      pthread_rwlock_destroy (&travas[i]);
+  free (travas);
+  free (geracoes);
+  free (leitores_fd);
+  free (atrasados);
+  travas = NULL;
+  geracoes = NULL;
+  leitores_fd = NULL;
+  atrasados = NULL;
+  for (int f = 0; f < N_FATIAS; f++) {
+    pthread_mutex_destroy (&fatias_blocos[f].trava);
+    pthread_mutex_destroy (&fatias_inodes[f].trava);
+    fatias_blocos[f].cursor = 0;
+    fatias_inodes[f].cursor = 0;
+  }
+  termina_dcache ();
+  termina_cache ();
+
+  destroi_conjunto (&sujos);
+  destroi_conjunto (&alterados);
+  destroi_conjunto (&retidos);
+  destroi_conjunto (&presos);
+  destroi_conjunto (&a_perfurar);
+  destroi_conjunto (&em_leitura);
+  free (transacao);
+  transacao = NULL;
+  pthread_rwlock_destroy (&trava_journal);
+  trechos_pendentes = 0;
+  blocos_reservados = 0;
+  blocos_presos = 0;
+  blocos_em_leitura = 0;
 }
 
 /* Recebe o path de um arquivo e retorna o nome do arquivo e o path restante*/
@@ -299,8 +2523,8 @@ int quebra_nome (const char *path, char **name, char **parent) {
   char* c1 = strdup(path);
 	char* c2 = strdup(path);
 	
-	*parent = (char*)malloc(sizeof(char)*strlen(c1));
-  *name = (char*)malloc(sizeof(char)*strlen(c1));
+	*parent = (char*)malloc(sizeof(char)*(strlen(c1)+1));
+  *name = (char*)malloc(sizeof(char)*(strlen(c1)+1));
 	if (parent == NULL || name == NULL)
 		return 1;
 	
@@ -312,109 +2536,549 @@ int quebra_nome (const char *path, char **name, char **parent) {
 	strcpy(*name, n);
 	strcpy(*parent, p);
 
+	free(c1);
+	free(c2);
   return 0;
 }
 
-/* Devolve 1 caso o nome do arquivo seja o mesmo do indicado pelo path e 0 cc */
-int compara_nome (const char *path, const char *nome) {
-	char *mn = NULL;
-  char *mp = NULL;
+/* Cache de entradas de diretório (dentries). Guarda o resultado das buscas
+   por (inode do pai, nome), inclusive das que não encontraram nada
+   (entradas negativas), para que dir_tree não precise varrer os
+   diretórios a cada chamada. É uma tabela de espalhamento de endereçamento
+   direto: uma entrada nova simplesmente substitui a que ocupava a posição */
+#define N_DENTRIES 16384
+/* Nomes maiores que isso não são guardados no cache */
+#define TAM_NOME_DENTRY 64
 
-  quebra_nome (path, &mn, &mp);
+typedef struct {
+  uint32_t hash; // hash do nome
+  uint32_t pai; // inode do diretório pai
+  uint32_t id; // inode do arquivo ou N_INODES + 1 (entrada negativa)
+  uint8_t valida;
+  uint8_t len; // tamanho do nome
+  char nome[TAM_NOME_DENTRY];
+} dentry;
 
-	if (strcmp(nome, mn) == 0) {
-		free(mn);
-		free(mp);
-		return 1;
-	}
-		
-	free(mn);
-	free(mp);
+dentry dentries[N_DENTRIES];
+
+/* Travas do cache: cada uma protege as posições de mesmo resto da divisão
+   por N_TRAVAS_DCACHE */
+#define N_TRAVAS_DCACHE 64
+pthread_mutex_t travas_dcache[N_TRAVAS_DCACHE];
+
+// As entradas de uma montagem anterior no mesmo processo são descartadas
+void inicia_dcache (void) {
+  for (int t = 0; t < N_TRAVAS_DCACHE; t++)
+    pthread_mutex_init (&travas_dcache[t], NULL);
+  memset (dentries, 0, sizeof(dentries));
+}
+
+void termina_dcache (void) {
+  for (int t = 0; t < N_TRAVAS_DCACHE; t++)
+    pthread_mutex_destroy (&travas_dcache[t]);
+}
+
+/* Hash FNV-1a dos len primeiros bytes do nome */
+uint32_t hash_nome (const char *nome, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char) nome[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* Posição do cache correspondente ao par (pai, nome) */
+uint32_t dcache_posicao (uint32_t pai, uint32_t hash) {
+  return (hash ^ (pai * 2654435761u)) % N_DENTRIES;
+}
+
+/* Procura (pai, nome) no cache. Devolve 1 e preenche id se encontrar */
+int dcache_busca (uint32_t pai, const char *nome, size_t len, uint32_t hash,
+                  uint32_t *id) {
+  uint32_t pos = dcache_posicao (pai, hash);
+  dentry *e = &dentries[pos];
+  int achou = 0;
+  pthread_mutex_lock (&travas_dcache[pos % N_TRAVAS_DCACHE]);
+  if (e->valida && e->pai == pai && e->hash == hash && e->len == len &&
+      memcmp (e->nome, nome, len) == 0) {
+    *id = e->id;
+    achou = 1;
+  }
+  pthread_mutex_unlock (&travas_dcache[pos % N_TRAVAS_DCACHE]);
+  return achou;
+}
+
+/* Guarda no cache que (pai, nome) leva ao inode id (ou a nada, se o id
+   estiver fora do intervalo de inodes) */
+void dcache_insere (uint32_t pai, const char *nome, size_t len, uint32_t hash,
+                    uint32_t id) {
+  if (len >= TAM_NOME_DENTRY)
+    return;
+  uint32_t pos = dcache_posicao (pai, hash);
+  dentry *e = &dentries[pos];
+  pthread_mutex_lock (&travas_dcache[pos % N_TRAVAS_DCACHE]);
+  e->valida = 1;
+  e->hash = hash;
+  e->pai = pai;
+  e->id = id;
+  e->len = len;
+  memcpy (e->nome, nome, len);
+  pthread_mutex_unlock (&travas_dcache[pos % N_TRAVAS_DCACHE]);
+}
+
+/* Remove do cache todas as entradas do diretório dir e a que leva a ele.
+   Usado quando o diretório é apagado e o seu inode pode ser reaproveitado */
+void dcache_invalida_dir (uint32_t dir) {
+  for (int t = 0; t < N_TRAVAS_DCACHE; t++) {
+    pthread_mutex_lock (&travas_dcache[t]);
+    for (int i = t; i < N_DENTRIES; i += N_TRAVAS_DCACHE)
+      if (dentries[i].valida && (dentries[i].pai == dir || dentries[i].id == dir))
+        dentries[i].valida = 0;
+    pthread_mutex_unlock (&travas_dcache[t]);
+  }
+}
+
+/* Devolve a raiz do índice do diretório */
+cabecalho_dir *indice_de (uint32_t dir) {
+  return (cabecalho_dir*) (disco + DISCO_OFFSET(mapeia_bloco(dir, 0)));
+}
+
+/* Devolve o nó intermediário do índice de número lógico no */
+no_dir *no_de (uint32_t dir, uint32_t no) {
+  return (no_dir*) (disco + DISCO_OFFSET(mapeia_bloco(dir, no)));
+}
+
+/* Devolve o bloco folha de número lógico folha do diretório */
+folha_dir *folha_de (uint32_t dir, uint32_t folha) {
+  return (folha_dir*) (disco + DISCO_OFFSET(mapeia_bloco(dir, folha)));
+}
+
+/* Busca binária pela posição, entre as n primeiras de v, cuja faixa
+   contém o hash */
+uint32_t posicao_indice (const indice_dir *v, uint32_t n, uint32_t hash) {
+  uint32_t ini = 0, fim = n;
+  while (fim - ini > 1) {
+    uint32_t meio = (ini + fim) / 2;
+    if (v[meio].hash_min <= hash)
+      ini = meio;
+    else
+      fim = meio;
+  }
+  return ini;
+}
+
+/* Lugar, dentro do índice de um diretório, da folha que guarda um hash */
+typedef struct {
+  uint32_t no; // bloco lógico com a lista da folha (0 é a raiz)
+  byte *base; // início desse bloco
+  indice_dir *v; // a lista
+  uint32_t *n; // posições em uso na lista
+  uint32_t max; // capacidade da lista
+  uint32_t pos; // posição da folha na lista
+} lugar_dir;
+
+/* Localiza a folha do diretório cuja faixa contém o hash */
+void localiza_folha (uint32_t dir, uint32_t hash, lugar_dir *l) {
+  cabecalho_dir *c = indice_de (dir);
+  l->no = 0;
+  l->base = (byte*) c;
+  l->v = c->indice;
+  l->n = &c->n;
+  l->max = N_INDICES_DIR;
+  if (c->niveis > 0) {
+    l->no = c->indice[posicao_indice (c->indice, c->n, hash)].bloco;
+    no_dir *no = no_de (dir, l->no);
+    l->base = (byte*) no;
+    l->v = no->indice;
+    l->n = &no->n;
+    l->max = N_INDICES_NO;
+  }
+  l->pos = posicao_indice (l->v, *l->n, hash);
+}
+
+/* Bloco lógico da folha localizada */
+uint32_t folha_do_lugar (const lugar_dir *l) {
+  return l->v[l->pos].bloco;
+}
+
+/* Marca como alterados os bytes [ini, ini + tam) do bloco lógico indicado
+   de um diretório */
+void marca_dir (uint32_t dir, uint32_t logico, uint32_t ini, uint32_t tam) {
+  marca_meta (mapeia_bloco(dir, logico), ini, tam);
+}
+
+/* Marca como alterada a lista do lugar l, das posições pos em diante */
+void marca_lista (uint32_t dir, const lugar_dir *l, uint32_t pos) {
+  uint32_t ini = (byte*) &l->v[pos] - l->base;
+  marca_dir (dir, l->no, ini, (*l->n - pos) * sizeof(indice_dir));
+}
+
+/* Reserva o próximo bloco lógico do diretório, já zerado, e devolve o seu
+   número, ou 0 se o disco estiver cheio */
+uint32_t novo_bloco_dir (uint32_t dir) {
+  uint32_t logico = superbloco[dir].tamanho / TAM_BLOCO;
+  int cursor = -1;
+  if (bloco_do_arquivo (dir, logico, &cursor) == 0)
+    return 0;
+  superbloco[dir].tamanho += TAM_BLOCO;
+  marca_inode (dir);
+  return logico;
+}
+
+/* Preenche o índice e a primeira folha (blocos lógicos 0 e 1, já
+   reservados e zerados) de um diretório recém criado */
+void inicia_dir (uint32_t id) {
+  cabecalho_dir *c = indice_de (id);
+  c->n_entradas = 0;
+  c->n_folhas = 1;
+  c->niveis = 0;
+  c->n = 1;
+  c->indice[0].hash_min = 0;
+  c->indice[0].bloco = 1;
+  folha_dir *f = folha_de (id, 1);
+  f->n = 0;
+  f->usados = 0;
+  marca_dir (id, 0, 0, sizeof(cabecalho_dir) + sizeof(indice_dir));
+  marca_dir (id, 1, 0, sizeof(folha_dir));
+  superbloco[id].tamanho = 2 * TAM_BLOCO;
+}
+
+/* Posição de uma varredura das folhas de um diretório na ordem do índice */
+typedef struct {
+  uint32_t i; // posição na raiz
+  uint32_t j; // posição no nó, com dois níveis
+} cursor_dir;
+
+/* Devolve o bloco lógico da próxima folha da varredura, ou 0 no fim. O
+   diretório não pode mudar durante a varredura */
+uint32_t proxima_folha (uint32_t dir, cursor_dir *k) {
+  cabecalho_dir *c = indice_de (dir);
+  while (k->i < c->n) {
+    if (c->niveis == 0)
+      return c->indice[k->i++].bloco;
+    no_dir *no = no_de (dir, c->indice[k->i].bloco);
+    if (k->j < no->n)
+      return no->indice[k->j++].bloco;
+    k->i++;
+    k->j = 0;
+  }
   return 0;
 }
 
-// Recebe um path e retorna o id do inode indicado pelo path
-uint16_t dir_tree (const char *path) {
-	int count = 0; // Contador de nivel de hierarquia
-	uint16_t id = MIN_DATABLOCKS + 1; // id fora do range que será retornado se não encontrar
-	
-	// Variáveis necessárias para utilizar a libgen
-	char* n0 = strdup(path);
-	char* p0 = strdup(path);
-	
-	// Loop para contar a quantidade de camadas até o arquivo indicado por path
-	while (strcmp(p0,"/") != 0) {
-		char* p1 = strdup(p0);
-		char* p2 = strdup(p0);
-		n0 = basename(p1);
-		p0 = dirname(p2);
-		count ++;
-	}
-	
-	if (strcmp(n0,"/") == 0)
-		return 0;
-	
-	// Loop para percorrer o path
-	for(int k = count; k > 0; k--) {
-		n0 = strdup(path);
-		p0 = strdup(path);
-	
-		for(int w = 0; w < k; w++) {
-			char* p1 = strdup(p0);
-			char* p2 = strdup(p0);
-			n0 = basename(p1);
-			p0 = dirname(p2);
-		}
-		
-		// Condicional para o caso do diretório raiz
-		if (k == count) {
-			for (int i = 0; i < N_SUPERBLOCKS; i++) { // Percorre os inodes
-  			if (superbloco[i].bloco != 0 && strcmp(p0, superbloco[i].nome) == 0) { // Achou o pai
-    			dir = disco + DISCO_OFFSET(superbloco[i].bloco); // Aponta dir para o bloco do pai
-    			uint16_t *d = (uint16_t*) dir; // Faz um casting para uint16_t
-    			
-    			// Varre todos os arquivos dentro do diretório pai
-    			for(int j = 1; j <= d[0]; j++) {
-    				if (strcmp(n0, superbloco[d[j]].nome) == 0) { // Achou!
-							id = d[j]; // Grava o id do inode
-							break; // Vai para o próximo step do path
-						}
-					}
-					break;
-				}
-			}
-		} else { //Se não for o diretório raiz
-			dir = disco + DISCO_OFFSET(superbloco[id].bloco); // Aponta dir para o bloco do pai
-    	uint16_t *d = (uint16_t*) dir; // Faz um casting para uint16_t
-    	
-    	// Varre todos os arquivos dentro do diretório pai
-    	for(int j = 1; j <= d[0]; j++) {
-    		if (strcmp(n0, superbloco[d[j]].nome) == 0) { // Achou!
-					id = d[j]; // Grava o id do inode
-				}
-			}
-		}
+/* Entrada seguinte a e na mesma folha */
+entrada_dir *proxima_entrada (const entrada_dir *e) {
+  return (entrada_dir*) ((byte*) e + TAM_ENTRADA(e->len));
+}
+
+/* Acrescenta uma entrada ao fim da folha, que deve ter espaço para ela.
+   Devolve a posição da entrada em relação ao início da folha */
+uint32_t acrescenta_entrada (folha_dir *f, uint32_t hash, uint32_t id,
+                             const char *nome, size_t len) {
+  entrada_dir *e = (entrada_dir*) (f->entradas + f->usados);
+  memset (e, 0, TAM_ENTRADA(len));
+  e->hash = hash;
+  e->id = id;
+  e->len = len;
+  memcpy (e->nome, nome, len);
+  f->n++;
+  f->usados += TAM_ENTRADA(len);
+  return (byte*) e - (byte*) f;
+}
+
+int compara_hash (const void *a, const void *b) {
+  uint32_t ha = (*(entrada_dir* const*) a)->hash;
+  uint32_t hb = (*(entrada_dir* const*) b)->hash;
+  return ha < hb ? -1 : ha > hb;
+}
+
+/* Abre uma posição livre na lista do índice que contém o hash, que está
+   cheia. Com um nível, a lista da raiz passa para um nó intermediário;
+   com dois, o nó cheio é dividido ao meio. Devolve 0 ou um código de
+   erro negativo */
+int abre_espaco_indice (uint32_t dir, uint32_t hash) {
+  cabecalho_dir *c = indice_de (dir);
+  if (c->niveis == 0) {
+    uint32_t logico = novo_bloco_dir (dir);
+    if (logico == 0)
+      return -ENOSPC;
+    no_dir *no = no_de (dir, logico);
+    memcpy (no->indice, c->indice, c->n * sizeof(indice_dir));
+    no->n = c->n;
+    marca_dir (dir, logico, 0, sizeof(no_dir) + no->n * sizeof(indice_dir));
+    memset (c->indice, 0, c->n * sizeof(indice_dir));
+    c->indice[0].hash_min = 0;
+    c->indice[0].bloco = logico;
+    c->niveis = 1;
+    marca_dir (dir, 0, 0, sizeof(cabecalho_dir) + c->n * sizeof(indice_dir));
+    c->n = 1;
+    return 0;
+  }
+
+  if (c->n == N_INDICES_DIR)
+    return -ENOSPC;
+  uint32_t pos = posicao_indice (c->indice, c->n, hash);
+  uint32_t logico = novo_bloco_dir (dir);
+  if (logico == 0)
+    return -ENOSPC;
+  // A metade de cima da lista vai para um nó novo, logo após o velho
+  no_dir *velho = no_de (dir, c->indice[pos].bloco);
+  no_dir *novo = no_de (dir, logico);
+  uint32_t metade = velho->n / 2;
+  novo->n = velho->n - metade;
+  memcpy (novo->indice, &velho->indice[metade], novo->n * sizeof(indice_dir));
+  memset (&velho->indice[metade], 0, novo->n * sizeof(indice_dir));
+  marca_dir (dir, c->indice[pos].bloco, 0, sizeof(no_dir) + velho->n * sizeof(indice_dir));
+  velho->n = metade;
+  marca_dir (dir, logico, 0, sizeof(no_dir) + novo->n * sizeof(indice_dir));
+
+  memmove (&c->indice[pos+2], &c->indice[pos+1], (c->n - pos - 1) * sizeof(indice_dir));
+  c->indice[pos+1].hash_min = novo->indice[0].hash_min;
+  c->indice[pos+1].bloco = logico;
+  c->n++;
+  marca_dir (dir, 0, 0, sizeof(cabecalho_dir) + c->n * sizeof(indice_dir));
+  return 0;
+}
+
+/* Divide a folha cheia que guarda o hash, passando cerca de metade dos
+   bytes, com as entradas de maiores hashes, para uma folha nova.
+   Entradas de mesmo hash nunca ficam separadas, para que uma busca só
+   precise olhar uma folha */
+int divide_folha (uint32_t dir, uint32_t hash) {
+  lugar_dir l;
+  localiza_folha (dir, hash, &l);
+  if (*l.n == l.max) {
+    int erro = abre_espaco_indice (dir, hash);
+    if (erro < 0)
+      return erro;
+    localiza_folha (dir, hash, &l);
+  }
+
+  // As entradas são ordenadas por hash numa cópia da folha
+  folha_dir *velha = folha_de (dir, folha_do_lugar (&l));
+  uint32_t n = velha->n;
+  byte *copia = malloc (TAM_BLOCO);
+  entrada_dir **v = malloc (n * sizeof(entrada_dir*));
+  if (copia == NULL || v == NULL) {
+    free (copia);
+    free (v);
+    return -ENOMEM;
+  }
+  memcpy (copia, velha, TAM_BLOCO);
+  entrada_dir *e = (entrada_dir*) ((folha_dir*) copia)->entradas;
+  for (uint32_t j = 0; j < n; j++, e = proxima_entrada (e))
+    v[j] = e;
+  qsort (v, n, sizeof(entrada_dir*), compara_hash);
+
+  uint32_t metade = 0;
+  for (size_t bytes = 0; metade < n && bytes < velha->usados / 2; metade++)
+    bytes += TAM_ENTRADA(v[metade]->len);
+  uint32_t meio = metade;
+  while (meio > 0 && meio < n && v[meio]->hash == v[meio-1]->hash)
+    meio++;
+  if (meio == n) { // Tenta dividir antes da metade
+    meio = metade;
+    while (meio > 0 && meio < n && v[meio]->hash == v[meio-1]->hash)
+      meio--;
+  }
+
+  uint32_t logico = 0;
+  if (meio > 0 && meio < n) // Senão todas as entradas têm o mesmo hash
+    logico = novo_bloco_dir (dir);
+  if (logico == 0) {
+    free (copia);
+    free (v);
+    return -ENOSPC;
+  }
+  folha_dir *nova = folha_de (dir, logico);
+
+  memset (velha, 0, TAM_BLOCO);
+  for (uint32_t j = 0; j < n; j++)
+    acrescenta_entrada (j < meio ? velha : nova, v[j]->hash, v[j]->id, v[j]->nome, v[j]->len);
+  uint32_t hash_nova = v[meio]->hash;
+  free (copia);
+  free (v);
+
+  // A folha nova entra no índice logo após a velha
+  memmove (&l.v[l.pos+2], &l.v[l.pos+1], (*l.n - l.pos - 1) * sizeof(indice_dir));
+  l.v[l.pos+1].hash_min = hash_nova;
+  l.v[l.pos+1].bloco = logico;
+  (*l.n)++;
+  indice_de(dir)->n_folhas++;
+
+  marca_dir (dir, 0, 0, sizeof(cabecalho_dir));
+  marca_dir (dir, l.no, (byte*) l.n - l.base, sizeof(uint32_t));
+  marca_lista (dir, &l, l.pos + 1);
+  marca_dir (dir, folha_do_lugar (&l), 0, TAM_BLOCO); // reescrita em ordem
+  marca_dir (dir, logico, 0, sizeof(folha_dir) + nova->usados);
+  return 0;
+}
+
+/* Procura o nome (com len caracteres, não necessariamente terminado em
+   '\0') e hash indicado dentro do diretório pai, sem passar pelo cache. A
+   trava do pai deve estar com quem chama. Devolve o id do inode
+   encontrado ou N_INODES + 1 se não existir */
+uint32_t busca_entrada (uint32_t pai, const char *nome, size_t len, uint32_t hash) {
+  uint32_t id = N_INODES + 1;
+  if (inode_em_uso(pai) && S_ISDIR(superbloco[pai].type)) {
+    lugar_dir l;
+    localiza_folha (pai, hash, &l);
+    folha_dir *f = folha_de (pai, folha_do_lugar (&l));
+    // Só os nomes com o mesmo hash precisam ser comparados
+    entrada_dir *e = (entrada_dir*) f->entradas;
+    for (uint32_t j = 0; j < f->n; j++, e = proxima_entrada (e)) {
+      if (e->hash == hash && e->len == len && memcmp(e->nome, nome, len) == 0) { // Achou!
+        id = e->id;
+        break;
+      }
+    }
+  }
+  return id;
+}
+
+/* Procura o nome (com len caracteres, não necessariamente terminado em
+   '\0') dentro do diretório pai, consultando antes o cache. Devolve o id
+   do inode encontrado ou N_INODES + 1 se não existir */
+uint32_t procura_entrada (uint32_t pai, const char *nome, size_t len) {
+  uint32_t hash = hash_nome (nome, len);
+  uint32_t id;
+
+  if (dcache_busca (pai, nome, len, hash, &id)) {
+    CONTA (dcache_acertos, 1);
+    return id;
+  }
+  CONTA (dcache_falhas, 1);
+
+  trava_leitura (pai);
+  id = busca_entrada (pai, nome, len, hash);
+  /* O resultado vai para o cache ainda com a trava do pai, para não
+     sobrescrever o de uma criação ou remoção concorrente */
+  dcache_insere (pai, nome, len, hash, id);
+  destrava (pai);
+  return id;
+}
+
+/* Inclui o nome (com len caracteres), que aponta para o inode id, no
+   diretório pai, cuja trava de escrita deve estar com quem chama */
+int insere_entrada (uint32_t pai, const char *nome, size_t len, uint32_t id) {
+  uint32_t hash = hash_nome (nome, len);
+
+  lugar_dir l;
+  localiza_folha (pai, hash, &l);
+  uint32_t folha = folha_do_lugar (&l);
+  folha_dir *f = folha_de (pai, folha);
+  if (f->usados + TAM_ENTRADA(len) > ESPACO_FOLHA) {
+    int erro = divide_folha (pai, hash);
+    if (erro < 0)
+      return erro;
+    localiza_folha (pai, hash, &l);
+    folha = folha_do_lugar (&l);
+    f = folha_de (pai, folha);
+    if (f->usados + TAM_ENTRADA(len) > ESPACO_FOLHA)
+      return -ENOSPC;
+  }
+
+  uint32_t ini = acrescenta_entrada (f, hash, id, nome, len);
+  indice_de(pai)->n_entradas++;
+  marca_dir (pai, 0, 0, sizeof(cabecalho_dir));
+  marca_dir (pai, folha, 0, sizeof(folha_dir));
+  marca_dir (pai, folha, ini, TAM_ENTRADA(len));
+
+  dcache_insere (pai, nome, len, hash, id);
+  return 0;
+}
+
+/* Retira o nome (com len caracteres) do diretório pai, cuja trava de
+   escrita deve estar com quem chama. O nome passa a ser uma entrada
+   negativa no cache */
+void remove_entrada (uint32_t pai, const char *nome, size_t len) {
+  uint32_t hash = hash_nome (nome, len);
+
+  lugar_dir l;
+  localiza_folha (pai, hash, &l);
+  uint32_t folha = folha_do_lugar (&l);
+  folha_dir *f = folha_de (pai, folha);
+  entrada_dir *e = (entrada_dir*) f->entradas;
+  for (uint32_t j = 0; j < f->n; j++, e = proxima_entrada (e)) {
+    if (e->hash == hash && e->len == len && memcmp(e->nome, nome, len) == 0) {
+      // As entradas seguintes são deslocadas sobre a removida
+      uint32_t ini = (byte*) e - f->entradas;
+      uint32_t tam = TAM_ENTRADA(e->len);
+      uint32_t usados = f->usados;
+      memmove (e, (byte*) e + tam, usados - ini - tam);
+      memset (f->entradas + usados - tam, 0, tam);
+      f->usados -= tam;
+      f->n--;
+      indice_de(pai)->n_entradas--;
+      marca_dir (pai, 0, 0, sizeof(cabecalho_dir));
+      marca_dir (pai, folha, 0, sizeof(folha_dir) + usados);
+      break;
+    }
+  }
+
+  dcache_insere (pai, nome, len, hash, N_INODES + 1);
+}
+
+/* Recebe um path e retorna o id do inode indicado pelo path, ou
+   N_INODES + 1 se ele não existir. Os componentes do path são
+   percorridos a partir da raiz (inode 0) sem cópias do path */
+uint32_t dir_tree (const char *path) {
+	uint32_t id = 0;
+	const char *p = path;
+
+	while (*p != '\0') {
+		// Pula as barras que separam os componentes
+		while (*p == '/')
+			p++;
+		if (*p == '\0')
+			break;
+
+		const char *fim = p;
+		while (*fim != '\0' && *fim != '/')
+			fim++;
+
+		id = procura_entrada (id, p, fim - p);
+		if (id > N_INODES)
+			return id;
+		p = fim;
 	}
 	// Ao final, o inode que estiver na variável id, é o inode indicado pelo path
   return id; 
 }
 
 // Armazena a data de criação ou modificação do inode
-int armazena_data (int typeop, int inode){
+int armazena_data (int typeop, uint32_t inode){
   struct timeval time;
   gettimeofday (&time, NULL);
 
+  /* O acesso é registrado também por leitores, que têm apenas a trava de
+     leitura do inode, por isso as escritas atômicas */
   if (typeop == 0) { // Modificacao
-    superbloco[inode].timestamp[0] = time.tv_sec;
-    superbloco[inode].timestamp[1] = time.tv_sec;
+    __atomic_store_n (&superbloco[inode].timestamp[0], time.tv_sec, __ATOMIC_RELAXED);
+    __atomic_store_n (&superbloco[inode].timestamp[1], time.tv_sec, __ATOMIC_RELAXED);
+    marca_inode (inode);
     return 0;
   } else if (typeop == 1) { // Acesso
-    superbloco[inode].timestamp[1] = time.tv_sec;
+    /* O horário de acesso não passa pelo journal: vai para o hdd1 junto
+       com o bloco do inode, no commit ou no checkpoint */
+    __atomic_store_n (&superbloco[inode].timestamp[1], time.tv_sec, __ATOMIC_RELAXED);
+    marca_sujo (INICIO_SUPERBLOCO + inode * sizeof(superbloco[0]) / TAM_BLOCO);
     return 0;
   }
   return 1; //Caso operacao invalide
 }
 
+/* Tamanho do arquivo visto por quem o usa, com as escritas atrasadas. O
+   tamanho no inode só cresce quando elas são descarregadas, junto com os
+   blocos, para que o journal nunca guarde um tamanho sem os dados. Lido
+   com a trava do inode */
+uint64_t tamanho_de (uint32_t id) {
+  arquivo_aberto *a = atrasados[id];
+  uint64_t tamanho = superbloco[id].tamanho;
+  if (a != NULL && a->ini_atraso + a->tam_atraso > tamanho)
+    tamanho = a->ini_atraso + a->tam_atraso;
+  return tamanho;
+}
 
 /* A função getattr_brisafs devolve os metadados de um arquivo cujo
    caminho é dado por path. Devolve 0 em caso de sucesso ou um código
@@ -422,6 +3086,16 @@ int armazena_data (int typeop, int inode){
 static int getattr_brisafs(const char *path, struct stat *stbuf) {
 	memset(stbuf, 0, sizeof(struct stat));
 
+  // Estatísticas, geradas na hora e somente para leitura
+  if (strcmp(path, ARQUIVO_ESTATISTICAS) == 0) {
+    char buf[TAM_ESTATISTICAS];
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = gera_estatisticas(buf, sizeof(buf));
+    stbuf->st_mtime = stbuf->st_atime = time(NULL);
+    return 0;
+  }
+
   //Diretório raiz
   if (strcmp(path, "/") == 0) {
   	stbuf->st_mode = S_IFDIR | 0755;
@@ -429,154 +3103,661 @@ static int getattr_brisafs(const char *path, struct stat *stbuf) {
     return 0;
   }
 
-  char *subdir = NULL;
-  char *filename = NULL;
-  quebra_nome(path, &filename, &subdir);
+  uint32_t id = dir_tree(path);
+  if (id > N_INODES)
+    return -ENOENT; // Caso nao encontre o arquivo ou algum diretorio do caminho
+  TRACE_INODE (id);
+
+  trava_leitura (id);
+  if (!inode_em_uso(id)) { // Removido depois da busca
+    destrava (id);
+    return -ENOENT;
+  }
+  stbuf->st_mode = superbloco[id].type | superbloco[id].direitos;
+  stbuf->st_nlink = 1;
+  stbuf->st_size = tamanho_de(id);
+  stbuf->st_blksize = TAM_BLOCO;
+  // Os blocos reservados por escritas atrasadas já contam como ocupados
+  uint64_t blocos = blocos_alocados(id);
+  if (atrasados[id] != NULL)
+    blocos += atrasados[id]->reservados_atraso;
+  stbuf->st_blocks = blocos * (TAM_BLOCO / 512);
+  stbuf->st_mtime = superbloco[id].timestamp[0];
+  stbuf->st_atime = __atomic_load_n (&superbloco[id].timestamp[1], __ATOMIC_RELAXED);
+  stbuf->st_uid = superbloco[id].userown;
+  stbuf->st_gid = superbloco[id].groupown;
+  destrava (id);
+  return 0;
+}
+
+/* Devolve ao FUSE a estrutura completa do diretório indicado pelo
+   parâmetro path. Devolve 0 em caso de sucesso ou um código de
+   erro. Atenção ao uso abaixo dos demais parâmetros. */
+static int readdir_brisafs(const char *path, void *buf, fuse_fill_dir_t filler,
+                           off_t offset, struct fuse_file_info *fi) {
+	(void) offset;
+  (void) fi;
+
+  filler(buf, ".", NULL, 0);
+  filler(buf, "..", NULL, 0);
+	
+	uint32_t id = dir_tree(path);
+	if (id > N_INODES)
+		return -ENOENT;
+  TRACE_INODE (id);
+	
+  /* A trava de leitura do diretório impede que as entradas mudem (ou que
+     os inodes delas sejam liberados) durante a varredura */
+  trava_leitura (id);
+  if (!inode_em_uso(id) || !S_ISDIR(superbloco[id].type)) {
+    destrava (id);
+    return -ENOTDIR;
+  }
+  // As folhas são percorridas na ordem do índice
+  cursor_dir k = {0, 0};
+  char nome[TAM_MAX_NOME + 1];
+  for (uint32_t folha; (folha = proxima_folha(id, &k)) != 0; ) {
+    folha_dir *f = folha_de(id, folha);
+    entrada_dir *e = (entrada_dir*) f->entradas;
+    for (uint32_t j = 0; j < f->n; j++, e = proxima_entrada(e)) {
+      memcpy(nome, e->nome, e->len);
+      nome[e->len] = '\0';
+      filler(buf, nome, NULL, 0);
+    }
+  }
+  destrava (id);
+  if (id == 0)
+    filler(buf, ARQUIVO_ESTATISTICAS + 1, NULL, 0);
+  return 0;
+}
+
+/* Abre um arquivo. O caminho é resolvido uma única vez e o inode fica
+   guardado em fi->fh, junto com o cursor dos extents, para as leituras e
+   escritas seguintes */
+static int open_brisafs(const char *path, struct fuse_file_info *fi) {
+  /* As estatísticas são copiadas na abertura, para que leituras
+     sucessivas do mesmo arquivo aberto vejam um conteúdo consistente. O
+     tamanho muda a cada abertura, por isso o acesso é direto */
+  if (strcmp(path, ARQUIVO_ESTATISTICAS) == 0) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+      return -EACCES;
+    arquivo_aberto *a = calloc(1, sizeof(arquivo_aberto));
+    if (a == NULL || (a->instantaneo = malloc(TAM_ESTATISTICAS)) == NULL) {
+      free(a);
+      return -ENOMEM;
+    }
+    a->id = N_INODES + 1;
+    a->tamanho_instantaneo = gera_estatisticas(a->instantaneo, TAM_ESTATISTICAS);
+    fi->direct_io = 1;
+    fi->fh = (uintptr_t) a;
+    return 0;
+  }
+
+  uint32_t id = dir_tree(path);
+  if (id > N_INODES)
+    return -ENOENT;
+  TRACE_INODE (id);
+
+  arquivo_aberto *a = calloc(1, sizeof(arquivo_aberto));
+  if (a == NULL)
+    return -ENOMEM;
+  trava_leitura (id);
+  if (!inode_em_uso(id)) {
+    destrava (id);
+    free(a);
+    return -ENOENT;
+  }
+  a->id = id;
+  a->geracao = geracoes[id];
+  a->cursor = -1;
+  destrava (id);
+  fi->fh = (uintptr_t) a;
+  return 0;
+}
+
+/* Devolve o arquivo aberto guardado em fi, ou NULL se a operação foi
+   chamada sem um open antes */
+static arquivo_aberto *aberto_de (struct fuse_file_info *fi) {
+  return fi != NULL ? (arquivo_aberto*) (uintptr_t) fi->fh : NULL;
+}
+
+/* Confere, com a trava do inode, se ele ainda é o arquivo que foi aberto */
+static int aberto_valido (uint32_t id, const arquivo_aberto *a) {
+  return inode_em_uso(id) && (a == NULL || geracoes[id] == a->geracao);
+}
+
+/* Leitura antecipada, no modo mmap. Chamada com a trava do inode depois
+   de cada leitura de [offset, offset + size) pelo arquivo aberto a. Se a
+   leitura continua a anterior, a janela dobra e, quando falta menos de
+   meia janela para alcançar o que já foi pedido, os blocos da janela
+   seguinte são pedidos ao kernel com POSIX_FADV_WILLNEED, um pedido por
+   extent, sem esperar por eles. Uma leitura fora de sequência zera a
+   janela. Leituras simultâneas pelo mesmo arquivo aberto só atrapalham a
+   detecção, sem outro efeito. Fora do modo mmap o disco inteiro já está
+   em memória e não há o que antecipar */
+static void le_adiante (uint32_t id, arquivo_aberto *a, off_t offset, size_t size) {
+  if (!opcoes.mmap || a == NULL || size == 0)
+    return;
+  uint64_t fim = offset + size;
+  uint64_t janela = __atomic_load_n (&a->janela, __ATOMIC_RELAXED);
+  if ((uint64_t) offset != __atomic_load_n (&a->proxima_leitura, __ATOMIC_RELAXED)) {
+    __atomic_store_n (&a->proxima_leitura, fim, __ATOMIC_RELAXED);
+    __atomic_store_n (&a->janela, 0, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_store_n (&a->proxima_leitura, fim, __ATOMIC_RELAXED);
+
+  // Com o cache de blocos, a janela não passa de um quarto do limite dele
+  uint64_t maxima = JANELA_MAXIMA;
+  if (capacidade_cache > 0 &&
+      maxima > (uint64_t) capacidade_cache * N_FATIAS * TAM_BLOCO / 4)
+    maxima = (uint64_t) capacidade_cache * N_FATIAS * TAM_BLOCO / 4;
+  janela = janela == 0 ? JANELA_INICIAL : 2 * janela;
+  if (janela > maxima)
+    janela = maxima;
+  __atomic_store_n (&a->janela, janela, __ATOMIC_RELAXED);
+
+  uint64_t pedido = __atomic_load_n (&a->fim_adiante, __ATOMIC_RELAXED);
+  if (pedido < fim)
+    pedido = fim;
+  else if (pedido - fim >= janela / 2)
+    return;
+  uint64_t ate = fim + janela;
+  if (ate > superbloco[id].tamanho)
+    ate = superbloco[id].tamanho;
+  if (pedido >= ate)
+    return;
+  __atomic_store_n (&a->fim_adiante, ate, __ATOMIC_RELAXED);
+
+  uint32_t ini_logico = pedido / TAM_BLOCO;
+  uint32_t fim_logico = (ate + TAM_BLOCO - 1) / TAM_BLOCO;
+  extent *e = extents_de (id);
+  int n = superbloco[id].n_extents;
+  int i = procura_extent (e, n, ini_logico);
+  for (i = i < 0 ? 0 : i; i < n && e[i].inicio < fim_logico; i++) {
+    uint32_t ini = e[i].inicio > ini_logico ? e[i].inicio : ini_logico;
+    uint32_t fim_e = e[i].inicio + e[i].tamanho;
+    if (fim_e > fim_logico)
+      fim_e = fim_logico;
+    if (ini >= fim_e) // Extent antes do trecho, ou buraco
+      continue;
+    posix_fadvise (disco_fd, DISCO_OFFSET(e[i].bloco + (ini - e[i].inicio)),
+                   (off_t) (fim_e - ini) * TAM_BLOCO, POSIX_FADV_WILLNEED);
+    CONTA (blocos_adiante, fim_e - ini);
+    // Os blocos trazidos já contam no cache
+    for (uint32_t k = ini; k < fim_e; k++)
+      usa_bloco (e[i].bloco + (k - e[i].inicio));
+  }
+}
+
+/* Função chamada quando o FUSE deseja ler dados de um arquivo
+   indicado pelo parâmetro path. Se você implementou a função
+   open_brisafs, o uso do parâmetro fi é necessário. A função lê size
+   bytes, a partir do offset do arquivo path no buffer buf. */
+static int read_brisafs(const char *path, char *buf, size_t size,
+                        off_t offset, struct fuse_file_info *fi) {
+		
+  arquivo_aberto *a = aberto_de(fi);
+  if (a != NULL && a->instantaneo != NULL) { // Estatísticas
+    if (offset >= a->tamanho_instantaneo)
+      return 0;
+    if (offset + size > a->tamanho_instantaneo)
+      size = a->tamanho_instantaneo - offset;
+    memcpy(buf, a->instantaneo + offset, size);
+    return size;
+  }
+
+	uint32_t id = a != NULL ? a->id : dir_tree(path);
+	if (id > N_INODES)
+		return -ENOENT; // Arquivo não encontrado
+  TRACE_INODE (id);
+
+  // Várias leituras do mesmo arquivo podem acontecer ao mesmo tempo
+  trava_leitura_descarregada (id);
+  if (!aberto_valido(id, a)) {
+    destrava (id);
+    return -ENOENT;
+  }
+  
+  // Tamanho do arquivo a ser lido
+  size_t len = superbloco[id].tamanho;
+  armazena_data(1, id);
+  
+  if (offset >= len) { //tentou ler além do fim do arquivo
+    destrava (id);
+    return 0;
+  }
+  if (offset + size > len) // Lê apenas até o fim do arquivo
+    size = len - offset;
+
+  if (eh_inline(id)) { // O conteúdo está no próprio inode
+    memcpy(buf, superbloco[id].dados + offset, size);
+    destrava (id);
+    return size;
+  }
+
+  /* Cada bloco lógico é localizado nos extents a partir do cursor do
+     arquivo aberto, que leitores simultâneos podem atualizar */
+  int cursor = a != NULL ? __atomic_load_n(&a->cursor, __ATOMIC_RELAXED) : -1;
+  size_t lido = 0;
+  while (lido < size) {
+    uint32_t logico = (offset + lido) / TAM_BLOCO;
+    uint32_t desloc = (offset + lido) % TAM_BLOCO;
+    size_t n = TAM_BLOCO - desloc;
+    if (n > size - lido)
+      n = size - lido;
+
+    uint32_t bloco = mapeia_bloco_cursor(id, logico, &cursor);
+    if (bloco == 0) // Bloco não mapeado é lido como zeros
+      memset(buf + lido, 0, n);
+    else {
+      memcpy(buf + lido, disco + DISCO_OFFSET(bloco) + desloc, n);
+      usa_bloco(bloco);
+    }
+    lido += n;
+  }
+  if (a != NULL)
+    __atomic_store_n(&a->cursor, cursor, __ATOMIC_RELAXED);
+  le_adiante(id, a, offset, size);
+  destrava (id);
+  return size;
+}
+
+/* Lê com read_brisafs para um único buffer em memória, como faria o
+   próprio libfuse sem read_buf */
+static int le_para_memoria (const char *path, struct fuse_bufvec **bufp, size_t size,
+                            off_t offset, struct fuse_file_info *fi) {
+  struct fuse_bufvec *v = malloc(sizeof(struct fuse_bufvec));
+  if (v == NULL)
+    return -ENOMEM;
+  *v = FUSE_BUFVEC_INIT(size);
+  v->buf[0].mem = malloc(size > 0 ? size : 1);
+  if (v->buf[0].mem == NULL) {
+    free(v);
+    return -ENOMEM;
+  }
+  int ret = read_brisafs(path, v->buf[0].mem, size, offset, fi);
+  if (ret < 0) {
+    free(v->buf[0].mem);
+    free(v);
+    return ret;
+  }
+  v->buf[0].size = ret;
+  *bufp = v;
+  return 0;
+}
+
+/* Leitura sem cópia. No modo mmap o disco é o próprio arquivo da imagem,
+   então cada sequência de blocos contíguos lida vira um buffer
+   FUSE_BUF_IS_FD (descritor e posição na imagem) e o libfuse pode levar os
+   dados do arquivo ao kernel com splice, sem passar por um buffer aqui.
+   Buracos viram buffers de zeros. Fora do modo mmap o arquivo pode estar
+   atrás do disco em memória, e a leitura (assim como a de arquivos inline
+   e das estatísticas) é copiada por le_para_memoria.
+   O libfuse só lê os buffers depois que a trava do inode é solta, então
+   uma leitura simultânea a um truncate ou unlink pode ver nos blocos
+   liberados o conteúdo que eles tiverem naquele momento */
+static int read_buf_brisafs(const char *path, struct fuse_bufvec **bufp, size_t size,
+                            off_t offset, struct fuse_file_info *fi) {
+  // Sem um arquivo aberto nada segura os blocos até o libfuse lê-los
+  arquivo_aberto *a = aberto_de(fi);
+  if (!opcoes.mmap || a == NULL || a->instantaneo != NULL)
+    return le_para_memoria(path, bufp, size, offset, fi);
+
+	uint32_t id = a->id;
+  TRACE_INODE (id);
+
+  trava_leitura_descarregada (id);
+  if (!aberto_valido(id, a)) {
+    destrava (id);
+    return -ENOENT;
+  }
+  if (eh_inline(id)) {
+    destrava (id);
+    return le_para_memoria(path, bufp, size, offset, fi);
+  }
+
+  size_t len = superbloco[id].tamanho;
+  armazena_data(1, id);
+  if (offset >= len)
+    size = 0;
+  else if (offset + size > len)
+    size = len - offset;
+
+  // No máximo um buffer por bloco lógico lido
+  size_t max = size / TAM_BLOCO + 2;
+  struct fuse_bufvec *v = calloc(1, sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+  if (v == NULL) {
+    destrava (id);
+    return -ENOMEM;
+  }
+
+  /* O libfuse lê os buffers com o descritor depois que a trava é solta.
+     Até o release deste arquivo aberto, os blocos que o inode liberar não
+     são reaproveitados (ver libera_bloco_de) */
+  if (!__atomic_exchange_n(&a->leitor_fd, 1, __ATOMIC_RELAXED))
+    __atomic_fetch_add(&leitores_fd[id], 1, __ATOMIC_RELAXED);
+
+  int cursor = __atomic_load_n(&a->cursor, __ATOMIC_RELAXED);
+  size_t lido = 0, n_bufs = 0;
+  while (lido < size) {
+    uint32_t logico = (offset + lido) / TAM_BLOCO;
+    uint32_t desloc = (offset + lido) % TAM_BLOCO;
+    size_t n = TAM_BLOCO - desloc;
+    if (n > size - lido)
+      n = size - lido;
+
+    uint32_t bloco = mapeia_bloco_cursor(id, logico, &cursor);
+    if (bloco != 0)
+      usa_bloco(bloco);
+    struct fuse_buf *ult = n_bufs > 0 ? &v->buf[n_bufs - 1] : NULL;
+    off_t pos = DISCO_OFFSET(bloco) + desloc;
+    if (bloco != 0 && ult != NULL && (ult->flags & FUSE_BUF_IS_FD) &&
+        ult->pos + (off_t) ult->size == pos) { // Continua a sequência anterior
+      ult->size += n;
+    } else if (bloco == 0 && ult != NULL && !(ult->flags & FUSE_BUF_IS_FD)) {
+      ult->size += n; // Continua o buraco anterior
+    } else {
+      struct fuse_buf *b = &v->buf[n_bufs++];
+      b->size = n;
+      if (bloco != 0) {
+        b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        b->fd = disco_fd;
+        b->pos = pos;
+      } else {
+        b->fd = -1;
+      }
+    }
+    lido += n;
+  }
+  __atomic_store_n(&a->cursor, cursor, __ATOMIC_RELAXED);
+  le_adiante(id, a, offset, size);
+  destrava (id);
+
+  // Os buracos são lidos de buffers zerados, liberados pelo libfuse
+  for (size_t i = 0; i < n_bufs; i++) {
+    if (!(v->buf[i].flags & FUSE_BUF_IS_FD) &&
+        (v->buf[i].mem = calloc(1, v->buf[i].size)) == NULL) {
+      for (size_t j = 0; j < i; j++)
+        free(v->buf[j].mem);
+      free(v);
+      return -ENOMEM;
+    }
+  }
+  if (n_bufs == 0) { // Leitura além do fim do arquivo
+    v->buf[0].fd = -1;
+    n_bufs = 1;
+  }
+  v->count = n_bufs;
+  *bufp = v;
+  return 0;
+}
+
+/* Diz se há blocos livres, fora os já reservados, para os blocos lógicos
+   ainda não mapeados de [ini_bloco, fim_bloco] do arquivo id, com um a
+   mais para um eventual bloco de extents */
+static int cabe_intervalo (uint32_t id, uint32_t ini_bloco, uint32_t fim_bloco, int *cursor) {
+  int64_t ext_blocos = 0;
+  for (uint64_t logico = ini_bloco; logico <= fim_bloco; logico++)
+    if (mapeia_bloco_cursor(id, logico, cursor) == 0)
+      ext_blocos++;
+  return ext_blocos == 0 ||
+    ext_blocos + 1 <= __atomic_load_n (&free_space, __ATOMIC_RELAXED) -
+                      __atomic_load_n (&blocos_reservados, __ATOMIC_RELAXED);
+}
+
+/* Reserva todos os blocos atingidos pela escrita de size bytes em offset
+   no arquivo id, promovendo um arquivo inline que deixe de caber no
+   inode. Devolve 1 se a escrita vai para o conteúdo inline, 0 se os
+   blocos foram reservados ou um código de erro negativo */
+static int reserva_escrita (uint32_t id, arquivo_aberto *a, size_t size, off_t offset) {
+  uint64_t tamanho = superbloco[id].tamanho;
+  if (eh_inline(id)) {
+    if (offset + size <= TAM_INLINE) // Continua inline
+      return 1;
+    if (tamanho > 0 && promove_inline(id) < 0)
+      return -ENOSPC;
+  }
+
+	if (offset + size > MAX_FILE_SIZE)
+		return -EFBIG; // Tamanho máximo de arquivo excedido
+
+  /* Só os blocos lógicos atingidos pela escrita são reservados. Se ela
+     começa além do fim do arquivo, os blocos entre o fim atual e o offset
+     ficam como um buraco, lido como zeros */
+  uint32_t ini_bloco = offset / TAM_BLOCO;
+  uint32_t fim_bloco = (offset + size - 1) / TAM_BLOCO;
+  int cursor = a != NULL ? a->cursor : -1;
+	if (!cabe_intervalo(id, ini_bloco, fim_bloco, &cursor))
+		return -ENOSPC; // Não há espaço suficiente em disco para este arquivo
+
+  if ((uint64_t) offset > tamanho)
+    zera_apos_fim (id);
+  for (uint32_t logico = ini_bloco; logico <= fim_bloco; logico++)
+    if (bloco_do_arquivo(id, logico, &cursor) == 0)
+      return -ENOSPC;
+  if (a != NULL)
+    a->cursor = cursor;
+  return 0;
+}
+
+/* Corpo de write_brisafs e write_buf_brisafs, executado com a trava de
+   escrita do inode id. Os blocos são todos reservados antes, e os dados
+   de buf vão numa única chamada a fuse_buf_copy para os trechos contíguos
+   do disco que eles ocupam. No modo mmap, se buf vem de um descritor (o
+   pipe do FUSE, com splice), os trechos são posições no arquivo da imagem
+   e os dados podem ir do pipe para o arquivo sem passar por este processo */
+static int escreve_travado (uint32_t id, arquivo_aberto *a, struct fuse_bufvec *buf,
+                            size_t size, off_t offset) {
+  if (!aberto_valido(id, a))
+    return -ENOENT;
+
+  int ret = reserva_escrita(id, a, size, offset);
+  if (ret < 0)
+    return ret;
+
+  ssize_t escrito;
+  if (ret == 1) {
+    struct fuse_bufvec destino = FUSE_BUFVEC_INIT(size);
+    destino.buf[0].mem = superbloco[id].dados + offset;
+    escrito = fuse_buf_copy(&destino, buf, 0);
+    if (escrito > 0)
+      marca_inode (id);
+  } else {
+    // No máximo um trecho por bloco lógico escrito
+    size_t max = size / TAM_BLOCO + 2;
+    struct fuse_bufvec *destino = calloc(1, sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+    if (destino == NULL)
+      return -ENOMEM;
+    int para_fd = opcoes.mmap && (buf->buf[buf->idx].flags & FUSE_BUF_IS_FD);
+
+    int cursor = a != NULL ? a->cursor : -1;
+    size_t n_bufs = 0;
+    for (size_t feito = 0; feito < size; ) {
+      uint32_t desloc = (offset + feito) % TAM_BLOCO;
+      size_t n = TAM_BLOCO - desloc;
+      if (n > size - feito)
+        n = size - feito;
+      uint32_t bloco = mapeia_bloco_cursor(id, (offset + feito) / TAM_BLOCO, &cursor);
+      off_t pos = DISCO_OFFSET(bloco) + desloc;
+      struct fuse_buf *ult = n_bufs > 0 ? &destino->buf[n_bufs - 1] : NULL;
+      if (ult != NULL && ult->pos + (off_t) ult->size == pos) {
+        ult->size += n; // Continua o trecho anterior
+      } else {
+        struct fuse_buf *d = &destino->buf[n_bufs++];
+        d->size = n;
+        d->pos = pos;
+        if (para_fd) {
+          d->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+          d->fd = disco_fd;
+        } else {
+          d->mem = disco + pos;
+          d->fd = -1;
+        }
+      }
+      feito += n;
+    }
+    destino->count = n_bufs;
+    escrito = fuse_buf_copy(destino, buf, 0);
 
-  for(int i = 0; i < N_SUPERBLOCKS; i++){
-    if(superbloco[i].bloco != 0 && S_ISDIR(superbloco[i].type) && 
-       compara_nome(subdir, superbloco[i].nome)) {
-
-			// Se o id do inode for igual ao do inode analisado, prossegue
-			if (dir_tree(subdir) == i) {
-        dir = disco + DISCO_OFFSET(superbloco[i].bloco); // Aponta dir para o bloco do pai
-    		uint16_t *d = (uint16_t*) dir; // Faz um casting para uint16_t
-    		
-    		//Procura se existe um arquivo dentro do pai correspondente ao arquivo buscado
-    		for(int j = 1; j <= d[0]; j++) {
-    			//Se o arquivo existe no diretorio, preenche as informacoes ao buffer
-    			if(strcmp(filename,superbloco[d[j]].nome) == 0) {
-            stbuf->st_mode = superbloco[d[j]].type | superbloco[d[j]].direitos;
-            stbuf->st_nlink = 1;
-            stbuf->st_size = superbloco[d[j]].tamanho;
-            stbuf->st_mtime = superbloco[d[j]].timestamp[0];
-            stbuf->st_atime = superbloco[d[j]].timestamp[1];
-            stbuf->st_uid = superbloco[d[j]].userown;
-            stbuf->st_gid = superbloco[d[j]].groupown;
-            return 0;
-          }
-    		}
-        return -ENOENT;//Caso nao encontre o arquivo
+    // Só depois da cópia os blocos podem ir para o hdd1 e contar no cache
+    for (size_t i = 0; i < n_bufs; i++) {
+      struct fuse_buf *d = &destino->buf[i];
+      for (uint32_t b = d->pos / TAM_BLOCO; b <= (d->pos + d->size - 1) / TAM_BLOCO; b++) {
+        marca_sujo (b);
+        usa_bloco (b);
       }
     }
-	}
-  return -ENOENT; //Caso nao encontre o subdiretorio/pai
+    free(destino);
+  }
+  if (escrito <= 0)
+    return escrito < 0 ? escrito : -EIO;
+
+  if (offset + escrito > superbloco[id].tamanho)
+    superbloco[id].tamanho = offset + escrito;
+  armazena_data(0, id);
+  return escrito;
 }
 
-/* Devolve ao FUSE a estrutura completa do diretório indicado pelo
-   parâmetro path. Devolve 0 em caso de sucesso ou um código de
-   erro. Atenção ao uso abaixo dos demais parâmetros. */
-static int readdir_brisafs(const char *path, void *buf, fuse_fill_dir_t filler,
-                           off_t offset, struct fuse_file_info *fi) {
-	(void) offset;
-  (void) fi;
+/* Aloca os blocos das escritas atrasadas do arquivo aberto a, todos de
+   uma vez e contíguos sempre que possível, e copia os dados para eles.
+   Executada com a trava de escrita do inode id e entre inicia_operacao e
+   termina_operacao. Um erro fica em a->erro_atraso, para o fsync ou o
+   release, já que a escrita original já foi confirmada ao FUSE */
+int descarrega_atraso (uint32_t id, arquivo_aberto *a) {
+  if (atrasados[id] != a || a->tam_atraso == 0)
+    return 0;
+  atrasados[id] = NULL;
+  __atomic_fetch_sub (&blocos_reservados, a->reservados_atraso, __ATOMIC_RELAXED);
+  a->reservados_atraso = 0;
+  uint64_t ini = a->ini_atraso;
+  size_t size = a->tam_atraso;
+  a->tam_atraso = 0;
 
-  filler(buf, ".", NULL, 0);
-  filler(buf, "..", NULL, 0);
-	
-	uint16_t id = dir_tree(path);
-	if (id > MIN_DATABLOCKS)
-		return -ENOENT;
-	
-  dir = disco + DISCO_OFFSET(superbloco[id].bloco);
-  uint16_t *d = (uint16_t*) dir;
-  for(int j = 1; j <= d[0]; j++) {
-  	filler(buf, superbloco[d[j]].nome, NULL, 0);
+  int ret = aloca_intervalo (id, ini / TAM_BLOCO, (ini + size - 1) / TAM_BLOCO);
+  if (ret == 0) {
+    struct fuse_bufvec origem = FUSE_BUFVEC_INIT(size);
+    origem.buf[0].mem = a->atraso;
+    ret = escreve_travado (id, a, &origem, size, ini);
+  }
+  if (ret < 0) {
+    a->erro_atraso = ret;
+    return ret;
   }
   return 0;
 }
 
-/* Abre um arquivo. Caso deseje controlar os arquvos abertos é preciso
-   implementar esta função */
-static int open_brisafs(const char *path, struct fuse_file_info *fi) {
-    return 0;
+/* Descarrega as escritas atrasadas do inode id, para quem ainda não tem a
+   trava dele nem está dentro de uma operação */
+int descarrega_inode (uint32_t id) {
+  inicia_operacao ();
+  trava_escrita (id);
+  int ret = atrasados[id] != NULL ? descarrega_atraso (id, atrasados[id]) : 0;
+  destrava (id);
+  termina_operacao ();
+  return ret;
 }
 
-/* Função chamada quando o FUSE deseja ler dados de um arquivo
-   indicado pelo parâmetro path. Se você implementou a função
-   open_brisafs, o uso do parâmetro fi é necessário. A função lê size
-   bytes, a partir do offset do arquivo path no buffer buf. */
-static int read_brisafs(const char *path, char *buf, size_t size,
-                        off_t offset, struct fuse_file_info *fi) {
-		
-	uint16_t id = dir_tree(path);
-	if (id > MIN_DATABLOCKS)
-		return -ENOENT; // Arquivo não encontrado
-  
-  // Tamanho do arquivo a ser lido
-  size_t len = superbloco[id].tamanho;
-  // Quantidade de blocos que o read vai ler
-  int num_blocos = (1+((size-1) / TAM_BLOCO));
-  // Bloco sendo lido
-  uint16_t supb = id;
-  // Quantidade lida
-  uint32_t read_size;
-  // Faltando ser lido
-  uint32_t remaining_size;
-   
-  printf("Caminho: %s\n", path);
-  //printf("Buf: %s\n", buf);
-  printf("Tamanho: %ld\n", size);
-  printf("Offset: %ld\n", offset);
-  printf("len: %ld\n", len);
-  printf("Blocos que o arquivo ocupa: %d\n", num_blocos);
-  armazena_data(1, id);
-  
-  if (offset >= len) {//tentou ler além do fim do arquivo
-    printf("Tentou ler o fim do arquivo\n");
+/* Adquire a trava de leitura do inode id sem escritas atrasadas, para que
+   os leitores vejam os dados delas nos blocos do arquivo */
+void trava_leitura_descarregada (uint32_t id) {
+  trava_leitura (id);
+  while (atrasados[id] != NULL) {
+    destrava (id);
+    descarrega_inode (id);
+    trava_leitura (id);
+  }
+}
+
+/* Alocação atrasada: uma escrita no fim do arquivo não aloca blocos, só
+   reserva a quantidade deles e é copiada para o buffer do arquivo aberto.
+   Escritas seguintes contíguas se juntam no buffer, e os blocos são
+   alocados de uma vez quando ele enche ou quando outra operação precisa
+   dos dados (descarrega_atraso). Assim, arquivos escritos ao mesmo tempo
+   por várias threads não intercalam os seus blocos no disco.
+   Devolve a quantidade de bytes atrasados, 0 se a escrita deve seguir
+   pelo caminho normal ou um código de erro negativo */
+static int atrasa_escrita (uint32_t id, arquivo_aberto *a, struct fuse_bufvec *buf,
+                           size_t size, off_t offset) {
+  if (!aberto_valido(id, a))
+    return -ENOENT;
+  // Os dados atrasados por outro arquivo aberto vêm antes desta escrita
+  if (atrasados[id] != NULL && atrasados[id] != a)
+    descarrega_atraso (id, atrasados[id]);
+  if (a == NULL || a->instantaneo != NULL || !S_ISREG(superbloco[id].type))
+    return 0;
+
+  int contigua = a->tam_atraso > 0 && (uint64_t) offset == a->ini_atraso + a->tam_atraso;
+  if (a->tam_atraso > 0 && (!contigua || a->tam_atraso + size > TAM_ATRASO))
+    descarrega_atraso (id, a);
+  // Sem os dados ainda no buffer, que podem ter acabado de ser descarregados
+  uint64_t tamanho = superbloco[id].tamanho;
+  if (!contigua && (uint64_t) offset < tamanho) // Só escritas no fim do arquivo
+    return 0;
+  contigua = a->tam_atraso > 0;
+  if (size > TAM_ATRASO || offset + size <= TAM_INLINE || offset + size > MAX_FILE_SIZE)
     return 0;
+  if (eh_inline(id) && tamanho > 0 && promove_inline(id) < 0)
+    return -ENOSPC;
+
+  // Blocos ainda não mapeados nem reservados pelas escritas anteriores
+  uint32_t ini_bloco = contigua ? (offset + TAM_BLOCO - 1) / TAM_BLOCO : offset / TAM_BLOCO;
+  uint32_t fim_bloco = (offset + size - 1) / TAM_BLOCO;
+  int cursor = a->cursor;
+  int64_t novos = 0;
+  for (uint64_t logico = ini_bloco; logico <= fim_bloco; logico++)
+    if (mapeia_bloco_cursor(id, logico, &cursor) == 0)
+      novos++;
+  if (novos > 0 && __atomic_add_fetch (&blocos_reservados, novos, __ATOMIC_RELAXED) + 1 >
+      __atomic_load_n (&free_space, __ATOMIC_RELAXED)) {
+    __atomic_fetch_sub (&blocos_reservados, novos, __ATOMIC_RELAXED);
+    return -ENOSPC;
   }
-  
-  // Se o que está sendo lido é mais do que o primeiro bloco de dados
-  if (offset + size > TAM_BLOCO) {
-  	if (offset > TAM_BLOCO) { // Se o inicio da leitura for além do primeiro bloco
-  		read_size = 0; // Não leu nada ainda
-  		remaining_size = size; // Falta ler tudo
-  		
-  		uint32_t read_offset = 0;
-  		// Loop para chegar até o bloco onde está o offset de leitura
-  		while (read_offset < offset) {
-  			if (superbloco[supb].proxbloco != 0) {
-  				supb = superbloco[supb].proxbloco;
-  				read_offset = read_offset + TAM_BLOCO;
-  			} else {
-  				return 0;
-  			}
-  		}
-  	} else { // Se o início da leitura for no primeiro bloco
-  		printf("offset + size maior que TAM_BLOCO\n");
-  		read_size = TAM_BLOCO - offset; // Tamanho que será lido
-  		remaining_size = size - read_size; // Tamanho que falta ser lido
-  		printf("1. Lendo inode %u referente ao bloco %u\n", superbloco[id].id, superbloco[id].bloco);
-    	memcpy(buf, disco + DISCO_OFFSET(superbloco[id].bloco) + offset, read_size);
-    	supb = superbloco[supb].proxbloco; // Próximo bloco de dados
-  	}
-  } else { // Se o que está sendo lido está inteiramente contido no primeiro bloco
-  	printf("2. Lendo inode %u referente ao bloco %u\n", superbloco[id].id, superbloco[id].bloco);
-  	memcpy(buf, disco + DISCO_OFFSET(superbloco[id].bloco) + offset, size);
-  	return size;
+
+  if (a->atraso == NULL && (a->atraso = malloc(TAM_ATRASO)) == NULL) {
+    __atomic_fetch_sub (&blocos_reservados, novos, __ATOMIC_RELAXED);
+    return -ENOMEM;
   }
-  
-  // Laço para leitura dos blocos extras				
-	for (int k = 0; k < num_blocos; k++) {
-		printf("EB: %d/%d\n", k, num_blocos);
-		printf("Read Size: %d\n", read_size);
-  	printf("Remaining Size: %u\n", remaining_size);
-		
-		// Se o que falta ler é mais do que um bloco
-		if (remaining_size > TAM_BLOCO) {
-			printf("EB1. Lendo inode %u referente ao bloco %u\n", superbloco[supb].id, superbloco[supb].bloco);
-			memcpy(buf+read_size, disco + DISCO_OFFSET(superbloco[supb].bloco), TAM_BLOCO);
-    	supb = superbloco[supb].proxbloco;
-			read_size = read_size + TAM_BLOCO;
-  		remaining_size = size - read_size;
-		} else { // Se o que falta ler é apenas 1 bloco
-			printf("EB2. Lendo inode %u referente ao bloco %u\n", superbloco[supb].id, superbloco[supb].bloco);
-			memcpy(buf+read_size, disco + DISCO_OFFSET(superbloco[supb].bloco), remaining_size);
-  		return size;
-		}
-	}
-	return 0;
+  struct fuse_bufvec destino = FUSE_BUFVEC_INIT(size);
+  destino.buf[0].mem = a->atraso + a->tam_atraso;
+  ssize_t copiado = fuse_buf_copy(&destino, buf, 0);
+  if (copiado <= 0) {
+    __atomic_fetch_sub (&blocos_reservados, novos, __ATOMIC_RELAXED);
+    return copiado < 0 ? copiado : -EIO;
+  }
+
+  if (!contigua) {
+    if ((uint64_t) offset > tamanho) // O trecho antes do offset é um buraco
+      zera_apos_fim (id);
+    a->ini_atraso = offset;
+  }
+  a->tam_atraso += copiado;
+  a->reservados_atraso += novos;
+  atrasados[id] = a;
+  // superbloco[id].tamanho só muda na descarga (ver tamanho_de)
+  armazena_data(0, id);
+  return copiado;
+}
+
+/* Localiza o inode de path (ou do arquivo aberto em fi) e escreve nele o
+   conteúdo de buf a partir de offset */
+static int escreve_bufvec (const char *path, struct fuse_bufvec *buf, off_t offset,
+                           struct fuse_file_info *fi) {
+  arquivo_aberto *a = aberto_de(fi);
+  uint32_t id = a != NULL ? a->id : dir_tree(path);
+  if (id > N_INODES)
+		return -ENOENT; // Arquivo não encontrado
+  TRACE_INODE (id);
+  size_t size = fuse_buf_size(buf);
+	if (size == 0)
+		return 0;
+
+  trava_escrita (id);
+  int ret = atrasa_escrita (id, a, buf, size, offset);
+  if (ret == 0)
+    ret = escreve_travado (id, a, buf, size, offset);
+  destrava (id);
+  return ret;
 }
 
 /* Função chamada quando o FUSE deseja escrever dados em um arquivo
@@ -586,238 +3767,262 @@ static int read_brisafs(const char *path, char *buf, size_t size,
    //Em caso de Segmatation fault: fusermount -u <dir>
 static int write_brisafs(const char *path, const char *buf, size_t size,
                          off_t offset, struct fuse_file_info *fi) {
-	
-	printf("Path: %s\n", path);
-  //printf("Buf: %s\n", buf);
-  //printf("Tamanho do Buf: %ld\n", strlen(buf));
-  printf("Size: %ld\n", size);
-  printf("Offset: %ld\n", offset);
-	
-  uint16_t id = dir_tree(path);
-  if (id > MIN_DATABLOCKS)
+  struct fuse_bufvec origem = FUSE_BUFVEC_INIT(size);
+  origem.buf[0].mem = (void*) buf;
+  return escreve_bufvec (path, &origem, offset, fi);
+}
+
+/* Escrita a partir dos buffers do FUSE, que podem ser um pipe com os dados
+   ainda no kernel (splice) */
+static int write_buf_brisafs(const char *path, struct fuse_bufvec *buf, off_t offset,
+                             struct fuse_file_info *fi) {
+  return escreve_bufvec (path, buf, offset, fi);
+}
+
+/* Procura dados ou buracos num arquivo esparso (SEEK_DATA e SEEK_HOLE).
+   O FUSE só repassa o lseek a partir do libfuse 3.8, cuja tabela de
+   operações este arquivo não usa; a busca é feita por brisafs_busca */
+static off_t lseek_brisafs(const char *path, off_t offset, int whence,
+                           struct fuse_file_info *fi) {
+  if (whence != SEEK_DATA && whence != SEEK_HOLE)
+    return -EINVAL;
+  arquivo_aberto *a = aberto_de(fi);
+  uint32_t id = a != NULL ? a->id : dir_tree(path);
+  if (id > N_INODES)
 		return -ENOENT; // Arquivo não encontrado
-	
-	printf("Tamanho atual: %d\n", superbloco[id].tamanho);
-		
-  // Quantidade de blocos que o arquivo ocupa atualmente
-  int ini_blocos = (1+((superbloco[id].tamanho-1) / TAM_BLOCO));
-  // Quantidade de blocos que o arquivo precisará
-  int fim_blocos = (1+((superbloco[id].tamanho+size-1) / TAM_BLOCO));
-  // Quantidade de blocos a mais
-  int ext_blocos = fim_blocos - ini_blocos;
-  // Variáveis auxiliares
-  uint16_t supb = id;
-  uint32_t wrt_size;
-  uint32_t remaining_size;
-  				
-	printf("Blocos que o arquivo ocupa atualmente: %d\n", ini_blocos);
-	printf("Blocos que o arquivo precisará: %d\n", fim_blocos);
-	printf("Blocos extras que o arquivo precisará: %d\n", ext_blocos);
-	//printf("Write Size: %d\n", wrt_size);
-	//printf("Remaining Size: %ld\n", remaining_size);
-	
-	if (superbloco[id].tamanho + size > MAX_FILE_SIZE) {
-		printf("Tamanho máximo de arquivo excedido!\n");
-		return EFBIG;
-	} else if (ext_blocos > free_space) {
-		printf("Não há espaço suficiente em disco para este arquivo!\n");
-		return ENOSPC;
-	}
-  
-  // Pega o último bloco do arquivo    	
-  while (superbloco[supb].proxbloco != 0) {
-  	supb = superbloco[supb].proxbloco;
-  }
-	
-	/* Se tamanho do buffer a ser escrito não couber no último bloco já existente 
-	do arquivo, preenche apenas o que couber */
-  if (offset + size > TAM_BLOCO) {
-  	if (offset < TAM_BLOCO) {
-  		wrt_size = TAM_BLOCO - offset;
-  		remaining_size = size - wrt_size;
-  		printf("1. To escrevendo %d bytes no bloco %u referente ao inode %u\n\n", 
-        		wrt_size, superbloco[supb].bloco, superbloco[supb].id);
-    	memcpy(disco + DISCO_OFFSET(superbloco[supb].bloco) + offset, buf, wrt_size);
-    	superbloco[id].tamanho = offset + wrt_size;
-    	armazena_data(0, id);
-  	} else { // Se não couber nada no último bloco
-  		printf("Veio aqui...\n");
-  		wrt_size = 0;
-  		remaining_size = size;
-  	}
-  	// Não tem return, pois ainda falta salvar o resto dos dados
-	} else { // Se o buffer couber inteiro no último bloco já existente do arquivo
-		printf("2. To escrevendo %ld bytes no bloco %u referente ao inode %u\n\n", 
-        		size, superbloco[supb].bloco, superbloco[supb].id);
-		memcpy(disco + DISCO_OFFSET(superbloco[supb].bloco) + offset, buf, size);
-		superbloco[id].tamanho = offset + size;
-    armazena_data(0, id);
-    printf("Terminei!\n");
-		return size;
-	}
-	
-	// Laço para a criação dos blocos extras para acomodar todo o buffer				
-	for (int k = 0; k < ext_blocos; k++) {
-		printf("EB: %d/%d\n", k, ext_blocos);
-		for (int isb = 0; isb < N_SUPERBLOCKS; isb++) {
-  		if (superbloco[isb].bloco == 0) { //ninguem usando
-    		uint16_t bloco = N_SUPERBLOCKS + isb + 1;
-    		printf("EB - Inode vazio: %d - Bloco vazio: %d\n", isb, bloco);
-    		
-    		// Preenche apenas o essencial, pois o primeiro inode já tem as infos do arquivo		
-    		superbloco[isb].id = isb;
-    		superbloco[isb].bloco = bloco;
-    		
-    		// O último bloco do arquivo agora passa a ser esse recém criado
-				superbloco[isb].proxbloco = 0; // 0 indica ultimo bloco
-				superbloco[supb].proxbloco = isb; // O penultimo bloco aponta para o último
-				// Salva o último bloco para futura referência de um eventual novo último bloco
-				supb = isb; 
-					
-				//printf("Conteúdo: %s\n", conteudo);
-    		//printf("Tamanho do Conteúdo: %lu\n", sizeof(conteudo));
-    		
-    		// Se todo o buffer restante não couber em um bloco 
-				if (remaining_size > TAM_BLOCO) {
-					printf("EB1. To escrevendo %d bytes no bloco %u referente ao inode %u\n\n", 
-        		TAM_BLOCO, superbloco[supb].bloco, superbloco[supb].id);
-      		memcpy(disco + DISCO_OFFSET(bloco), buf + wrt_size, TAM_BLOCO);
-      	  wrt_size = wrt_size + TAM_BLOCO; // Atualiza o tanto que já foi escrito
-      	  remaining_size = size - wrt_size; // Atualiza o quanto falta ser escrito
-      	  superbloco[id].tamanho = offset + wrt_size; // Atualiza o tamanho do arquivo
-      	 	armazena_data(0, id);
-      	  free_space--;
-					break;
-				} else { // Se todo o buffer restante couber neste bloco
-					printf("EB2. To escrevendo %d bytes no bloco %u referente ao inode %u\n\n", 
-        		remaining_size, superbloco[supb].bloco, superbloco[supb].id);
-					memcpy(disco + DISCO_OFFSET(bloco), buf + wrt_size, remaining_size);
-					wrt_size = wrt_size + remaining_size; // Atualiza o tanto que já foi escrito
-					superbloco[id].tamanho = offset + wrt_size; // Atualiza o tamanho do arquivo
-      	 	armazena_data(0, id);
-					free_space--;
-					return size;
-				}
-			}
-		}
-	}
+  TRACE_INODE (id);
 
-  //Se chegou aqui não achou. Entao cria
-  //Acha o primeiro bloco vazio
-  if (preenche_bloco (path, DIREITOS_PADRAO, size, buf, S_IFREG) == 0) {
-  	printf("EU ENTREI AQUI\n");
-  	return size;
-  }
-  return -EIO;
+  trava_leitura_descarregada (id);
+  off_t ret = aberto_valido(id, a) ? busca_dado_buraco (id, offset, whence) : -ENOENT;
+  destrava (id);
+  return ret;
 }
 
-// Remove um arquivo
-static int unlink_brisafs(const char *path) {
-	
+/* Localiza o arquivo path e o diretório que o contém para uma remoção.
+   Em caso de sucesso, devolve 0 com as travas de escrita do pai e do
+   arquivo, nesta ordem, já adquiridas, e o nome do arquivo em *nome, que
+   deve ser liberado por quem chama */
+static int trava_para_remover (const char *path, uint32_t *pai, uint32_t *id, char **nome) {
 	char *subdir = NULL;
   char *filename = NULL;
   quebra_nome(path, &filename, &subdir);
   
-  uint16_t id = dir_tree(subdir);
-  if (id > MIN_DATABLOCKS)
+  *pai = dir_tree(subdir);
+  *id = N_INODES + 1;
+  if (*pai <= N_INODES) {
+    size_t len = strlen(filename);
+    trava_escrita (*pai);
+    *id = busca_entrada(*pai, filename, len, hash_nome(filename, len));
+    if (*id > N_INODES)
+      destrava (*pai);
+  }
+  free(subdir);
+  if (*id > N_INODES) {
+    free(filename);
 		return -ENOENT; // Arquivo não encontrado
-	
-  dir = disco + DISCO_OFFSET(superbloco[id].bloco);
-  uint16_t *d = (uint16_t*) dir;
-  // Varre todos os arquivos dentro do pai para encontrar o arquivo
-  for(int j = 1; j <= d[0]; j++) {
-  	if (compara_nome(path, superbloco[d[j]].nome)) { // achou!
-    	/* Informa que o bloco está disponível para gravação, assim como todos os 
-    	blocos do arquivo, caso ele tenha mais do que 4096 bytes */
-      uint16_t sb = d[j];
-      while (sb != 0) {
-      	superbloco[sb].bloco = 0;
-      	superbloco[sb].tamanho = 0;
-      	sb = superbloco[sb].proxbloco;
-      } 
-      
-      // Remove o arquivo do diretório pai
-      d[0]--;
-      for(int w = j; w <= d[0]; w++) {
-      	d[w] = d[w+1];
+  }
+
+  TRACE_INODE (*id);
+  trava_escrita (*id);
+  *nome = filename;
+  return 0;
+}
+
+// Remove um arquivo
+static int unlink_brisafs(const char *path) {
+  uint32_t pai, id;
+  char *nome;
+  int ret = trava_para_remover (path, &pai, &id, &nome);
+  if (ret < 0)
+    return ret;
+
+  if (S_ISDIR(superbloco[id].type)) {
+    ret = -EISDIR;
+  } else {
+    // Remove o arquivo do diretório pai
+    remove_entrada (pai, nome, strlen(nome));
+    /* Informa que o inode está disponível para gravação, assim como todos os 
+    blocos do arquivo */
+    libera_inode (id);
+  }
+  destrava (id);
+  destrava (pai);
+  free(nome);
+  return ret;
+}
+
+/* Apaga tudo o que está dentro do diretório dir, travado para escrita,
+   descendo pelos subdiretórios. Cada diretório esvaziado deixa de ter
+   entradas no cache */
+static void apaga_conteudo (uint32_t dir) {
+  //Varre as folhas do diretório que será apagado, apagando todos os arquivos internos
+  cursor_dir k = {0, 0};
+  for (uint32_t folha; (folha = proxima_folha(dir, &k)) != 0; ) {
+    folha_dir *f = folha_de(dir, folha);
+    entrada_dir *e = (entrada_dir*) f->entradas;
+    for (uint32_t j = 0; j < f->n; j++, e = proxima_entrada(e)) {
+      uint32_t filho = e->id;
+      if (inode_em_uso(filho)) { //achou um arquivo dentro do diretorio
+        // Informa que o inode e todos os blocos do arquivo estão disponíveis
+        trava_escrita (filho);
+        if (S_ISDIR(superbloco[filho].type))
+          apaga_conteudo (filho);
+        libera_inode (filho);
+        destrava (filho);
       }
-      return 0;
-		}
+    }
   }
-  return -ENOENT; // Arquivo não encontrado
+  // Nenhuma entrada do cache pode continuar apontando para este diretório
+  dcache_invalida_dir (dir);
 }
 
 // Remove um diretório, assim como todos os arquivos dentro dele
 static int rmdir_brisafs (const char *path) {
+  uint32_t pai, id;
+  char *nome;
+  int ret = trava_para_remover (path, &pai, &id, &nome);
+  if (ret < 0)
+    return ret;
+
+  if (!S_ISDIR(superbloco[id].type)) {
+    destrava (id);
+    destrava (pai);
+    free(nome);
+    return -ENOTDIR;
+  }
 	
-	char *subdir = NULL;
-  char *filename = NULL;
-  quebra_nome(path, &filename, &subdir);
+  apaga_conteudo (id);
   
-  uint16_t id = dir_tree(subdir);
-  if (id > MIN_DATABLOCKS)
-		return -ENOENT; // Arquivo não encontrado
-	
-	// Leva o ponteiro d0 até o pai do diretório que será apagado
-  dir = disco + DISCO_OFFSET(superbloco[id].bloco);
-  uint16_t *d0 = (uint16_t*) dir;
-  // Varre todos os arquivos dentro do pai para encontrar o diretório
-  for(int j = 1; j <= d0[0]; j++) {
-  	if (compara_nome(path, superbloco[d0[j]].nome)) { // achou!
-    	
-    	// Leva o ponterio d1 para o diretório que será apagado
-    	dir = disco + DISCO_OFFSET(superbloco[d0[j]].bloco);
-  		uint16_t *d1 = (uint16_t*) dir;
-    	
-    	//Varre o diretório que será apagado, apagando todos os arquivos internos
-    	for(int i = 1; i <= d1[0]; i++) {
-  			if (superbloco[d1[i]].bloco == 0) { //achou um arquivo dentro do diretorio*/
-    			/* Informa que o bloco está disponível para gravação, assim como todos
-    			 os blocos do arquivo, caso ele tenha mais do que 4096 bytes */
-      		uint16_t sb = d1[i];
-      		while (sb != 0) {
-      			superbloco[sb].bloco = 0;
-      			superbloco[sb].tamanho = 0;
-      			sb = superbloco[sb].proxbloco;
-      		} 
-    		}
-    	}
-    	
-    	// Apaga o diretório, informando que está disponível para gravação
-      superbloco[d0[j]].bloco = 0;
-      superbloco[d0[j]].tamanho = 0;
-      		
-      // Remove o diretório do diretório pai
-      d0[0]--;
-      for(int w = j; w <= d0[0]; w++) {
-      	d0[w] = d0[w+1];
-      }
-      return 0;
-		}
-  }
-  return -ENOENT; // Arquivo não encontrado
+  // Remove o diretório do diretório pai e o apaga
+  remove_entrada (pai, nome, strlen(nome));
+  libera_inode (id);
+  destrava (id);
+  destrava (pai);
+  free(nome);
+  return 0;
 }
 
 /* Altera o tamanho do arquivo apontado por path para tamanho size
    bytes */
 static int truncate_brisafs(const char *path, off_t size) {
   if (size > MAX_FILE_SIZE) {
-  	return EFBIG;
+  	return -EFBIG;
 	}
 	
-	uint16_t findex = MIN_DATABLOCKS + 1;
+	uint32_t findex = N_INODES + 1;
 
   findex = dir_tree(path);	
 	
   //procura o arquivo
-  if (findex <= MIN_DATABLOCKS) {// arquivo existente
-  	superbloco[findex].tamanho = size;
-    return 0;
+  if (findex <= N_INODES) {// arquivo existente
+    TRACE_INODE (findex);
+    trava_escrita (findex);
+    if (atrasados[findex] != NULL)
+      descarrega_atraso (findex, atrasados[findex]);
+    int ret = -ENOENT;
+    if (inode_em_uso(findex)) {
+      ret = 0;
+      if (eh_inline(findex)) {
+        uint64_t tamanho = superbloco[findex].tamanho;
+        if (size > TAM_INLINE && tamanho > 0)
+          ret = promove_inline(findex);
+        else if (size < tamanho) // Um novo crescimento deve ler zeros
+          memset(superbloco[findex].dados + size, 0, tamanho - size);
+      } else if ((uint64_t) size > superbloco[findex].tamanho) {
+        zera_apos_fim (findex); // O crescimento é um buraco
+      } else { // Os blocos além do novo fim voltam a ficar livres
+        ret = libera_intervalo (findex, ((uint64_t) size + TAM_BLOCO - 1) / TAM_BLOCO,
+                                (uint64_t) UINT32_MAX + 1);
+      }
+      if (ret == 0) {
+  	    superbloco[findex].tamanho = size;
+  	    marca_inode (findex);
+      }
+    }
+    destrava (findex);
+    return ret;
   } else {// Arquivo novo
-    //Acha o primeiro bloco vazio
-  	preenche_bloco (path, DIREITOS_PADRAO, size, NULL, S_IFREG);
+    // Criado vazio e crescido como um arquivo existente, com um buraco
+  	int ret = preenche_bloco (path, DIREITOS_PADRAO, 0, NULL, S_IFREG);
+    return ret < 0 || size == 0 ? ret : truncate_brisafs (path, size);
   }
-  return 0;
+}
+
+/* Reserva blocos para o intervalo [offset, offset + length) do arquivo
+   (mode 0 ou FALLOC_FL_KEEP_SIZE, que não altera o tamanho) ou libera os
+   blocos inteiros do intervalo e zera o resto dele (FALLOC_FL_PUNCH_HOLE) */
+static int fallocate_brisafs(const char *path, int mode, off_t offset, off_t length,
+                             struct fuse_file_info *fi) {
+  if (offset < 0 || length <= 0)
+    return -EINVAL;
+  if (mode != 0 && mode != FALLOC_FL_KEEP_SIZE &&
+      mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+    return -EOPNOTSUPP;
+  if ((uint64_t) offset + length > MAX_FILE_SIZE)
+    return -EFBIG;
+
+  arquivo_aberto *a = aberto_de(fi);
+  uint32_t id = a != NULL ? a->id : dir_tree(path);
+  if (id > N_INODES)
+		return -ENOENT; // Arquivo não encontrado
+  TRACE_INODE (id);
+
+  trava_escrita (id);
+  if (atrasados[id] != NULL)
+    descarrega_atraso (id, atrasados[id]);
+  int ret = -ENOENT;
+  uint64_t fim = (uint64_t) offset + length;
+  if (!aberto_valido(id, a)) {
+    // Removido
+  } else if (!S_ISREG(superbloco[id].type)) {
+    ret = -ENODEV;
+  } else if (mode & FALLOC_FL_PUNCH_HOLE) {
+    if (eh_inline(id)) {
+      if ((uint64_t) offset < TAM_INLINE)
+        memset(superbloco[id].dados + offset, 0, (fim < TAM_INLINE ? fim : TAM_INLINE) - offset);
+      ret = 0;
+    } else {
+      // Só os blocos inteiramente dentro do intervalo são liberados
+      uint64_t ini_bloco = ((uint64_t) offset + TAM_BLOCO - 1) / TAM_BLOCO;
+      uint64_t fim_bloco = fim / TAM_BLOCO;
+      ret = libera_intervalo(id, ini_bloco, fim_bloco);
+      if (ret == 0 && ini_bloco < fim_bloco) {
+        zera_trecho(id, offset, ini_bloco * TAM_BLOCO);
+        zera_trecho(id, fim_bloco * TAM_BLOCO, fim);
+      } else if (ret == 0) {
+        zera_trecho(id, offset, fim);
+      }
+    }
+    if (ret == 0)
+      armazena_data(0, id);
+  } else {
+    ret = 0;
+    uint64_t tamanho = superbloco[id].tamanho;
+    if (eh_inline(id) && fim > TAM_INLINE && tamanho > 0)
+      ret = promove_inline(id);
+    if (ret == 0 && !(eh_inline(id) && fim <= TAM_INLINE)) {
+      /* Os blocos vêm em sequências contíguas, como os de uma escrita
+         atrasada, e não um a um como os de uma escrita */
+      uint32_t ini_bloco = offset / TAM_BLOCO;
+      uint32_t fim_bloco = (fim - 1) / TAM_BLOCO;
+      int cursor = -1;
+      if (!cabe_intervalo(id, ini_bloco, fim_bloco, &cursor)) {
+        ret = -ENOSPC;
+      } else {
+        if (fim > tamanho)
+          zera_apos_fim (id);
+        ret = aloca_intervalo(id, ini_bloco, fim_bloco);
+      }
+    }
+    if (ret == 0) {
+      if (!(mode & FALLOC_FL_KEEP_SIZE) && fim > superbloco[id].tamanho) {
+        superbloco[id].tamanho = fim;
+        armazena_data(0, id);
+      }
+    }
+  }
+  destrava (id);
+  return ret;
 }
 
 /* Cria um arquivo comum ou arquivo especial (links, pipes, ...) no caminho
@@ -828,12 +4033,9 @@ static int mknod_brisafs(const char *path, mode_t mode, dev_t rdev) {
     //mknod" para instruções de como pegar os direitos e demais
     //informações sobre os arquivos
     //Acha o primeiro bloco vazio
-    if(preenche_bloco (path, DIREITOS_PADRAO, 0, NULL, S_IFREG) == 0) {
-    	return 0;
-		}
-    return ENOSPC;
+    return preenche_bloco (path, DIREITOS_PADRAO, 0, NULL, S_IFREG);
   }
-  return EINVAL;
+  return -EINVAL;
 }
 
 
@@ -842,7 +4044,19 @@ static int mknod_brisafs(const char *path, mode_t mode, dev_t rdev) {
    persistidas */
 static int fsync_brisafs(const char *path, int isdatasync,
                          struct fuse_file_info *fi) {
-	return 0;
+  arquivo_aberto *a = aberto_de(fi);
+  uint32_t id = a != NULL ? a->id : dir_tree(path);
+  int ret = 0;
+  if (id <= N_INODES) {
+    TRACE_INODE (id);
+    descarrega_inode (id);
+  }
+  if (a != NULL && a->erro_atraso < 0) { // Erro de uma descarga anterior
+    ret = a->erro_atraso;
+    a->erro_atraso = 0;
+  }
+  int erro = sincroniza_disco();
+	return ret < 0 ? ret : erro;
 }
 
 /* Ajusta a data de acesso e modificação do arquivo com resolução de nanosegundos */
@@ -852,12 +4066,16 @@ static int utimens_brisafs(const char *path, const struct timespec ts[2]) {
 }
 
 static int chown_brisafs(const char *path, uid_t userowner, gid_t groupowner){
-  printf("O GRUPO É: %d\n", groupowner);
-  printf("O USUARIO É: %d\n", userowner);
-  
-  uint16_t id = dir_tree(path);
-  if (id > MIN_DATABLOCKS)
+  uint32_t id = dir_tree(path);
+  if (id > N_INODES)
 		return -ENOENT; // Arquivo não encontrado
+  TRACE_INODE (id);
+
+  trava_escrita (id);
+  if (!inode_em_uso(id)) {
+    destrava (id);
+    return -ENOENT;
+  }
 		
   if(userowner != -1)
   	superbloco[id].userown = userowner;
@@ -865,16 +4083,28 @@ static int chown_brisafs(const char *path, uid_t userowner, gid_t groupowner){
   if(groupowner != -1)
   	superbloco[id].groupown = groupowner;
 
+  marca_inode (id);
+  destrava (id);
+
   return 0;
 }
 
 static int chmod_brisafs(const char *path, mode_t mode) {
 	
-	uint16_t id = dir_tree(path);
-  if (id > MIN_DATABLOCKS)
+	uint32_t id = dir_tree(path);
+  if (id > N_INODES)
 		return -ENOENT; // Arquivo não encontrado
+  TRACE_INODE (id);
+
+  trava_escrita (id);
+  if (!inode_em_uso(id)) {
+    destrava (id);
+    return -ENOENT;
+  }
 	
   superbloco[id].direitos = mode;
+  marca_inode (id);
+  destrava (id);
   
   return 0;
 }
@@ -887,60 +4117,494 @@ static int create_brisafs(const char *path, mode_t mode,
 	//cuidar disso Veja "man 2 mknod" para instruções de como pegar os
 	//direitos e demais informações sobre os arquivos Acha o primeiro
 	//bloco vazio
-	if(preenche_bloco (path, DIREITOS_PADRAO, 0, NULL, S_IFREG) == 0) {
-		return 0;
-  }
-	return ENOSPC;
+	int ret = preenche_bloco (path, DIREITOS_PADRAO, 0, NULL, S_IFREG);
+	if (ret < 0)
+		return ret;
+	return open_brisafs (path, fi);
 }
 
 // Cria um diretório no caminho apontado por path
 static int mkdir_brisafs(const char *path, mode_t type){
-	if(preenche_bloco (path, DIREITOS_PADRAO, 0, NULL, S_IFDIR) == 0) {
-		return 0;
-	}
-  return ENOSPC;
+	return preenche_bloco (path, DIREITOS_PADRAO, 0, NULL, S_IFDIR);
 }
 
-// Release de um arquivo
+// Release de um arquivo: libera o arquivo aberto guardado em fi->fh
 static int release_brisafs(const char *path, struct fuse_file_info *fi) {
-	salva_disco();
-  return 0;
+  arquivo_aberto *a = aberto_de(fi);
+  int ret = 0;
+  if (a != NULL) {
+    if (a->tam_atraso > 0)
+      descarrega_inode (a->id);
+    if (a->leitor_fd)
+      solta_leitor_fd (a->id);
+    ret = a->erro_atraso;
+    free(a->atraso);
+    free(a->instantaneo);
+  }
+  free(a);
+  fi->fh = 0;
+  int erro = salva_disco();
+  return ret < 0 ? ret : erro;
+}
+
+/* Versões das operações que entram na tabela do FUSE. Cada uma mede a
+   operação original, conta a chamada nas estatísticas e, com
+   BRISAFS_TRACE, grava um evento no anel da thread */
+#define MEDE_CHAMADA(op, offset, tamanho, chamada) \
+  uint64_t inicio = relogio_ns (); \
+  TRACE_INODE (0); \
+  int ret = chamada; \
+  MEDE_FIM (op, offset, tamanho)
+
+/* Como MEDE_CHAMADA, para as operações que alteram metadados, que ficam
+   entre inicia_operacao e termina_operacao */
+#define MEDE_ALTERACAO(op, offset, tamanho, chamada) \
+  uint64_t inicio = relogio_ns (); \
+  TRACE_INODE (0); \
+  inicia_operacao (); \
+  int ret = chamada; \
+  termina_operacao (); \
+  MEDE_FIM (op, offset, tamanho)
+
+#define MEDE_FIM(op, offset, tamanho) \
+  uint64_t fim = relogio_ns (); \
+  registra_estatistica (op, fim - inicio, ret); \
+  REGISTRA_TRACE (op, inicio, fim, offset, tamanho, ret); \
+  return ret
+
+static int mede_getattr (const char *path, struct stat *stbuf) {
+  MEDE_CHAMADA (OP_GETATTR, 0, 0, getattr_brisafs (path, stbuf));
+}
+static int mede_readdir (const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi) {
+  MEDE_CHAMADA (OP_READDIR, offset, 0, readdir_brisafs (path, buf, filler, offset, fi));
+}
+static int mede_open (const char *path, struct fuse_file_info *fi) {
+  MEDE_CHAMADA (OP_OPEN, 0, 0, open_brisafs (path, fi));
+}
+static int mede_read (const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi) {
+  MEDE_CHAMADA (OP_READ, offset, size, read_brisafs (path, buf, size, offset, fi));
+}
+static int mede_read_buf (const char *path, struct fuse_bufvec **bufp, size_t size,
+                          off_t offset, struct fuse_file_info *fi) {
+  MEDE_CHAMADA (OP_READ, offset, size, read_buf_brisafs (path, bufp, size, offset, fi));
+}
+static int mede_write (const char *path, const char *buf, size_t size,
+                       off_t offset, struct fuse_file_info *fi) {
+  MEDE_ALTERACAO (OP_WRITE, offset, size, write_brisafs (path, buf, size, offset, fi));
+}
+static int mede_write_buf (const char *path, struct fuse_bufvec *buf, off_t offset,
+                           struct fuse_file_info *fi) {
+  MEDE_ALTERACAO (OP_WRITE, offset, fuse_buf_size (buf), write_buf_brisafs (path, buf, offset, fi));
+}
+static int mede_unlink (const char *path) {
+  MEDE_ALTERACAO (OP_UNLINK, 0, 0, unlink_brisafs (path));
+}
+static int mede_rmdir (const char *path) {
+  MEDE_ALTERACAO (OP_RMDIR, 0, 0, rmdir_brisafs (path));
+}
+static int mede_truncate (const char *path, off_t size) {
+  MEDE_ALTERACAO (OP_TRUNCATE, size, 0, truncate_brisafs (path, size));
+}
+static int mede_mknod (const char *path, mode_t mode, dev_t rdev) {
+  MEDE_ALTERACAO (OP_MKNOD, 0, 0, mknod_brisafs (path, mode, rdev));
+}
+static int mede_fsync (const char *path, int isdatasync, struct fuse_file_info *fi) {
+  MEDE_CHAMADA (OP_FSYNC, 0, 0, fsync_brisafs (path, isdatasync, fi));
+}
+static int mede_fallocate (const char *path, int mode, off_t offset, off_t length,
+                           struct fuse_file_info *fi) {
+  MEDE_ALTERACAO (OP_FALLOCATE, offset, length, fallocate_brisafs (path, mode, offset, length, fi));
+}
+static int mede_utimens (const char *path, const struct timespec ts[2]) {
+  MEDE_ALTERACAO (OP_UTIMENS, 0, 0, utimens_brisafs (path, ts));
+}
+static int mede_chown (const char *path, uid_t userowner, gid_t groupowner) {
+  MEDE_ALTERACAO (OP_CHOWN, 0, 0, chown_brisafs (path, userowner, groupowner));
+}
+static int mede_chmod (const char *path, mode_t mode) {
+  MEDE_ALTERACAO (OP_CHMOD, 0, 0, chmod_brisafs (path, mode));
+}
+static int mede_create (const char *path, mode_t mode, struct fuse_file_info *fi) {
+  MEDE_ALTERACAO (OP_CREATE, 0, 0, create_brisafs (path, mode, fi));
+}
+static int mede_mkdir (const char *path, mode_t type) {
+  MEDE_ALTERACAO (OP_MKDIR, 0, 0, mkdir_brisafs (path, type));
+}
+static int mede_release (const char *path, struct fuse_file_info *fi) {
+  MEDE_CHAMADA (OP_RELEASE, 0, 0, release_brisafs (path, fi));
+}
+// Devolve um offset, que não cabe no int de MEDE_FIM
+static off_t mede_lseek (const char *path, off_t offset, int whence,
+                         struct fuse_file_info *fi) {
+  uint64_t inicio = relogio_ns ();
+  TRACE_INODE (0);
+  off_t ret = lseek_brisafs (path, offset, whence, fi);
+  uint64_t fim = relogio_ns ();
+  registra_estatistica (OP_LSEEK, fim - inicio, ret < 0 ? (int) ret : 0);
+  REGISTRA_TRACE (OP_LSEEK, inicio, fim, offset, 0, ret < 0 ? (int) ret : 0);
+  return ret;
+}
+
+/* Desmontagem: tudo vai para o hdd1 no lugar e o journal fica vazio */
+static void destroy_brisafs(void *private_data) {
+  for (uint32_t id = 0; id < N_INODES; id++)
+    if (atrasados[id] != NULL)
+      descarrega_inode (id);
+  confirma_journal (1, 1);
 }
 
 /* Esta estrutura contém os ponteiros para as operações implementadas
    no FS */
 static struct fuse_operations fuse_brisafs = {
-                                              .create = create_brisafs,
-                                              .fsync = fsync_brisafs,
-                                              .getattr = getattr_brisafs,
-                                              .mknod = mknod_brisafs,
-                                              .open = open_brisafs,
-                                              .read = read_brisafs,
-                                              .readdir = readdir_brisafs,
-                                              .truncate	= truncate_brisafs,
-                                              .utimens = utimens_brisafs,
-                                              .write = write_brisafs,
-                                              .chown = chown_brisafs,
-                                              .release = release_brisafs,
-                                              .mkdir = mkdir_brisafs,
-                                              .unlink = unlink_brisafs,
-                                              .rmdir = rmdir_brisafs,
-                                              .chmod = chmod_brisafs
+                                              .create = mede_create,
+                                              .fsync = mede_fsync,
+                                              .getattr = mede_getattr,
+                                              .mknod = mede_mknod,
+                                              .open = mede_open,
+                                              .read = mede_read,
+                                              .read_buf = mede_read_buf,
+                                              .readdir = mede_readdir,
+                                              .truncate	= mede_truncate,
+                                              .fallocate = mede_fallocate,
+                                              .utimens = mede_utimens,
+                                              .write = mede_write,
+                                              .write_buf = mede_write_buf,
+                                              .chown = mede_chown,
+                                              .release = mede_release,
+                                              .mkdir = mede_mkdir,
+                                              .unlink = mede_unlink,
+                                              .rmdir = mede_rmdir,
+                                              .chmod = mede_chmod,
+                                              .destroy = destroy_brisafs
+};
+
+/* Interface de brisafs.h: cada função passa pela tabela acima, como faria
+   o FUSE. Um arquivo aberto é só o fuse_file_info da abertura e o
+   caminho, usado pelas operações que o recebem */
+struct brisafs_arquivo {
+  struct fuse_file_info fi;
+  char *path;
+};
+
+void brisafs_limita_cache (uint64_t bytes) {
+  opcoes.limite_cache = bytes;
+}
+
+// Cópia do nome da imagem montada, liberada na desmontagem
+static char *imagem_montada = NULL;
+
+int brisafs_monta (const char *imagem, int usa_mmap) {
+  if (imagem != NULL && (imagem_montada = strdup(imagem)) == NULL)
+    return -ENOMEM;
+  opcoes.imagem = imagem_montada;
+  opcoes.mmap = usa_mmap;
+  if (init_brisafs() < 0) {
+    libera_estado();
+    free(imagem_montada);
+    imagem_montada = NULL;
+    opcoes.imagem = NULL;
+    return -EIO;
+  }
+  return 0;
+}
+
+void brisafs_desmonta (void) {
+  fuse_brisafs.destroy (NULL);
+  libera_estado();
+  free(imagem_montada);
+  imagem_montada = NULL;
+  opcoes.imagem = NULL;
+}
+
+static int abre_arquivo (const char *path, mode_t mode, int flags, int criar,
+                         brisafs_arquivo **arquivo) {
+  brisafs_arquivo *a = calloc(1, sizeof(brisafs_arquivo));
+  if (a == NULL || (a->path = strdup(path)) == NULL) {
+    free(a);
+    return -ENOMEM;
+  }
+  a->fi.flags = flags;
+  int ret = criar ? fuse_brisafs.create (path, mode, &a->fi) : fuse_brisafs.open (path, &a->fi);
+  if (ret < 0) {
+    free(a->path);
+    free(a);
+    return ret;
+  }
+  *arquivo = a;
+  return 0;
+}
+
+int brisafs_cria (const char *path, mode_t mode, brisafs_arquivo **arquivo) {
+  return abre_arquivo (path, mode, O_RDWR | O_CREAT, 1, arquivo);
+}
+
+int brisafs_abre (const char *path, int flags, brisafs_arquivo **arquivo) {
+  return abre_arquivo (path, 0, flags, 0, arquivo);
+}
+
+int brisafs_le (brisafs_arquivo *arquivo, void *buf, size_t size, off_t offset) {
+  return fuse_brisafs.read (arquivo->path, buf, size, offset, &arquivo->fi);
+}
+
+int brisafs_escreve (brisafs_arquivo *arquivo, const void *buf, size_t size, off_t offset) {
+  return fuse_brisafs.write (arquivo->path, buf, size, offset, &arquivo->fi);
+}
+
+int brisafs_fsync (brisafs_arquivo *arquivo) {
+  return fuse_brisafs.fsync (arquivo->path, 0, &arquivo->fi);
+}
+
+int brisafs_fallocate (brisafs_arquivo *arquivo, int mode, off_t offset, off_t length) {
+  return fuse_brisafs.fallocate (arquivo->path, mode, offset, length, &arquivo->fi);
+}
+
+// O lseek fica fora da tabela, que é a do libfuse 2
+off_t brisafs_busca (brisafs_arquivo *arquivo, off_t offset, int whence) {
+  return mede_lseek (arquivo->path, offset, whence, &arquivo->fi);
+}
+
+int brisafs_fecha (brisafs_arquivo *arquivo) {
+  int ret = fuse_brisafs.release (arquivo->path, &arquivo->fi);
+  free(arquivo->path);
+  free(arquivo);
+  return ret;
+}
+
+int brisafs_stat (const char *path, struct stat *st) {
+  return fuse_brisafs.getattr (path, st);
+}
+
+// Repassa cada entrada de readdir_brisafs para a função de brisafs_lista
+typedef struct {
+  brisafs_entrada_t entrada;
+  void *contexto;
+} lista_entradas;
+
+static int preenche_lista (void *buf, const char *nome, const struct stat *st, off_t off) {
+  lista_entradas *l = buf;
+  l->entrada (l->contexto, nome);
+  return 0;
+}
+
+int brisafs_lista (const char *path, brisafs_entrada_t entrada, void *contexto) {
+  lista_entradas l = { entrada, contexto };
+  return fuse_brisafs.readdir (path, &l, preenche_lista, 0, NULL);
+}
+
+int brisafs_mkdir (const char *path, mode_t mode) {
+  return fuse_brisafs.mkdir (path, mode);
+}
+
+int brisafs_unlink (const char *path) {
+  return fuse_brisafs.unlink (path);
+}
+
+int brisafs_rmdir (const char *path) {
+  return fuse_brisafs.rmdir (path);
+}
+
+int brisafs_truncate (const char *path, off_t size) {
+  return fuse_brisafs.truncate (path, size);
+}
+
+int brisafs_mknod (const char *path, mode_t mode) {
+  return fuse_brisafs.mknod (path, mode, 0);
+}
+
+int brisafs_chmod (const char *path, mode_t mode) {
+  return fuse_brisafs.chmod (path, mode);
+}
+
+int brisafs_chown (const char *path, uid_t uid, gid_t gid) {
+  return fuse_brisafs.chown (path, uid, gid);
+}
+
+int brisafs_utimens (const char *path, const struct timespec ts[2]) {
+  return fuse_brisafs.utimens (path, ts);
+}
+
+#ifndef BRISAFS_BIBLIOTECA
+/* Gravação das operações (-o gravar=<arquivo>, veja brisafs_gravacao.h).
+   A tabela operacoes_gravadas, que o FUSE recebe no lugar de fuse_brisafs,
+   repassa cada chamada à de fuse_brisafs e grava um registro ao final */
+FILE *gravacao;
+pthread_mutex_t trava_gravacao = PTHREAD_MUTEX_INITIALIZER;
+uint64_t inicio_gravacao;
+
+int inicia_gravacao (const char *caminho) {
+  gravacao = fopen (caminho, "w");
+  if (gravacao == NULL)
+    return -errno;
+  setvbuf (gravacao, NULL, _IOFBF, 1 << 20);
+  cabecalho_gravacao c = { MAGICO_GRAVACAO, VERSAO_GRAVACAO, 0 };
+  if (fwrite (&c, sizeof(c), 1, gravacao) != 1)
+    return -EIO;
+  inicio_gravacao = relogio_ns ();
+  return 0;
+}
+
+void grava (uint32_t op, uint64_t inicio, const char *path, uint64_t arquivo,
+            uint64_t offset, uint64_t tamanho, uint32_t modo, int resultado) {
+  registro_gravacao r = {0};
+  r.instante_ns = inicio - inicio_gravacao;
+  r.latencia_ns = relogio_ns () - inicio;
+  r.offset = offset;
+  r.tamanho = tamanho;
+  r.arquivo = arquivo;
+  r.op = op;
+  r.modo = modo;
+  r.resultado = resultado;
+  r.len_path = path != NULL ? strnlen (path, UINT16_MAX) : 0;
+  pthread_mutex_lock (&trava_gravacao);
+  fwrite (&r, sizeof(r), 1, gravacao);
+  fwrite (path, 1, r.len_path, gravacao);
+  pthread_mutex_unlock (&trava_gravacao);
+}
+
+// O arquivo aberto é lido depois da chamada, que pode tê-lo criado
+#define GRAVA(op, path, arquivo, offset, tamanho, modo, chamada) \
+  uint64_t inicio = relogio_ns (); \
+  int ret = chamada; \
+  grava (op, inicio, path, arquivo, offset, tamanho, modo, ret); \
+  return ret
+
+#define FH(fi) ((fi) != NULL ? (fi)->fh : 0)
+
+static int grava_getattr (const char *path, struct stat *stbuf) {
+  GRAVA (OP_GETATTR, path, 0, 0, 0, 0, fuse_brisafs.getattr (path, stbuf));
+}
+static int grava_readdir (const char *path, void *buf, fuse_fill_dir_t filler,
+                          off_t offset, struct fuse_file_info *fi) {
+  GRAVA (OP_READDIR, path, FH(fi), offset, 0, 0,
+         fuse_brisafs.readdir (path, buf, filler, offset, fi));
+}
+static int grava_open (const char *path, struct fuse_file_info *fi) {
+  GRAVA (OP_OPEN, path, FH(fi), 0, 0, fi->flags, fuse_brisafs.open (path, fi));
+}
+static int grava_read (const char *path, char *buf, size_t size, off_t offset,
+                       struct fuse_file_info *fi) {
+  GRAVA (OP_READ, path, FH(fi), offset, size, 0,
+         fuse_brisafs.read (path, buf, size, offset, fi));
+}
+static int grava_read_buf (const char *path, struct fuse_bufvec **bufp, size_t size,
+                           off_t offset, struct fuse_file_info *fi) {
+  GRAVA (OP_READ, path, FH(fi), offset, size, 0,
+         fuse_brisafs.read_buf (path, bufp, size, offset, fi));
+}
+static int grava_write (const char *path, const char *buf, size_t size,
+                        off_t offset, struct fuse_file_info *fi) {
+  GRAVA (OP_WRITE, path, FH(fi), offset, size, 0,
+         fuse_brisafs.write (path, buf, size, offset, fi));
+}
+static int grava_write_buf (const char *path, struct fuse_bufvec *buf, off_t offset,
+                            struct fuse_file_info *fi) {
+  size_t size = fuse_buf_size (buf);
+  GRAVA (OP_WRITE, path, FH(fi), offset, size, 0,
+         fuse_brisafs.write_buf (path, buf, offset, fi));
+}
+static int grava_unlink (const char *path) {
+  GRAVA (OP_UNLINK, path, 0, 0, 0, 0, fuse_brisafs.unlink (path));
+}
+static int grava_rmdir (const char *path) {
+  GRAVA (OP_RMDIR, path, 0, 0, 0, 0, fuse_brisafs.rmdir (path));
+}
+static int grava_truncate (const char *path, off_t size) {
+  GRAVA (OP_TRUNCATE, path, 0, size, 0, 0, fuse_brisafs.truncate (path, size));
+}
+static int grava_mknod (const char *path, mode_t mode, dev_t rdev) {
+  GRAVA (OP_MKNOD, path, 0, 0, 0, mode, fuse_brisafs.mknod (path, mode, rdev));
+}
+static int grava_fsync (const char *path, int isdatasync, struct fuse_file_info *fi) {
+  GRAVA (OP_FSYNC, path, FH(fi), 0, 0, isdatasync, fuse_brisafs.fsync (path, isdatasync, fi));
+}
+static int grava_fallocate (const char *path, int mode, off_t offset, off_t length,
+                            struct fuse_file_info *fi) {
+  GRAVA (OP_FALLOCATE, path, FH(fi), offset, length, mode,
+         fuse_brisafs.fallocate (path, mode, offset, length, fi));
+}
+static int grava_utimens (const char *path, const struct timespec ts[2]) {
+  GRAVA (OP_UTIMENS, path, 0, 0, 0, 0, fuse_brisafs.utimens (path, ts));
+}
+static int grava_chown (const char *path, uid_t userowner, gid_t groupowner) {
+  GRAVA (OP_CHOWN, path, 0, userowner, groupowner, 0,
+         fuse_brisafs.chown (path, userowner, groupowner));
+}
+static int grava_chmod (const char *path, mode_t mode) {
+  GRAVA (OP_CHMOD, path, 0, 0, 0, mode, fuse_brisafs.chmod (path, mode));
+}
+static int grava_create (const char *path, mode_t mode, struct fuse_file_info *fi) {
+  GRAVA (OP_CREATE, path, FH(fi), 0, 0, mode, fuse_brisafs.create (path, mode, fi));
+}
+static int grava_mkdir (const char *path, mode_t type) {
+  GRAVA (OP_MKDIR, path, 0, 0, 0, type, fuse_brisafs.mkdir (path, type));
+}
+static int grava_release (const char *path, struct fuse_file_info *fi) {
+  uint64_t fh = FH(fi); // O release zera fi->fh
+  GRAVA (OP_RELEASE, path, fh, 0, 0, 0, fuse_brisafs.release (path, fi));
+}
+static void grava_destroy (void *private_data) {
+  fuse_brisafs.destroy (private_data);
+  fclose (gravacao);
+}
+
+static struct fuse_operations operacoes_gravadas = {
+                                              .create = grava_create,
+                                              .fsync = grava_fsync,
+                                              .getattr = grava_getattr,
+                                              .mknod = grava_mknod,
+                                              .open = grava_open,
+                                              .read = grava_read,
+                                              .read_buf = grava_read_buf,
+                                              .readdir = grava_readdir,
+                                              .truncate	= grava_truncate,
+                                              .fallocate = grava_fallocate,
+                                              .utimens = grava_utimens,
+                                              .write = grava_write,
+                                              .write_buf = grava_write_buf,
+                                              .chown = grava_chown,
+                                              .release = grava_release,
+                                              .mkdir = grava_mkdir,
+                                              .unlink = grava_unlink,
+                                              .rmdir = grava_rmdir,
+                                              .chmod = grava_chmod,
+                                              .destroy = grava_destroy
 };
 
 int main(int argc, char *argv[]) {
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+  if (fuse_opt_parse(&args, &opcoes, opcoes_spec, NULL) == -1)
+    return 1;
 
 	printf("Iniciando o BrisaFS...\n");
-	printf("\t Tamanho do bloco = %d bytes\n", TAM_BLOCO);
-  printf("\t Tamanho máximo de arquivo = %d bytes\n", MAX_FILE_SIZE);
+  if (init_brisafs() < 0)
+    return 1;
+
+  // A geometria só é conhecida depois de lido o cabeçalho da imagem
+  printf("\t Imagem: %s\n", opcoes.imagem);
+	printf("\t Tamanho do bloco = %u bytes\n", TAM_BLOCO);
+  printf("\t Tamanho máximo de arquivo = %lu bytes\n", MAX_FILE_SIZE);
   printf("\t Tamanho do inode: %lu bytes\n", sizeof(inode));
-  printf("\t Quantidade de inodes: %u\n", MIN_DATABLOCKS);
+  printf("\t Quantidade de inodes: %u\n", N_INODES);
   printf("\t Número máximo de inodes por superboco: %lu\n", MAX_FILES);
-  printf("\t Número de superbocos: %lu\n", N_SUPERBLOCKS);
-  printf("\t Quantidade de blocos no disco: %lu\n", MAX_BLOCOS);
-  printf("\t Tamanho do Disco: %lu bytes\n", TAM_BLOCO * MAX_BLOCOS);
+  printf("\t Número de superbocos: %u\n", N_SUPERBLOCKS);
+  printf("\t Quantidade de blocos no disco: %u\n", MAX_BLOCOS);
+  printf("\t Tamanho do Disco: %zu bytes\n", DISCO_OFFSET(MAX_BLOCOS));
 
-  init_brisafs();
+  if (opcoes.gravar != NULL) {
+    int erro = inicia_gravacao (opcoes.gravar);
+    if (erro < 0) {
+      fprintf(stderr, "Não foi possível gravar em %s: %s\n", opcoes.gravar, strerror(-erro));
+      return 1;
+    }
+    printf("\t Gravando as operações em %s\n", opcoes.gravar);
+  }
 
-  return fuse_main(argc, argv, &fuse_brisafs, NULL);
+  int ret = fuse_main(args.argc, args.argv,
+                      opcoes.gravar != NULL ? &operacoes_gravadas : &fuse_brisafs, NULL);
+  fuse_opt_free_args(&args);
+  return ret;
 }
+#endif
@@ -0,0 +1,270 @@
+/*
+ * brisareplay: repete sobre o núcleo do BrisaFS, dentro do próprio processo
+ * (brisafs.h), as operações gravadas por uma montagem com -o gravar=<arquivo>
+ * (veja brisafs_gravacao.h).
+ *
+ * Uso: brisareplay [-m] [-k] [-i imagem] [-r] [-v fator] gravacao
+ *   -m  monta a imagem com mmap
+ *   -k  usa a imagem existente, ex. uma cópia da imagem tirada antes da
+ *       gravação; sem ela a imagem é apagada e recriada
+ *   -i  imagem (padrão replay.img)
+ *   -r  respeita os intervalos da gravação entre o início das operações;
+ *       sem ela as operações são repetidas o mais rápido possível
+ *   -v  com -r, divide os intervalos pelo fator (ex. -v 2: duas vezes
+ *       mais rápido)
+ *
+ * As operações são repetidas em uma única thread, na ordem da gravação. O
+ * conteúdo escrito é um padrão fixo. Ao final é impressa uma linha por
+ * operação com a quantidade, quantas devolveram um resultado diferente do
+ * gravado e a latência média e percentis, em microssegundos, seguida do
+ * total.
+ *
+ * Compilação:
+ *   gcc -O2 -DBRISAFS_BIBLIOTECA -c -o brisafs.o brisafs_v2.c
+ *   gcc -O2 -o brisareplay brisareplay.c brisafs.o -lfuse -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "brisafs.h"
+#include "brisafs_trace.h"
+#include "brisafs_gravacao.h"
+
+#define N_BALDES 4096
+
+static void uso (const char *prog) {
+  fprintf (stderr, "Uso: %s [-m] [-k] [-i imagem] [-r] [-v fator] gravacao\n", prog);
+  exit (2);
+}
+
+static uint64_t relogio_ns (void) {
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1000000000u + t.tv_nsec;
+}
+
+/* Arquivos abertos, pelo fi->fh da gravação */
+typedef struct aberto {
+  uint64_t fh;
+  brisafs_arquivo *arquivo;
+  struct aberto *prox;
+} aberto;
+
+static aberto *abertos[N_BALDES];
+
+static aberto **balde (uint64_t fh) {
+  return &abertos[(fh >> 4) % N_BALDES];
+}
+
+static void guarda (uint64_t fh, brisafs_arquivo *arquivo) {
+  aberto *a = malloc (sizeof(aberto));
+  a->fh = fh;
+  a->arquivo = arquivo;
+  a->prox = *balde (fh);
+  *balde (fh) = a;
+}
+
+static brisafs_arquivo *procura (uint64_t fh, int remover) {
+  for (aberto **p = balde (fh); *p != NULL; p = &(*p)->prox) {
+    if ((*p)->fh == fh) {
+      aberto *a = *p;
+      brisafs_arquivo *arquivo = a->arquivo;
+      if (remover) {
+        *p = a->prox;
+        free (a);
+      }
+      return arquivo;
+    }
+  }
+  return NULL;
+}
+
+/* Latências de cada operação */
+typedef struct {
+  uint64_t n, divergentes, capacidade;
+  uint64_t *latencias;
+} estatistica;
+
+static estatistica estatisticas[N_OPS_TRACE];
+
+static void registra (uint32_t op, uint64_t latencia, int divergente) {
+  estatistica *e = &estatisticas[op];
+  if (e->n == e->capacidade) {
+    e->capacidade = e->capacidade > 0 ? 2 * e->capacidade : 1024;
+    e->latencias = realloc (e->latencias, e->capacidade * sizeof(uint64_t));
+  }
+  e->latencias[e->n++] = latencia;
+  e->divergentes += divergente;
+}
+
+static int ignora_entrada (void *contexto, const char *nome) {
+  return 0;
+}
+
+static char *dados;
+static size_t tam_dados;
+
+static void garante_dados (uint64_t tamanho) {
+  if (tamanho > tam_dados) {
+    free (dados);
+    tam_dados = tamanho;
+    dados = malloc (tam_dados);
+    memset (dados, 'r', tam_dados);
+  }
+}
+
+/* Executa uma operação gravada. Devolve o resultado, para ser comparado
+   com o gravado */
+static int repete (const registro_gravacao *r, const char *path) {
+  brisafs_arquivo *a = NULL, *temporario = NULL;
+  struct stat st;
+  int ret;
+
+  // Operações com um arquivo aberto que a gravação não mostrou abrindo
+  if (r->op == OP_READ || r->op == OP_WRITE || r->op == OP_FSYNC || r->op == OP_FALLOCATE) {
+    a = r->arquivo != 0 ? procura (r->arquivo, 0) : NULL;
+    if (a == NULL) {
+      ret = brisafs_abre (path, O_RDWR, &temporario);
+      if (ret < 0)
+        return ret;
+      a = temporario;
+    }
+  }
+
+  switch (r->op) {
+  case OP_GETATTR: ret = brisafs_stat (path, &st); break;
+  case OP_READDIR: ret = brisafs_lista (path, ignora_entrada, NULL); break;
+  case OP_OPEN:
+  case OP_CREATE:
+    ret = r->op == OP_OPEN ? brisafs_abre (path, r->modo, &a) : brisafs_cria (path, r->modo, &a);
+    if (ret == 0 && r->resultado == 0 && r->arquivo != 0)
+      guarda (r->arquivo, a);
+    else if (ret == 0)
+      brisafs_fecha (a);
+    break;
+  case OP_RELEASE:
+    a = procura (r->arquivo, 1);
+    ret = a != NULL ? brisafs_fecha (a) : 0;
+    break;
+  case OP_READ:
+    garante_dados (r->tamanho);
+    ret = brisafs_le (a, dados, r->tamanho, r->offset);
+    break;
+  case OP_WRITE:
+    garante_dados (r->tamanho);
+    ret = brisafs_escreve (a, dados, r->tamanho, r->offset);
+    break;
+  case OP_FSYNC: ret = brisafs_fsync (a); break;
+  case OP_FALLOCATE: ret = brisafs_fallocate (a, r->modo, r->offset, r->tamanho); break;
+  case OP_UNLINK: ret = brisafs_unlink (path); break;
+  case OP_RMDIR: ret = brisafs_rmdir (path); break;
+  case OP_MKDIR: ret = brisafs_mkdir (path, r->modo); break;
+  case OP_TRUNCATE: ret = brisafs_truncate (path, r->offset); break;
+  case OP_MKNOD: ret = brisafs_mknod (path, r->modo); break;
+  case OP_CHMOD: ret = brisafs_chmod (path, r->modo); break;
+  case OP_CHOWN: ret = brisafs_chown (path, r->offset, r->tamanho); break;
+  case OP_UTIMENS: ret = brisafs_utimens (path, NULL); break;
+  default: ret = r->resultado;
+  }
+
+  if (temporario != NULL)
+    brisafs_fecha (temporario);
+  return ret;
+}
+
+static int compara_u64 (const void *a, const void *b) {
+  uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentil (const uint64_t *v, uint64_t n, double p) {
+  return v[(uint64_t) (p * (n - 1) + 0.5)] / 1000.0;
+}
+
+int main (int argc, char *argv[]) {
+  const char *imagem = "replay.img";
+  int usa_mmap = 0, manter = 0, ritmo = 0, opt;
+  double fator = 1;
+
+  while ((opt = getopt (argc, argv, "mki:rv:")) != -1) {
+    switch (opt) {
+    case 'm': usa_mmap = 1; break;
+    case 'k': manter = 1; break;
+    case 'i': imagem = optarg; break;
+    case 'r': ritmo = 1; break;
+    case 'v': fator = atof (optarg); break;
+    default: uso (argv[0]);
+    }
+  }
+  if (optind != argc - 1 || fator <= 0)
+    uso (argv[0]);
+
+  FILE *f = fopen (argv[optind], "r");
+  if (f == NULL) {
+    fprintf (stderr, "Não foi possível abrir %s: %s\n", argv[optind], strerror (errno));
+    return 1;
+  }
+  cabecalho_gravacao c;
+  if (fread (&c, sizeof(c), 1, f) != 1 || c.magico != MAGICO_GRAVACAO ||
+      c.versao != VERSAO_GRAVACAO) {
+    fprintf (stderr, "%s não é uma gravação do BrisaFS\n", argv[optind]);
+    return 1;
+  }
+
+  if (!manter)
+    unlink (imagem);
+  if (brisafs_monta (imagem, usa_mmap) < 0)
+    return 1;
+
+  registro_gravacao r;
+  char path[UINT16_MAX + 1];
+  uint64_t inicio = relogio_ns (), total = 0;
+  while (fread (&r, sizeof(r), 1, f) == 1) {
+    if (fread (path, 1, r.len_path, f) != r.len_path)
+      break;
+    path[r.len_path] = '\0';
+    if (r.op == 0 || r.op >= N_OPS_TRACE)
+      continue;
+
+    if (ritmo) {
+      uint64_t alvo = inicio + (uint64_t) (r.instante_ns / fator);
+      uint64_t agora = relogio_ns ();
+      if (alvo > agora) {
+        struct timespec t = { (alvo - agora) / 1000000000u, (alvo - agora) % 1000000000u };
+        nanosleep (&t, NULL);
+      }
+    }
+    uint64_t ini = relogio_ns ();
+    int ret = repete (&r, path);
+    registra (r.op, relogio_ns () - ini, ret != r.resultado);
+    total++;
+  }
+  double segundos = (relogio_ns () - inicio) / 1e9;
+  fclose (f);
+
+  printf ("%-10s %10s %11s %9s %9s %9s\n", "op", "ops", "divergentes",
+          "media_us", "p50_us", "p99_us");
+  for (int op = 1; op < N_OPS_TRACE; op++) {
+    estatistica *e = &estatisticas[op];
+    if (e->n == 0)
+      continue;
+    uint64_t soma = 0;
+    for (uint64_t i = 0; i < e->n; i++)
+      soma += e->latencias[i];
+    qsort (e->latencias, e->n, sizeof(uint64_t), compara_u64);
+    printf ("%-10s %10lu %11lu %9.1f %9.1f %9.1f\n", nomes_ops_trace[op], e->n,
+            e->divergentes, soma / 1000.0 / e->n, percentil (e->latencias, e->n, 0.5),
+            percentil (e->latencias, e->n, 0.99));
+  }
+  printf ("total %lu operações em %.3f s (%.0f ops/s)\n", total, segundos,
+          total / segundos);
+
+  brisafs_desmonta ();
+  return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * brisatrace: drena os anéis de rastreamento de um BrisaFS compilado com
+ * -DBRISAFS_TRACE (veja brisafs_trace.h).
+ *
+ * Uso: brisatrace [-b] [-1] [arquivo]
+ *   -b  grava os eventos binários (evento_trace) na saída padrão em vez
+ *       de uma linha de texto por evento
+ *   -1  drena uma única vez e termina; sem ela, drena até receber SIGINT
+ *   arquivo  padrão ARQUIVO_TRACE, no diretório onde o BrisaFS foi iniciado
+ *
+ * Compilação: gcc -O2 -o brisatrace brisatrace.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "brisafs_trace.h"
+
+static volatile sig_atomic_t terminar = 0;
+
+static void para (int sinal) {
+  (void) sinal;
+  terminar = 1;
+}
+
+static void escreve_evento (const evento_trace *e, int binario) {
+  if (binario) {
+    fwrite (e, sizeof(evento_trace), 1, stdout);
+    return;
+  }
+  printf ("%lu %s %u %lu %u %u %d\n", e->instante_ns,
+          e->op < N_OPS_TRACE ? nomes_ops_trace[e->op] : "?", e->inode,
+          e->offset, e->tamanho, e->latencia_ns, e->resultado);
+}
+
+// Copia os eventos ainda não lidos de todos os anéis. Devolve quantos
+static uint64_t drena (arquivo_trace *t, int binario) {
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < t->n_aneis; i++) {
+    anel_trace *a = &t->aneis[i];
+    uint64_t escrita = __atomic_load_n (&a->escrita, __ATOMIC_ACQUIRE);
+    uint64_t leitura = a->leitura;
+    for (; leitura < escrita; leitura++, total++)
+      escreve_evento (&a->eventos[leitura % N_EVENTOS_TRACE], binario);
+    __atomic_store_n (&a->leitura, leitura, __ATOMIC_RELEASE);
+  }
+  return total;
+}
+
+int main (int argc, char *argv[]) {
+  int binario = 0, uma_vez = 0;
+  const char *caminho = ARQUIVO_TRACE;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp (argv[i], "-b") == 0)
+      binario = 1;
+    else if (strcmp (argv[i], "-1") == 0)
+      uma_vez = 1;
+    else
+      caminho = argv[i];
+  }
+
+  int fd = open (caminho, O_RDWR);
+  if (fd < 0) {
+    fprintf (stderr, "Não foi possível abrir %s: %s\n", caminho, strerror (errno));
+    return 1;
+  }
+  arquivo_trace *t = mmap (NULL, sizeof(arquivo_trace), PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+  close (fd);
+  if (t == MAP_FAILED || __atomic_load_n (&t->magico, __ATOMIC_ACQUIRE) != MAGICO_TRACE ||
+      t->versao != VERSAO_TRACE || t->n_aneis > N_ANEIS_TRACE ||
+      t->n_eventos != N_EVENTOS_TRACE) {
+    fprintf (stderr, "%s não é um arquivo de rastreamento do BrisaFS\n", caminho);
+    return 1;
+  }
+
+  signal (SIGINT, para);
+  signal (SIGTERM, para);
+  do {
+    if (drena (t, binario) == 0 && !uma_vez)
+      usleep (10000);
+    fflush (stdout);
+  } while (!uma_vez && !terminar);
+  drena (t, binario);
+
+  uint64_t perdidos = t->sem_anel;
+  for (uint32_t i = 0; i < t->n_aneis; i++)
+    perdidos += t->aneis[i].perdidos;
+  if (perdidos > 0)
+    fprintf (stderr, "%lu eventos perdidos\n", perdidos);
+  return 0;
+}
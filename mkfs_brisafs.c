@@ -0,0 +1,120 @@
+/*
+ * mkfs.brisafs: cria uma imagem do BrisaFS com a geometria escolhida
+ * (veja brisafs_disco.h).
+ *
+ * Uso: mkfs.brisafs [-b tam_bloco] [-s tamanho] [-i inodes] [-j blocos] imagem
+ *   -b  tamanho do bloco em bytes, potência de 2 entre 1K e 64K (padrão 4K)
+ *   -s  tamanho da imagem, com sufixo K, M, G ou T opcional; sem ele a
+ *       imagem fica com um bloco de dados por inode
+ *   -i  quantidade de inodes (padrão: um a cada 4 blocos, no máximo 2^20)
+ *   -j  blocos do journal (padrão: 4 MiB)
+ *
+ * A imagem é recriada como um arquivo esparso contendo só o cabeçalho. Os
+ * mapas de bits e o diretório raiz são formatados na primeira montagem,
+ * com -o imagem=<imagem>.
+ *
+ * Compilação: gcc -O2 -o mkfs.brisafs mkfs_brisafs.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "brisafs_disco.h"
+
+static void uso (const char *prog) {
+  fprintf (stderr, "Uso: %s [-b tam_bloco] [-s tamanho] [-i inodes] [-j blocos] imagem\n", prog);
+  exit (2);
+}
+
+// Lê um número com sufixo K, M, G ou T opcional. Devolve 0 se for inválido
+static uint64_t le_tamanho (const char *s) {
+  char *fim;
+  errno = 0;
+  uint64_t n = strtoull (s, &fim, 10);
+  if (errno != 0 || fim == s)
+    return 0;
+  switch (*fim) {
+  case 'T': case 't': n <<= 10; // fall through
+  case 'G': case 'g': n <<= 10; // fall through
+  case 'M': case 'm': n <<= 10; // fall through
+  case 'K': case 'k': n <<= 10; fim++; break;
+  }
+  return *fim == '\0' ? n : 0;
+}
+
+int main (int argc, char *argv[]) {
+  uint64_t tam_bloco = TAM_BLOCO_PADRAO, tamanho = 0, n_inodes = 0, journal = 0;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "b:s:i:j:")) != -1) {
+    uint64_t v = le_tamanho (optarg);
+    if (v == 0)
+      uso (argv[0]);
+    switch (opt) {
+    case 'b': tam_bloco = v; break;
+    case 's': tamanho = v; break;
+    case 'i': n_inodes = v; break;
+    case 'j': journal = v; break;
+    default: uso (argv[0]);
+    }
+  }
+  if (optind != argc - 1)
+    uso (argv[0]);
+  const char *caminho = argv[optind];
+
+  if (tam_bloco < TAM_BLOCO_MIN || tam_bloco > TAM_BLOCO_MAX ||
+      (tam_bloco & (tam_bloco - 1)) != 0) {
+    fprintf (stderr, "O tamanho do bloco deve ser uma potência de 2 entre %d e %d bytes\n",
+             TAM_BLOCO_MIN, TAM_BLOCO_MAX);
+    return 1;
+  }
+  if (n_inodes == 0) {
+    n_inodes = tamanho > 0 ? tamanho / tam_bloco / 4 : N_INODES_PADRAO;
+    if (n_inodes > N_INODES_MAX_PADRAO)
+      n_inodes = N_INODES_MAX_PADRAO;
+  }
+
+  cabecalho_disco c;
+  cabecalho_padrao (&c, tam_bloco, n_inodes);
+  if (journal > 0)
+    c.n_blocos_journal = journal;
+  if (tamanho > 0)
+    c.n_blocos = tamanho / tam_bloco;
+
+  geometria g;
+  int erro = calcula_geometria (&c, &g);
+  if (erro == -ENOSPC) {
+    fprintf (stderr, "A imagem precisa de pelo menos %u blocos para esta geometria\n",
+             g.inicio_dados + 2);
+    return 1;
+  } else if (erro < 0) {
+    fprintf (stderr, "Geometria inválida (%lu inodes, journal de %u blocos)\n",
+             c.n_inodes, c.n_blocos_journal);
+    return 1;
+  }
+
+  int fd = open (caminho, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf (stderr, "Não foi possível criar %s: %s\n", caminho, strerror (errno));
+    return 1;
+  }
+  // Blocos nunca escritos ficam como buracos (zeros) no arquivo
+  if (ftruncate (fd, (off_t) g.n_blocos * g.tam_bloco) < 0 ||
+      pwrite (fd, &c, sizeof(c), 0) != sizeof(c) || fsync (fd) < 0) {
+    fprintf (stderr, "Não foi possível gravar %s: %s\n", caminho, strerror (errno));
+    close (fd);
+    return 1;
+  }
+  close (fd);
+
+  printf ("%s: %u blocos de %u bytes (%lu bytes)\n", caminho, g.n_blocos, g.tam_bloco,
+          (uint64_t) g.n_blocos * g.tam_bloco);
+  printf ("\t %u inodes em %u blocos\n", g.n_inodes, g.n_superblocks);
+  printf ("\t journal de %u blocos\n", g.n_blocos_journal);
+  printf ("\t %u blocos de dados a partir do bloco %u\n", g.n_blocos - g.inicio_dados,
+          g.inicio_dados);
+  return 0;
+}